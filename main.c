@@ -1,23 +1,46 @@
+#define _GNU_SOURCE // syscall(2) for perf_event_open
+
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-// #define TRACE_EXECUTION
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 // === TYPES AND GLOBALS ===
 typedef size_t word_t;
 
-#define WORD_UNION \
-  union {          \
-    word_t word;   \
-    int integer;   \
-    float float_;  \
-    char *cstr;    \
+#define WORD_UNION                  \
+  union {                           \
+    word_t word;                    \
+    int integer;                    \
+    float float_;                   \
+    char *cstr;                     \
+    char small[sizeof(word_t)];     \
   }
 
 typedef WORD_UNION Word;
@@ -55,6 +78,24 @@ typedef enum {
   TOK_JZ,
   TOK_JNZ,
   TOK_DOT,
+  TOK_COLON,
+  TOK_SEMICOLON,
+  TOK_SNAPSHOT,
+  TOK_INCLUDE,
+  TOK_CONCAT,
+  TOK_LENGTH,
+  TOK_COMPARE,
+  TOK_SUBSTR,
+  TOK_TO_INT,
+  TOK_TO_FLOAT,
+  TOK_TO_STRING,
+  TOK_READ_INT,
+  TOK_READ_FLOAT,
+  TOK_READ_LINE,
+  TOK_END_OF_INPUT,
+  TOK_PAR_SUM,
+  TOK_PAR_MIN,
+  TOK_PAR_MAX,
 
   TOK_KW_COUNT,
 
@@ -64,6 +105,9 @@ typedef enum {
   TOK_STR,
   TOK_LABEL,
   TOK_LABEL_ADDR,
+  TOK_WORD,  // name of a definition
+  TOK_STORE, // !name
+  TOK_LOAD,  // @name
 
   TOK_COUNT
 } TokenType;
@@ -89,12 +133,22 @@ typedef struct {
   TokenType type;
 } Token;
 
+// Strings are counted, not terminated: len bytes in small when they fit, otherwise at cstr, which points into
+// the data of the program, the string arena of the vm or, for long substrings, into the string they come from
+#define STRING_INLINE_CAPACITY ((int)sizeof(word_t))
+#define STRINGS_CHUNK_SIZE (64 * 1024)
+
 typedef struct {
   ValueType type;
+  int len; // strings only
   WORD_UNION;
 } Value;
 
 #define STACK_CAPACITY 256
+#define RSTACK_CAPACITY 256 // return addresses
+#define SLOTS_CAPACITY 64    // named variables, !name and @name
+#define PROGRAM_CAPACITY 16384 // bytes of bytecode
+#define DATA_CAPACITY 4096     // bytes of string literals
 #define LABELS_CAPACITY 256
 
 typedef struct ArenaChunk {
@@ -106,41 +160,229 @@ typedef struct ArenaChunk {
 
 typedef struct {
   ArenaChunk *chunk;
+  ArenaChunk *tail; // the only chunk allocated from, the ones before it are full
 } Arena;
 
+// Every instruction once: its operand, stack effect (values popped, values pushed), control flow, group and
+// handler. The interpreters are stamped out of this table, see vm_exec_variant, and the passes over the bytecode
+// take what they do not model themselves from it. A handler runs with vm->ip already past the instruction and
+// `ip`, `operand`, `preemptive`, `yield` and `status` in scope; CHECK is only evaluated by the checked ones.
+typedef enum { OPERAND_NONE = 0,
+               OPERAND_INT,   // any width, also slots
+               OPERAND_FLOAT, // bit pattern of a float
+               OPERAND_DATA,  // offset of a string in the data
+               OPERAND_ADDR,  // label address, fixed width for the linker
+               OPERAND_LABEL, // defines a label, emits nothing
+               OPERAND_NATIVE, // index of a registry entry, fixed width for the linker
+               OPERAND_LOOP,   // LoopOperand, fixed width for the linker
+               OPERAND_COUNT } OperandKind;
+
+// Where execution goes after an instruction; every one but FLOW_NEXT ends a basic block
+typedef enum { FLOW_NEXT = 0, // the next instruction
+               FLOW_JUMP,     // a jump target, or the next instruction when a condition fails
+               FLOW_CALL,     // somewhere else, then back to the next instruction
+               FLOW_END,      // somewhere only known when it runs
+               FLOW_COUNT } InstrFlow;
+
+// What an instruction needs besides the stack and the slots. The register code and the batch lanes only run the
+// core instructions, the others keep a program on the stack interpreter.
+typedef enum { GROUP_CORE = 0,
+               GROUP_STRING, // strings built at run time
+               GROUP_INPUT,  // the input
+               GROUP_NATIVE, // a native of the host
+               GROUP_PAR,    // the par pool
+               GROUP_LAZY,   // the blocks of --lazy
+               GROUP_COUNT } InstrGroup;
+
+#define PUSH(value) (vm->stack[vm->sp++] = (value))
+#define POP() (vm->stack[--vm->sp])
+#define JUMP(addr)                            \
+  do {                                        \
+    yield = preemptive && (addr) <= ip;       \
+    vm->ip = (addr);                          \
+  } while (0)
+#define PAR(reduction)                                                                           \
+  do {                                                                                           \
+    Value bound = POP();                                                                         \
+    Value first = POP();                                                                         \
+    CHECK(first.type == VAL_INT && bound.type == VAL_INT);                                       \
+    PUSH(par_run(vm, ip, operand, reduction, first.integer, bound.integer));                     \
+  } while (0)
+#define BINOP(in_type, in_member, out_type, out_member, operator_)                                \
+  do {                                                                                           \
+    Value b = POP();                                                                             \
+    Value a = POP();                                                                             \
+    CHECK(a.type == in_type && b.type == in_type);                                               \
+    PUSH(((Value){.type = out_type, .out_member = a.in_member operator_ b.in_member}));           \
+  } while (0)
+
+// clang-format off
+#define INSTR_TABLE(X)                                                                                               \
+  X(INT,        "int",      INT,    0, 1, NEXT, CORE,   PUSH(((Value){.type = VAL_INT, .integer = operand}));)       \
+  X(FLOAT,      "float",    FLOAT,  0, 1, NEXT, CORE,   PUSH(((Value){.type = VAL_FLOAT, .integer = operand}));)     \
+  X(STRING,     "string",   DATA,   0, 1, NEXT, CORE,   PUSH(string_literal(vm->data, operand));)                    \
+  X(LABEL,      "label",    LABEL,  0, 0, NEXT, CORE,   CHECK(0 && "labels are resolved by the compiler");)          \
+  X(LABEL_ADDR, "addr",     ADDR,   0, 1, NEXT, CORE,   PUSH(((Value){.type = VAL_INT, .integer = operand}));)       \
+  X(ADD,        "+",        NONE,   2, 1, NEXT, CORE,   BINOP(VAL_INT, integer, VAL_INT, integer, +);)               \
+  X(SUB,        "-",        NONE,   2, 1, NEXT, CORE,   BINOP(VAL_INT, integer, VAL_INT, integer, -);)               \
+  X(MUL,        "*",        NONE,   2, 1, NEXT, CORE,   BINOP(VAL_INT, integer, VAL_INT, integer, *);)               \
+  X(DIV,        "/",        NONE,   2, 1, NEXT, CORE,   BINOP(VAL_INT, integer, VAL_INT, integer, /);)               \
+  X(MOD,        "%",        NONE,   2, 1, NEXT, CORE,   BINOP(VAL_INT, integer, VAL_INT, integer, %);)               \
+  X(ADDF,       "+.",       NONE,   2, 1, NEXT, CORE,   BINOP(VAL_FLOAT, float_, VAL_FLOAT, float_, +);)             \
+  X(SUBF,       "-.",       NONE,   2, 1, NEXT, CORE,   BINOP(VAL_FLOAT, float_, VAL_FLOAT, float_, -);)             \
+  X(MULF,       "*.",       NONE,   2, 1, NEXT, CORE,   BINOP(VAL_FLOAT, float_, VAL_FLOAT, float_, *);)             \
+  X(DIVF,       "/.",       NONE,   2, 1, NEXT, CORE,   BINOP(VAL_FLOAT, float_, VAL_FLOAT, float_, /);)             \
+  X(EQ,         "=",        NONE,   2, 1, NEXT, CORE,   BINOP(VAL_INT, integer, VAL_INT, integer, ==);)              \
+  X(NEQ,        "!=",       NONE,   2, 1, NEXT, CORE,   BINOP(VAL_INT, integer, VAL_INT, integer, !=);)              \
+  X(LT,         "<",        NONE,   2, 1, NEXT, CORE,   BINOP(VAL_INT, integer, VAL_INT, integer, <);)               \
+  X(LE,         "<=",       NONE,   2, 1, NEXT, CORE,   BINOP(VAL_INT, integer, VAL_INT, integer, <=);)              \
+  X(GT,         ">",        NONE,   2, 1, NEXT, CORE,   BINOP(VAL_INT, integer, VAL_INT, integer, >);)               \
+  X(GE,         ">=",       NONE,   2, 1, NEXT, CORE,   BINOP(VAL_INT, integer, VAL_INT, integer, >=);)              \
+  X(DUP,        "dup",      NONE,   1, 2, NEXT, CORE,   vm->stack[vm->sp] = vm->stack[vm->sp - 1]; vm->sp += 1;)     \
+  X(OVER,       "over",     NONE,   2, 3, NEXT, CORE,   vm->stack[vm->sp] = vm->stack[vm->sp - 2]; vm->sp += 1;)     \
+  X(SWAP,       "swap",     NONE,   2, 2, NEXT, CORE,   Value tmp = vm->stack[vm->sp - 1];                           \
+                                                        vm->stack[vm->sp - 1] = vm->stack[vm->sp - 2];               \
+                                                        vm->stack[vm->sp - 2] = tmp;)                                \
+  X(DROP,       "drop",     NONE,   1, 0, NEXT, CORE,   vm->sp -= 1;)                                                \
+  X(ROT,        "rot",      NONE,   3, 3, NEXT, CORE,   Value tmp = vm->stack[vm->sp - 3];                           \
+                                                        vm->stack[vm->sp - 3] = vm->stack[vm->sp - 2];               \
+                                                        vm->stack[vm->sp - 2] = vm->stack[vm->sp - 1];               \
+                                                        vm->stack[vm->sp - 1] = tmp;)                                \
+  X(JMP,        "jmp",      NONE,   1, 0, JUMP, CORE,   Value addr = POP();                                          \
+                                                        CHECK(addr.type == VAL_INT);                                 \
+                                                        JUMP(addr.integer);)                                         \
+  X(JZ,         "jz",       NONE,   2, 0, JUMP, CORE,   Value cond = POP();                                          \
+                                                        Value addr = POP();                                          \
+                                                        CHECK(cond.type == VAL_INT && addr.type == VAL_INT);         \
+                                                        if (cond.integer == 0) JUMP(addr.integer);)                  \
+  X(JNZ,        "jnz",      NONE,   2, 0, JUMP, CORE,   Value cond = POP();                                          \
+                                                        Value addr = POP();                                          \
+                                                        CHECK(cond.type == VAL_INT && addr.type == VAL_INT);         \
+                                                        if (cond.integer == 1) JUMP(addr.integer);)                  \
+  X(GOTO,       "goto",     ADDR,   0, 0, JUMP, LAZY,   JUMP(operand);)                                              \
+  X(CALL,       "call",     ADDR,   0, 0, CALL, CORE,   CHECK(vm->rsp < RSTACK_CAPACITY);                            \
+                                                        vm->rstack[vm->rsp++] = vm->ip;                              \
+                                                        vm->ip = operand;)                                           \
+  X(RET,        "ret",      NONE,   0, 0, END,  CORE,   CHECK(vm->rsp >= 1);                                         \
+                                                        vm->ip = vm->rstack[--vm->rsp];)                             \
+  X(STORE,      "store",    INT,    1, 0, NEXT, CORE,   CHECK(operand >= 0 && operand < SLOTS_CAPACITY);             \
+                                                        vm->slots[operand] = POP();)                                 \
+  X(LOAD,       "load",     INT,    0, 1, NEXT, CORE,   CHECK(operand >= 0 && operand < SLOTS_CAPACITY);             \
+                                                        PUSH(vm->slots[operand]);)                                   \
+  X(CONCAT,     "concat",   NONE,   2, 1, NEXT, STRING, Value b = POP();                                             \
+                                                        Value a = POP();                                             \
+                                                        CHECK(a.type == VAL_STR && b.type == VAL_STR);               \
+                                                        PUSH(string_concat(vm, a, b));)                              \
+  X(LENGTH,     "length",   NONE,   1, 1, NEXT, STRING, Value a = POP();                                             \
+                                                        CHECK(a.type == VAL_STR);                                    \
+                                                        PUSH(((Value){.type = VAL_INT, .integer = a.len}));)         \
+  X(COMPARE,    "compare",  NONE,   2, 1, NEXT, STRING, Value b = POP();                                             \
+                                                        Value a = POP();                                             \
+                                                        CHECK(a.type == VAL_STR && b.type == VAL_STR);               \
+                                                        int order = string_compare(a, b);                            \
+                                                        PUSH(((Value){.type = VAL_INT, .integer = order}));)         \
+  X(SUBSTR,     "substr",   NONE,   3, 1, NEXT, STRING, Value count = POP();                                         \
+                                                        Value start = POP();                                         \
+                                                        Value a = POP();                                             \
+                                                        CHECK(a.type == VAL_STR && start.type == VAL_INT);           \
+                                                        CHECK(count.type == VAL_INT);                                \
+                                                        PUSH(string_substr(vm, a, start.integer, count.integer));)   \
+  X(TO_INT,     "to-int",   NONE,   1, 1, NEXT, STRING, Value a = POP(); PUSH(value_to_int(a));)                     \
+  X(TO_FLOAT,   "to-float", NONE,   1, 1, NEXT, STRING, Value a = POP(); PUSH(value_to_float(a));)                   \
+  X(TO_STRING,  "to-string", NONE,  1, 1, NEXT, STRING, Value a = POP(); PUSH(value_to_string(vm, a));)              \
+  X(READ_INT,   "read-int", NONE,   0, 1, NEXT, INPUT,  PUSH(input_read_int(vm));)                                   \
+  X(READ_FLOAT, "read-float", NONE, 0, 1, NEXT, INPUT,  PUSH(input_read_float(vm));)                                 \
+  X(READ_LINE,  "read-line", NONE,  0, 1, NEXT, INPUT,  PUSH(input_read_line(vm));)                                  \
+  X(END_OF_INPUT, "eof",    NONE,   0, 1, NEXT, INPUT,  Value eof = {.type = VAL_INT, .integer = vm->input_end};     \
+                                                        PUSH(eof);)                                                  \
+  X(CALL_NATIVE, "native",  NATIVE, 0, 0, NEXT, NATIVE, const Native *native = &natives[operand];                    \
+                                                        CHECK(vm->sp >= native->pops);                               \
+                                                        int depth = vm->sp - native->pops + native->pushes;          \
+                                                        CHECK(depth <= STACK_CAPACITY);                              \
+                                                        native->fn(vm, vm->stack + vm->sp - native->pops);           \
+                                                        vm->sp += native->pushes - native->pops;)                    \
+  X(PAR_SUM,    "par-sum",  ADDR,   2, 1, NEXT, PAR,    PAR(REDUCE_SUM);)                                            \
+  X(PAR_MIN,    "par-min",  ADDR,   2, 1, NEXT, PAR,    PAR(REDUCE_MIN);)                                            \
+  X(PAR_MAX,    "par-max",  ADDR,   2, 1, NEXT, PAR,    PAR(REDUCE_MAX);)                                            \
+  X(LAZY,       "lazy",     INT,    0, 0, END,  LAZY,   CHECK(vm->lazy && operand < vm->lazy->blocks_count);         \
+                                                        vm->ip = lazy_enter(vm, ip, operand);                        \
+                                                        if (vm->ip < 0) {                                            \
+                                                          vm->ip = ip;                                               \
+                                                          status = VM_FAILED;                                        \
+                                                          yield = true;                                              \
+                                                        })                                                           \
+  X(LOOP,       "loop",     LOOP,   0, 0, JUMP, CORE,   LoopOperand l = loop_operand_read(vm->program + ip + 1);     \
+                                                        CHECK(l.slot >= 0 || vm->sp >= 1);                           \
+                                                        Value *counter = l.slot >= 0 ? &vm->slots[l.slot]            \
+                                                                                     : &vm->stack[vm->sp - 1];       \
+                                                        Value bound = {.type = VAL_INT, .integer = l.value};         \
+                                                        if (l.bound_slot >= 0) bound = vm->slots[l.bound_slot];      \
+                                                        CHECK(counter->type == VAL_INT && bound.type == VAL_INT);    \
+                                                        counter->integer += 1;                                       \
+                                                        if (counter->integer < bound.integer) JUMP(l.target);)       \
+  X(TRIPS,      "trips",    LOOP,   0, 0, NEXT, CORE,   LoopOperand l = loop_operand_read(vm->program + ip + 1);     \
+                                                        Value bound = {.type = VAL_INT, .integer = l.value};         \
+                                                        if (l.bound_slot >= 0) bound = vm->slots[l.bound_slot];      \
+                                                        CHECK(vm->slots[l.slot].type == VAL_INT);                    \
+                                                        CHECK(bound.type == VAL_INT);                                \
+                                                        int first = vm->slots[l.slot].integer;                       \
+                                                        vm->loop_first = first;                                      \
+                                                        vm->loop_trips = loop_trips(first, bound.integer);           \
+                                                        int last = loop_last(first, vm->loop_trips);                 \
+                                                        vm->slots[l.slot].integer = last;)                           \
+  X(SERIES,     "series",   LOOP,   0, 0, NEXT, CORE,   LoopOperand l = loop_operand_read(vm->program + ip + 1);     \
+                                                        CHECK(vm->slots[l.slot].type == VAL_INT);                    \
+                                                        int acc = vm->slots[l.slot].integer;                         \
+                                                        vm->slots[l.slot].integer = loop_series(acc,                 \
+                                                          vm->loop_first, vm->loop_trips, l.target, l.value);)       \
+  X(SNAPSHOT,   "snapshot", NONE,   0, 0, CALL, CORE,   Arena *s = &vm->strings;                                     \
+                                                        vm->strings_mark = s->tail ? s->tail->offset : 0;            \
+                                                        status = VM_SNAPSHOT;                                        \
+                                                        yield = true;)                                               \
+  X(DUMP,       ".",        NONE,   1, 0, NEXT, CORE,   value_print(POP());)                                         \
+  X(DONE,       "done",     NONE,   0, 0, END,  CORE,   vm->ip = ip; status = VM_HALTED; yield = true;)
+// clang-format on
+
+#define INSTR_ENUM(name, ...) INSTR_##name,
 typedef enum {
-  INSTR_INT,
-  INSTR_FLOAT,
-  INSTR_STRING,
-  INSTR_LABEL,
-  INSTR_LABEL_ADDR,
-  INSTR_ADD,
-  INSTR_SUB,
-  INSTR_MUL,
-  INSTR_DIV,
-  INSTR_MOD,
-  INSTR_ADDF,
-  INSTR_SUBF,
-  INSTR_MULF,
-  INSTR_DIVF,
-  INSTR_EQ,
-  INSTR_NEQ,
-  INSTR_LT,
-  INSTR_LE,
-  INSTR_GT,
-  INSTR_GE,
-  INSTR_DUP,
-  INSTR_OVER,
-  INSTR_SWAP,
-  INSTR_DROP,
-  INSTR_ROT,
-  INSTR_JMP,
-  INSTR_JZ,
-  INSTR_JNZ,
-  INSTR_DUMP,
-  INSTR_DONE,
+  INSTR_TABLE(INSTR_ENUM)
   INSTR_COUNT,
 } Instr;
+#undef INSTR_ENUM
+
+typedef struct {
+  const char *name;     // as printed in traces
+  const char *mnemonic; // as printed by vm_dump
+  OperandKind operand;
+  int pops, pushes;
+  InstrFlow flow;
+  InstrGroup group;
+} InstrInfo;
+
+#define INSTR_INFO(name, mnemonic, operand, pops, pushes, flow, group, ...) \
+  [INSTR_##name] = {"INSTR_" #name, mnemonic, OPERAND_##operand, pops, pushes, FLOW_##flow, GROUP_##group},
+const InstrInfo instr_info[INSTR_COUNT] = {INSTR_TABLE(INSTR_INFO)};
+#undef INSTR_INFO
+
+static_assert(GROUP_COUNT == 6, "Update InstrGroup is required");
+// Why a program with an instruction of the group does not run as register code or in batch lanes
+const char *instr_group_names[GROUP_COUNT] = {
+    [GROUP_CORE] = "core instruction",
+    [GROUP_STRING] = "string operation",
+    [GROUP_INPUT] = "input operation",
+    [GROUP_NATIVE] = "native call",
+    [GROUP_PAR] = "par loop",
+    [GROUP_LAZY] = "lazy block",
+};
+
+// Interpreters of the stack bytecode, chosen with --interpreter: fast has no checks, checked reports the
+// instruction that breaks an invariant and traced also prints every instruction with the stack after it.
+// --trace and --profile record through the traced one whatever the choice.
+typedef enum { INTERPRETER_FAST = 0,
+               INTERPRETER_CHECKED,
+               INTERPRETER_TRACED,
+               INTERPRETER_COUNT } Interpreter;
+Interpreter interpreter = INTERPRETER_CHECKED;
 
 typedef struct {
   SV name;
@@ -149,39 +391,798 @@ typedef struct {
 
 #define LABEL_ADDR_DUMMY 0xDEADBEEFll
 
+#define DEFINITIONS_CAPACITY 256
+#define INLINE_THRESHOLD 8 // definitions of up to this many tokens are inlined at every use
+
+typedef struct {
+  Token **items;
+  int count, capacity;
+} TokenList;
+
+// Large sources are split at line boundaries and lexed on several threads, each part into its own token arena
+#define LEX_PART_MIN_BYTES (1 << 20)
+
+typedef struct {
+  SV source;    // whole lines
+  Location loc; // line is the number of lines before the part
+  bool eof;     // the last part ends the token stream
+  bool ok;
+  Arena tokens;
+} LexPart;
+
+typedef struct {
+  SV name;
+  TokenList body;
+  Location end; // of the `;`, where the ret is
+  int addr;
+  bool inline_;
+} Definition;
+
+typedef struct {
+  Label unresolved_labels[LABELS_CAPACITY];
+  int ulc;
+  Label unresolved_calls[LABELS_CAPACITY]; // name of the definition and address of the operand
+  int ucc;
+  Definition defs[DEFINITIONS_CAPACITY];
+  int defs_count;
+  SV slots[SLOTS_CAPACITY]; // names of the variables, indexed by slot
+  int slots_count;
+  struct Module *module;     // receives the relocations and exports
+  struct LazyProgram *lazy;  // blocks of the main module left for when they are reached, with --lazy
+} Compiler;
+
+// Counted loop recognized by compile_loop
+typedef struct {
+  SV label;
+  SV counter; // variable, empty when the counter is on the stack
+  const Token *bound;
+} CountedLoop;
+
+// `acc += coefficient * var + constant` in the body of a counted loop, var being its counter
+#define LOOP_UPDATES_CAPACITY 16
+typedef struct {
+  SV acc, var;
+  int coefficient, constant;
+} LoopUpdate;
+int inline_threshold = INLINE_THRESHOLD;
+bool lazy_blocks = false; // --lazy
+
+// Every source file is a module, compiled on its own into relocatable code and linked into one program.
+// Labels and variables are module-scoped, definitions are visible from every module.
+#define MODULES_CAPACITY 256
+#define MODULE_CACHE_MAGIC "STEPMOD8"
+
+typedef enum { RELOC_CODE = 0, // code address inside the module
+               RELOC_DATA,     // offset of a string inside the module data
+               RELOC_SLOT,     // variable of the module
+               RELOC_CALL,     // address of a definition of another module, by name
+               RELOC_INCLUDE,  // entry of an included module, by path
+               RELOC_NATIVE,   // registry entry of a native, by name
+               RELOC_COUNT } RelocKind;
+
+typedef struct {
+  RelocKind kind;
+  int offset; // of the operand in the module code
+  SV name;    // RELOC_CALL, RELOC_INCLUDE and RELOC_NATIVE only
+  Location loc;
+} Reloc;
+
+typedef struct {
+  SV name;
+  int addr; // inside the module code
+} Export;
+
+typedef struct Module {
+  const char *path;     // canonical, identifies the module
+  const char *filename; // as included, for messages
+  bool is_main;         // ends with done instead of ret
+
+  uint8_t *code;
+  int code_size;
+  Location *locations; // of every code byte
+  char *data;
+  int data_size;
+  int slots_count;
+  Reloc *relocs;
+  int relocs_count, relocs_capacity;
+  Export *exports;
+  int exports_count, exports_capacity;
+  Arena strings; // names and paths the relocations and exports point to
+  Arena source;
+  Arena tokens;         // of the source, only kept under --watch for the next load to reuse
+  int64_t source_mtime; // of the file when it was loaded
+  int64_t source_size;
+
+  bool loaded, cached;
+  double read_time, tokenize_time, compile_time;
+  int tokens_bytes;
+  int tokens_lexed, tokens_reused;
+  int code_base, data_base, slots_base; // assigned by the linker
+  int link_state;                       // 0 unvisited, 1 in progress, 2 placed
+  struct LazyProgram *lazy;             // main module compiled with --lazy, handed to the vm by the linker
+} Module;
+
+// --lazy compiles the labeled blocks of the top-level code of the main module the first time they run. The label
+// of a block stands for a LAZY stub, which lexes and compiles the block at the end of the program and turns into
+// a GOTO to it. A block refers to other blocks through their stubs only, so its code is copied as it is into every
+// vm of the program that reaches it. Blocks that include a module are compiled up front, since only the linker
+// resolves them, and so are the code before the first label and the definitions.
+typedef struct {
+  SV label;
+  SV source;      // from the label up to the next one
+  Location loc;   // of the label
+  bool upfront;   // includes a module, lexed and compiled with the code before the first label
+  Token **tokens; // while the block is compiled
+  int tokens_count;
+  int stub;                 // address of the LAZY instruction
+  int addr;                 // of the compiled block, -1 until it is reached
+  uint8_t *code;            // of the block compiled late, for the vms that reach it after
+  Location *locations;      // of every code byte
+  int code_size;
+  char *data;               // strings of the block, at data_offset in the data
+  int data_offset, data_size;
+} LazyBlock;
+
+typedef struct LazyProgram {
+  Compiler *compiler; // of the main module, kept with its definitions
+  Arena tokens_arena; // of the code compiled up front, the definitions point into them
+  Arena source;       // of the main module, the blocks are lexed from it
+  Module scratch;     // takes the relocations of the blocks compiled late, only calls of other modules need one
+  LazyBlock *blocks;
+  int blocks_count, blocks_capacity;
+  int *blocks_table; // index of the block of a label, open addressing keyed by the label
+  int blocks_table_size;
+  Token *refs; // first use of every variable and label address in the blocks, resolved up front
+  int refs_count, refs_capacity;
+  Label *labels; // of the code compiled up front
+  int labels_count;
+  Label *exports; // words of the other modules at their linked address, open addressing keyed by the name
+  int exports_size;
+  Arena exports_names;
+  int code_end, data_end; // of the program, where the next block goes
+  int deferred;           // blocks left for when they are reached, not the ones compiled up front
+  int compiled;           // blocks compiled late, the tokens, source and compiler are freed when all are
+  double compile_time;    // seconds
+} LazyProgram;
+
+// A block to compile late, posted by the vm that reached it to the thread compiling the blocks of every program
+typedef struct {
+  LazyProgram *p;
+  LazyBlock *block;
+  bool done, ok;
+  bool overflow; // the block does not fit the program, its data or its labels
+} LazyJob;
+// NOTE: the compiler emits into the vm of its thread, which may be the one running, so it has a thread of its own
+pthread_mutex_t lazy_lock = PTHREAD_MUTEX_INITIALIZER; // also guards the programs and their blocks
+pthread_cond_t lazy_cond = PTHREAD_COND_INITIALIZER;   // a job was posted or finished
+LazyJob *lazy_job;                                     // NULL when the compiler thread is idle
+bool lazy_compiler_started;
+
+// Modules waiting to be compiled are handed out to jobs threads; includes are queued as they are found
+typedef struct {
+  Module *modules[MODULES_CAPACITY];
+  int count;
+  int next;    // first module not handed out yet
+  int pending; // handed out and not finished
+  bool failed;
+  int64_t compiler_mtime; // of the step executable, part of the cache key
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ModuleLoader;
+
+// NOTE: a cached module is only used when every field matches, bytecode layout changes come with a new executable
+typedef struct {
+  char magic[sizeof(MODULE_CACHE_MAGIC) - 1];
+  int64_t compiler_mtime;
+  int64_t source_mtime; // nanoseconds
+  int64_t source_size;
+  int32_t inline_threshold;
+  int32_t path_len; // the canonical path follows, guards against hash collisions
+} ModuleCacheHeader;
+int module_jobs = 0;                                    // front end threads, 0 means cores
+const char *module_cache_dir = NULL; // --module-cache, NULL compiles every module from source
+
+// --watch reruns the program whenever one of its files changes, see watch_program
+#define WATCH_SETTLE_MS 20 // quiet time after a change before rebuilding, editors write files in several steps
+bool watching = false;
+
+// Bytecode is variable-length: a 1-byte opcode whose low 6 bits are the Instr and high 2 bits the log2 of
+// the operand width (1, 2, 4 or 8 bytes), followed by the operand if the instruction has one
+#define OPCODE(instr, width_log2) ((uint8_t)((instr) | ((width_log2) << 6)))
+#define OPCODE_INSTR(opcode) ((Instr)((opcode) & 0x3F))
+#define OPCODE_WIDTH(opcode) (1 << ((opcode) >> 6))
+static_assert(INSTR_COUNT <= 0x40, "Instr does not fit the opcode byte anymore");
+
+// label addresses are byte offsets, reserved with a fixed width so that they can be back-patched
+#define LABEL_ADDR_WIDTH_LOG2 1
+#define LABEL_ADDR_WIDTH (1 << LABEL_ADDR_WIDTH_LOG2)
+static_assert(PROGRAM_CAPACITY <= 1 << (8 * LABEL_ADDR_WIDTH - 1), "Label addresses do not fit their operand");
+
+#define DATA_OFFSET_WIDTH_LOG2 1
+#define DATA_OFFSET_WIDTH (1 << DATA_OFFSET_WIDTH_LOG2)
+static_assert(DATA_CAPACITY <= 1 << (8 * DATA_OFFSET_WIDTH - 1), "Data offsets do not fit their operand");
+#define NATIVE_WIDTH_LOG2 0
+#define NATIVE_WIDTH (1 << NATIVE_WIDTH_LOG2)
+
+// Operand of the counted loop instructions, 8 bytes: target (2, at the start so that it is relocated like a label
+// address), slot (1), bound_slot (1) and value (4).
+//   LOOP:   jumps to target while the counter, in slot or on the top of the stack when slot is -1, stays below the
+//           bound, in bound_slot or the constant value when bound_slot is -1
+//   TRIPS:  counter and bound the same way
+//   SERIES: coefficient in target, accumulator in slot, constant in value
+typedef struct {
+  int target, slot, bound_slot, value;
+} LoopOperand;
+#define LOOP_OPERAND_WIDTH_LOG2 3
+#define LOOP_OPERAND_WIDTH (1 << LOOP_OPERAND_WIDTH_LOG2)
+// NOTE: slot operands are always a single byte, so relocating them never changes the code size
+static_assert(SLOTS_CAPACITY <= 0x80, "Slots do not fit a 1 byte operand");
+
+// Binary execution trace: one compact record per executed instruction in a per-VM ring buffer
+#define TRACE_MAGIC "STEPTRC1"
+#define TRACE_DEFAULT_RECORDS 16384 // must be a power of 2
+
+typedef struct {
+  int32_t ip;
+  uint8_t instr;
+  uint8_t top_type; // VAL_COUNT when the stack is empty
+  uint16_t sp;
+  word_t top; // top of the stack the instruction starts with
+} TraceRecord;
+
+typedef struct {
+  TraceRecord *records;
+  uint32_t mask;
+  uint64_t written;
+  const char *filename; // source of the traced program, used by the decoder to find locations
+} Trace;
+
+// Register IR (--registers): the basic blocks of the linked program as three-address code. Registers are stack
+// slots relative to the stack pointer at the start of the block, its base, so a block means the same at any depth.
+// dup, over, swap, rot and drop only rename registers during the translation, constants become immediates.
+#define REG_TEMP 0x2000 // scratch registers are numbered from here until their block is translated
+
+typedef enum {
+  REG_MOV = 0,
+  REG_LOADK,
+  REG_LOAD,
+  REG_STORE,
+  REG_DUMP,
+  REG_TRIPS,  // counter slot in target, bound in a
+  REG_SERIES, // accumulator slot in target, coefficient in next, constant in k
+  // binary operations, in the order of Instr
+  REG_ADD, REG_SUB, REG_MUL, REG_DIV, REG_MOD,
+  REG_ADDF, REG_SUBF, REG_MULF, REG_DIVF,
+  REG_EQ, REG_NEQ, REG_LT, REG_LE, REG_GT, REG_GE,
+  // the same with an immediate right operand
+  REG_ADDK, REG_SUBK, REG_MULK, REG_DIVK, REG_MODK,
+  REG_ADDFK, REG_SUBFK, REG_MULFK, REG_DIVFK,
+  REG_EQK, REG_NEQK, REG_LTK, REG_LEK, REG_GTK, REG_GEK,
+  // terminators
+  REG_JMP,
+  REG_JZ,
+  REG_JNZ,
+  REG_CALL,
+  REG_RET,
+  REG_SNAPSHOT,
+  REG_DONE,
+
+  REG_OP_COUNT,
+} RegOp;
+
+typedef struct {
+  uint8_t op;      // RegOp
+  int16_t d, a, b; // registers
+  int32_t target;  // block of jumps and calls, slot of loads and stores, address of done
+  int32_t next;    // block after a conditional jump, a call or a snapshot, coefficient of series
+  int32_t height;  // terminators: stack height at the end of the block, relative to its base
+  int32_t cost;    // terminators: instructions of the block, charged to the budget
+  Value k;         // immediate operand
+} RegInstr;
+
+typedef struct {
+  int addr;      // in the bytecode
+  int first;     // first instruction
+  int low, high; // registers the block uses, checked against the stack when entering it
+} RegBlock;
+
+typedef struct {
+  RegInstr *code;
+  int count, capacity;
+  RegBlock *blocks;
+  int blocks_count;
+  int block_of[PROGRAM_CAPACITY]; // block starting at every bytecode address, -1 inside blocks
+  char data[DATA_CAPACITY];       // strings of the immediates, the vm the program was linked into is reused
+} RegProgram;
+
+// Abstract stack entry of the translation: a register or a constant
+typedef struct {
+  bool is_const;
+  int reg;
+  Value k;
+} RegOperand;
+
+typedef struct {
+  RegProgram *p;
+  RegOperand stack[2 * STACK_CAPACITY]; // positions relative to the base, offset by STACK_CAPACITY
+  int height, low;
+  int temp_refs[2 * STACK_CAPACITY]; // abstract stack entries using every scratch register
+  int temps;                         // scratch registers of the block so far
+} RegTranslator;
+bool use_registers = false;
+
+// Control-flow graph of the linked program. Before running, its basic blocks are laid out again without the
+// unreachable ones, following the hottest successor of every block so that the hot path falls through.
+typedef struct {
+  int addr, end;    // bytecode range of the block
+  int last;         // address of its last instruction
+  int taken;        // block the jump ending it goes to, -1 when none
+  int fall;         // block execution continues with after the last instruction, -1 when none
+  int target_addr;  // LABEL_ADDR pushing the jump target, -1 when the value has other uses
+  bool boolean;     // the condition of the jump is 0 or 1, so jz and jnz can be swapped
+  bool reachable;
+  bool placed;
+} CfgBlock;
+
+typedef struct {
+  CfgBlock *blocks;
+  int count;
+  int *block_of; // block starting at every bytecode address of the program, -1 inside blocks
+} Cfg;
+
+// Abstract stack entry while finding the jump targets of a block
 typedef struct {
-  Word program[STACK_CAPACITY];
+  int label;    // label address, -1 for any other value
+  int producer; // LABEL_ADDR that pushed it, -1 when copied
+  bool boolean;
+} CfgValue;
+bool use_layout = true;
+
+// Execution counts of a --profile run per bytecode address, used by the layout of the next runs
+#define PROFILE_MAGIC "STEPPRF1"
+
+typedef struct {
+  uint64_t program_hash;
+  uint64_t executed[PROGRAM_CAPACITY];
+  uint64_t taken[PROGRAM_CAPACITY]; // jumps only
+} Profile;
+const char *profile_path = NULL, *profile_use_path = NULL;
+
+// What read-int, read-float and read-line parse: the file of --input or stdin, opened by the first read of any vm.
+// A regular file is mapped whole. Anything else is read as the reads need it, into address space reserved up front,
+// so what was read never moves: the strings read-line returns are views of it and every vm reads it from its own
+// position.
+#define INPUT_CHUNK_SIZE (64 * 1024) // read at a time from an input that cannot be mapped
+#define INPUT_RESERVE (1l << 36)     // address space for it, halved until the system grants it
+
+typedef struct {
+  char *data;
+  atomic_long len; // read so far, only grows; everything for a mapped input
+  bool mapped;     // len never changes
+  bool ended;      // nothing left to read
+  int fd;          // read from while not ended
+  long reserved;   // bytes of address space at data
+} Input;
+const char *input_path = NULL; // NULL reads stdin
+Input input;
+bool input_failed;
+pthread_once_t input_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER; // taken to read more of an input that is not mapped
+
+// How much of the input a read needs from its position on, see input_fill
+typedef enum { INPUT_FIELD = 0,
+               INPUT_LINE,
+               INPUT_ALL } InputNeed;
+
+typedef struct {
+  uint8_t program[PROGRAM_CAPACITY];
   int ip;
+  int program_size; // bytes linked, the blocks --lazy compiles late go after them
 
   Value stack[STACK_CAPACITY];
   int sp;
 
-  char data[STACK_CAPACITY];
+  int rstack[RSTACK_CAPACITY];
+  int rsp;
+
+  Value slots[SLOTS_CAPACITY];
+
+  char data[DATA_CAPACITY];
   int data_offset;
 
   Label labels[LABELS_CAPACITY];
   int labels_count;
+  bool overflow; // an instruction did not fit the program, data or labels, the compile fails
+
+  Arena strings;             // created by the first string operation, freed by vm_reset
+  int strings_mark;          // offset in strings.tail at the last snapshot, later strings die on vm_restore
+  int loop_first;            // counter of the first iteration of the last TRIPS, for the SERIES after it
+  long long loop_trips;      // iterations of the last TRIPS
+  const Input *input;        // NULL until the first read
+  long input_pos;            // next byte of the input to read
+  long input_records;        // fields and lines read since the last vm_reset
+  bool input_end;            // a read found nothing left, pushed by eof
+  long instr_count;          // instructions executed since the last vm_reset
+  Trace *trace;              // NULL when tracing is off
+  Profile *profile;          // NULL when not profiling
+  const RegProgram *regs;    // NULL runs the bytecode on the stack interpreter
+  LazyProgram *lazy;         // NULL unless the program was compiled with --lazy, shared by copies of the vm
 } VM;
-VM vm;
+// NOTE: the front end compiles modules on several threads, each into its own vm and token arena
+_Thread_local VM vm;
+
+// Operation implemented by the host: reads its arguments from args, the deepest first, and writes its results
+// over them. CALL_NATIVE has already checked that the stack holds them.
+typedef void (*NativeFn)(VM *vm, Value *args);
+
+typedef struct {
+  SV name;
+  int pops, pushes;
+  NativeFn fn;
+} Native;
+
+// Words the compiler resolves to CALL_NATIVE, whose operand is the index of the entry.
+// NOTE: not its address, the program would differ from run to run under ASLR and so would its profile hash
+#define NATIVES_CAPACITY 64
+static_assert(NATIVES_CAPACITY <= 1 << (8 * NATIVE_WIDTH - 1), "Native indices do not fit their operand");
+// NOTE: registered before anything is compiled and only read afterwards, also by the front end threads
+Native natives[NATIVES_CAPACITY];
+int natives_count;
+
+// source location of every program word of the global vm, filled by compile and by the linker. PROGRAM_CAPACITY
+// entries, allocated by the compile job running on the thread or by the linker for its program, NULL otherwise
+_Thread_local Location *debug_locations;
+
+// Figures reported by --stats
+typedef enum { STATS_OFF = 0,
+               STATS_TEXT,
+               STATS_JSON,
+               STATS_COUNT } StatsFormat;
+
+typedef enum { COUNTER_CYCLES = 0,
+               COUNTER_INSTRUCTIONS,
+               COUNTER_BRANCH_MISSES,
+               COUNTER_CACHE_MISSES,
+               COUNTER_COUNT } Counter;
+
+typedef struct {
+  double read_time, tokenize_time, compile_time, run_time; // seconds
+  double startup_time; // from loading the program to its first instruction, seconds
+  int program_bytes;
+  int tokens_bytes;
+  int data_bytes;
+  int strings_bytes, strings_chunks; // built by string operations, left when the program halted
+  long input_bytes, input_records;
+  long instructions;
+  int max_sp;
+  int modules, modules_cached;
+  int lazy_blocks, lazy_compiled; // --lazy blocks and how many of them were reached
+  double lazy_time;               // compiling them, seconds
+  long max_rss;                   // kilobytes
+  bool counters_available; // perf_event_open may be missing or forbidden
+  uint64_t counters[COUNTER_COUNT];
+} Stats;
+Stats stats;
+
+Trace *traces; // every traced VM, dumped together on exit or crash
+int traces_count;
+int trace_fd = -1;
+
+typedef enum { VM_HALTED = 0,
+               VM_YIELDED,
+               VM_SNAPSHOT, // reached a snapshot point, resuming continues after it
+               VM_FAILED,   // stopped on an error it reported, a lazy block that could not be compiled
+               VM_STATUS_COUNT } VMStatus;
+
+#define VM_BUDGET_UNLIMITED (-1l)
+
+// How --requests starts every request
+typedef enum { REQUEST_COLD = 0, // load and run the whole program, prelude included
+               REQUEST_RESTORE,  // restore the VM from an in-process snapshot
+               REQUEST_FORK,     // fork() the snapshotted process, sharing its pages copy-on-write
+               REQUEST_MODE_COUNT } RequestMode;
+
+// Green-thread scheduler: many VMs multiplexed over a fixed pool of worker threads
+// NOTE: a read of the input blocks the worker running the VM, a slice is not cut short while it waits
+#define SCHED_DEFAULT_BUDGET 1024
+#define SCHED_STEAL_BATCH 32
+
+typedef struct {
+  VM *vm;
+  const char *name;
+  long slices;
+  double ready_since; // when the task was last put on a run queue
+  double total_wait, max_wait;
+  double finished;
+  bool failed; // stopped on an error instead of halting
+} Task;
+
+typedef struct {
+  pthread_mutex_t lock;
+  Task **tasks; // ring buffer
+  int capacity;
+  int head, count;
+} RunQueue;
+
+typedef struct Scheduler Scheduler;
+
+typedef struct {
+  Scheduler *sched;
+  int id;
+  pthread_t thread;
+  RunQueue queue;
+  long slices, instructions, steals;
+} Worker;
+
+struct Scheduler {
+  Worker *workers;
+  int workers_count;
+  Task *tasks;
+  int tasks_count;
+  long budget;
+  atomic_int live;   // tasks that have not halted yet
+  atomic_int queued; // tasks waiting in the run queues
+  // NOTE: a worker finding nothing to run or steal sleeps on wake until a task is queued or the last one halts
+  atomic_int sleeping;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t wake;
+  double started;
+};
+
+// Parallel loops: `first bound par-sum word` runs the definition word once for every i in [first, bound), i on
+// its stack, and combines the values it leaves. The iterations are split into chunks that a pool of threads
+// runs, each on a private copy of the vm; partial results are combined in chunk order.
+typedef enum { REDUCE_SUM = 0,
+               REDUCE_MIN,
+               REDUCE_MAX,
+               REDUCE_COUNT } Reduction;
+
+#define PAR_CHUNKS_PER_THREAD 8 // so that a slow thread holds up the others for a fraction of its share
+#define PAR_MIN_CHUNK 1024      // iterations not worth handing to another thread
+
+typedef struct {
+  const VM *vm; // program, data and slots every copy starts from
+  int ip;       // of the par instruction, for errors
+  int addr;     // of the body
+  int halt;     // address of a DONE the body returns to
+  Reduction reduction;
+  int first;
+  long long trips;
+  int chunks_count;
+  atomic_int next_chunk;
+  Value *partials; // result of every chunk
+  atomic_long instr_count;
+} ParJob;
+
+typedef struct {
+  pthread_mutex_t busy; // held by the par loop using the threads, the others run on their own
+  pthread_mutex_t lock;
+  pthread_cond_t posted, finished;
+  ParJob *job;
+  long generation; // of the last job posted, every thread joins each one once
+  int working;     // threads that have not left the last job yet
+  int threads_count;
+  bool started; // by the first par loop, guarded by lock
+} ParPool;
+int par_threads = 0; // --par-threads, 0 is one per core
+ParPool par_pool = {.busy = PTHREAD_MUTEX_INITIALIZER, .lock = PTHREAD_MUTEX_INITIALIZER,
+                    .posted = PTHREAD_COND_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER};
+
+// Batch mode: one program run in lockstep over many input records, one record per lane.
+// The stack is stored as structure-of-arrays so that every handler is a loop over lanes.
+#define BATCH_LANES 64
+
+typedef union {
+  int integer;
+  float float_; // strings are stored as offsets into vm.data in integer
+} BatchWord;
+
+// Lanes that share ip and stack depth; lanes that branch elsewhere are split off into a new group
+typedef struct {
+  int ip, sp;
+  int lanes_count;
+  int records[BATCH_LANES]; // input record every lane works on
+  int rstack[RSTACK_CAPACITY];
+  int rsp;
+  ValueType slot_types[SLOTS_CAPACITY];
+  BatchWord slots[SLOTS_CAPACITY][BATCH_LANES];
+  ValueType types[STACK_CAPACITY];
+  BatchWord stack[STACK_CAPACITY][BATCH_LANES];
+} BatchGroup;
+
+typedef struct {
+  const VM *vm;
+  BatchGroup *pool[BATCH_LANES]; // a chunk never splits into more groups than it has lanes
+  int pool_count;
+  BatchGroup *pending[BATCH_LANES];
+  int pending_count;
+  BatchWord *results;      // top of the stack of every record when its lane halted
+  ValueType *results_types; // of every result, lanes may end with different types
+} Batch;
 
 // === FORWARD DECLARATIONS ===
+bool vm_reserve(int code, int data);
 void vm_push_instr(Instr instr, Word arg);
-bool vm_run();
+int operand_width_log2(long long value);
+static inline long long operand_read(const uint8_t *code, int width);
+void operand_write(uint8_t *code, long long value, int width);
+static inline LoopOperand loop_operand_read(const uint8_t *code);
+void loop_operand_write(uint8_t *code, LoopOperand loop);
+long long loop_trips(int first, int bound);
+int loop_last(int first, long long trips);
+int loop_series(int acc, int first, long long trips, int coefficient, int constant);
+VMStatus vm_run(VM *vm, long budget);
+bool vm_finish(VM *vm);
+VMStatus vm_exec(VM *vm, long budget);
+static inline VMStatus vm_exec_variant(VM *vm, long budget, const bool checked, const bool traced);
+VMStatus vm_exec_fast(VM *vm, long budget);
+VMStatus vm_exec_checked(VM *vm, long budget);
+VMStatus vm_exec_traced(VM *vm, long budget);
+void vm_check_failed(const VM *vm, int ip, Instr instr, const char *check);
+void vm_trace_before(VM *vm, int ip, Instr instr);
+void vm_trace_after(VM *vm, int ip, Instr instr);
+void vm_reset(VM *vm);
+void vm_restore(VM *vm, const VM *snapshot);
+bool serve_requests(const char *filename, int requests, RequestMode mode, StatsFormat stats_format);
+int vm_max_sp(const VM *vm);
+int instr_size(uint8_t opcode);
+static inline bool instr_has_target(Instr instr);
+void program_leaders(const VM *vm, bool *leader);
+bool cfg_build(const VM *vm, Cfg *cfg);
+bool program_layout(VM *vm, const Profile *profile);
+Profile *profile_create(const VM *vm);
+bool profile_write(const Profile *profile, const char *path);
+bool profile_read(const char *path, const VM *vm, Profile **profile);
+RegInstr *reg_emit(RegTranslator *t, RegOp op);
+RegOperand *reg_at(RegTranslator *t, int position);
+void reg_push(RegTranslator *t, RegOperand operand);
+RegOperand reg_pop(RegTranslator *t);
+void reg_release(RegTranslator *t, RegOperand operand);
+RegOperand reg_temp(RegTranslator *t);
+RegOperand reg_in_temp(RegTranslator *t, RegOperand operand, bool entry_too);
+void reg_binop(RegTranslator *t, Instr instr);
+RegOperand reg_load(RegTranslator *t, int slot);
+void reg_use(RegTranslator *t, RegOp op, int slot);
+void reg_flush(RegTranslator *t);
+RegProgram *regs_translate(const VM *vm);
+void regs_free(RegProgram *p);
+VMStatus vm_exec_regs(VM *vm, long budget);
+void traces_init(int count, int records, const char *path);
+Trace *trace_attach(VM *vm, const char *filename);
+void traces_dump(void);
+void trace_crash_handler(int sig);
+bool trace_decode(const char *path);
 ArenaChunk *arena_chunk_create(int chunk_size);
 Arena arena_create(int chunk_size);
 void arena_destroy(Arena *a);
 void *arena_alloc(Arena *a, int size);
+void arena_release(Arena *a, ArenaChunk *tail, int offset);
 void tokens_init(void);
 void tokens_free(void);
 Token *make_token(const Token *source);
 Token *next_token(void);
 void token_print(const Token *token);
 void value_print(Value value);
-void vm_dump(void);
-void vm_dump_stack(void);
+static inline const char *value_chars(const Value *value);
+Value string_literal(const char *data, int offset);
+char *strings_alloc(VM *vm, int size);
+Value string_make(VM *vm, const char *chars, int len);
+Value string_concat(VM *vm, Value a, Value b);
+int string_compare(Value a, Value b);
+Value string_substr(VM *vm, Value a, int start, int count);
+Value value_to_int(Value value);
+Value value_to_float(Value value);
+Value value_to_string(VM *vm, Value value);
+void input_open(void);
+const Input *input_get(VM *vm);
+long input_fill(long pos, InputNeed need);
+bool program_reads_input(const VM *vm);
+static inline bool input_blank(char c);
+Value input_read_int(VM *vm);
+Value input_read_float(VM *vm);
+Value input_read_line(VM *vm);
+bool native_register(const char *name, int pops, int pushes, NativeFn fn);
+const Native *native_find(SV name);
+void native_sqrt(VM *vm, Value *args);
+void native_pow(VM *vm, Value *args);
+void native_sin(VM *vm, Value *args);
+void native_cos(VM *vm, Value *args);
+void native_exp(VM *vm, Value *args);
+void native_log(VM *vm, Value *args);
+void native_floor(VM *vm, Value *args);
+void native_abs(VM *vm, Value *args);
+void native_min(VM *vm, Value *args);
+void native_max(VM *vm, Value *args);
+void native_isqrt(VM *vm, Value *args);
+void native_hash(VM *vm, Value *args);
+void natives_init(void);
+void vm_dump(const VM *vm);
+void vm_dump_stack(const VM *vm);
 const char *instr_to_cstr(Instr instr);
 bool tokenize(const char *source, const char *filename);
-bool compile(void);
+bool tokenize_lines(SV sv, Location loc, bool eof);
+bool tokenize_edit(SV old, const Arena *old_tokens, SV source, const char *filename, int *reused);
+static inline bool at_line_start(SV sv, int at);
+static inline bool lex_next(SV *line, SV *text, bool *string);
+void *lex_count_lines(void *arg);
+void *lex_part(void *arg);
+int front_end_jobs(void);
+void token_list_push(TokenList *list, Token *token);
+Definition *compiler_get_definition(Compiler *c, SV name);
+int compiler_get_slot(Compiler *c, SV name);
+void compiler_error(const Token *token, const char *message);
+bool compiler_reaches(Compiler *c, Definition *def, Definition *target, bool *visited);
+Token *compiler_par_token(Token *par);
+const Token *compiler_par_effect(Compiler *c, Definition *def, bool *visited);
+bool token_is_int(const Token *token, int value);
+bool token_is_var(const Token *token, TokenType type, SV name);
+int compiler_loop_tail(Token **tokens, int count, CountedLoop *loop);
+int compiler_loop_term(Token **tokens, int count, LoopUpdate *update);
+int compiler_loop_update(Token **tokens, int count, LoopUpdate *update);
+int compile_loop(Compiler *c, Token **tokens, int count);
+bool compile_token(Compiler *c, Token *token);
+bool compile(Module *module);
+bool tokenize_lazy(Module *m, SV source);
+bool tokenize_lazy_block(LazyProgram *p, const Token *defs, int defs_count, const char *end);
+bool compile_lazy_blocks(Compiler *c, TokenList *main_tokens, int entry);
+bool compile_lazy_block(Compiler *c, LazyBlock *b);
+int lazy_label_addr(const LazyProgram *p, const LazyBlock *own, SV name);
+int lazy_enter(VM *vm, int ip, int index);
+void *lazy_compiler(void *arg);
+void lazy_compile(LazyJob *job);
+void lazy_release(LazyProgram *p);
+int lazy_export_addr(const LazyProgram *p, SV name);
+Location *debug_locations_alloc(void);
+char *arena_strdup(Arena *a, const char *cstr);
+uint64_t fnv1a(const char *data, int len);
+void module_add_reloc(Module *m, RelocKind kind, int offset, SV name, Location loc);
+void module_add_export(Module *m, SV name, int addr);
+bool module_resolve(const char *including, SV path, char *resolved);
+void module_cache_file(const Module *m, char *cache_file);
+bool module_cache_load(Module *m, const ModuleCacheHeader *header, const char *cache_file);
+void module_cache_store(const Module *m, const ModuleCacheHeader *header, const char *cache_file);
+bool module_load(Module *m, int64_t compiler_mtime);
+void module_unload(Module *m);
+Module *module_loader_find(ModuleLoader *l, const char *path);
+Module *module_loader_add(ModuleLoader *l, const char *path);
+void *module_loader_worker(void *arg);
+bool module_place(Module *m, ModuleLoader *l, Module **order, int *order_count);
+bool module_link(ModuleLoader *l);
+void module_free(Module *m);
+double now_seconds(void);
+void runqueue_init(RunQueue *q, int capacity);
+int runqueue_push(RunQueue *q, Task *task);
+Task *runqueue_pop(RunQueue *q);
+void scheduler_push(Scheduler *s, RunQueue *q, Task *task);
+void scheduler_wake(Scheduler *s, bool all);
+Task *scheduler_steal(Scheduler *s, Worker *thief);
+void *scheduler_worker(void *arg);
+void scheduler_run(Scheduler *s);
+double jain_index(const double *xs, int n);
+void scheduler_report(const Scheduler *s);
+void par_start(void);
+void par_reset(void);
+void *par_worker(void *arg);
+void par_chunks(ParJob *job, VM *copy);
+Value par_iterate(const ParJob *job, VM *copy, int i);
+Value par_combine(const ParJob *job, Value a, Value b);
+Value par_run(VM *vm, int ip, int addr, Reduction reduction, int first, int bound);
+BatchGroup *batch_group_alloc(Batch *b);
+void batch_diverge(Batch *b, BatchGroup *g, const int *next_ip);
+void batch_exec(Batch *b, BatchGroup *g);
+bool batch_run(const VM *vm, const char *input_path, ValueType input_type, const char *output_path);
+bool load_program(const char *filename);
+ModuleLoader *module_loader_create(const char *filename);
+bool module_loader_run(ModuleLoader *l);
+bool program_build(ModuleLoader *l);
+void module_loader_free(ModuleLoader *l);
+bool watch_program(const char *filename, StatsFormat stats_format);
+void stats_collect(const VM *vm, Stats *stats);
+int arena_used(const Arena *a);
+int arena_chunks(const Arena *a);
+bool counters_open(int *fds);
+void counters_close(int *fds, Stats *stats);
+void stats_print(const Stats *stats, StatsFormat format);
 int get_file_size(const char *filename);
 bool read_entire_file(const char *filename, Arena *arena);
 bool sv_eq(SV lhs, SV rhs);
@@ -215,7 +1216,7 @@ SV sv_chop(SV *sv, SV delim);
   (SV) { (sv).data + (offset), (len) }
 #define svf(sv) (sv).len, (sv).data
 
-static_assert(TOK_KW_COUNT == 25, "Update TokenType is required");
+static_assert(TOK_KW_COUNT == 43, "Update TokenType is required");
 SV keywords[TOK_KW_COUNT] = {
     [TOK_EOF] = svli("\0"),
     [TOK_PLUS] = svli("+"),
@@ -242,67 +1243,205 @@ SV keywords[TOK_KW_COUNT] = {
     [TOK_JZ] = svli("jz"),
     [TOK_JNZ] = svli("jnz"),
     [TOK_DOT] = svli("."),
+    [TOK_COLON] = svli(":"),
+    [TOK_SEMICOLON] = svli(";"),
+    [TOK_SNAPSHOT] = svli("snapshot"),
+    [TOK_INCLUDE] = svli("include"),
+    [TOK_CONCAT] = svli("concat"),
+    [TOK_LENGTH] = svli("length"),
+    [TOK_COMPARE] = svli("compare"),
+    [TOK_SUBSTR] = svli("substr"),
+    [TOK_TO_INT] = svli("to-int"),
+    [TOK_TO_FLOAT] = svli("to-float"),
+    [TOK_TO_STRING] = svli("to-string"),
+    [TOK_READ_INT] = svli("read-int"),
+    [TOK_READ_FLOAT] = svli("read-float"),
+    [TOK_READ_LINE] = svli("read-line"),
+    [TOK_END_OF_INPUT] = svli("eof"),
+    [TOK_PAR_SUM] = svli("par-sum"),
+    [TOK_PAR_MIN] = svli("par-min"),
+    [TOK_PAR_MAX] = svli("par-max"),
 };
 
 // === DEFINITIONS ===
+// smallest operand width, as log2 of bytes, that holds the signed value
+int operand_width_log2(long long value) {
+  if (value >= INT8_MIN && value <= INT8_MAX)
+    return 0;
+  if (value >= INT16_MIN && value <= INT16_MAX)
+    return 1;
+  if (value >= INT32_MIN && value <= INT32_MAX)
+    return 2;
+  return 3;
+}
+
+static inline long long operand_read(const uint8_t *code, int width) {
+  switch (width) {
+  case 1: {
+    int8_t value;
+    memcpy(&value, code, sizeof(value));
+    return value;
+  }
+  case 2: {
+    int16_t value;
+    memcpy(&value, code, sizeof(value));
+    return value;
+  }
+  case 4: {
+    int32_t value;
+    memcpy(&value, code, sizeof(value));
+    return value;
+  }
+  default: {
+    int64_t value;
+    memcpy(&value, code, sizeof(value));
+    return value;
+  }
+  }
+}
+
+void operand_write(uint8_t *code, long long value, int width) {
+  switch (width) {
+  case 1: {
+    int8_t narrow = value;
+    memcpy(code, &narrow, sizeof(narrow));
+  } break;
+  case 2: {
+    int16_t narrow = value;
+    memcpy(code, &narrow, sizeof(narrow));
+  } break;
+  case 4: {
+    int32_t narrow = value;
+    memcpy(code, &narrow, sizeof(narrow));
+  } break;
+  default: {
+    int64_t wide = value;
+    memcpy(code, &wide, sizeof(wide));
+  } break;
+  }
+}
+
+static inline LoopOperand loop_operand_read(const uint8_t *code) {
+  return (LoopOperand){
+      .target = operand_read(code, 2),
+      .slot = operand_read(code + 2, 1),
+      .bound_slot = operand_read(code + 3, 1),
+      .value = operand_read(code + 4, 4),
+  };
+}
+
+void loop_operand_write(uint8_t *code, LoopOperand loop) {
+  operand_write(code, loop.target, 2);
+  operand_write(code + 2, loop.slot, 1);
+  operand_write(code + 3, loop.bound_slot, 1);
+  operand_write(code + 4, loop.value, 4);
+}
+
+// Iterations of a counted loop entered with its counter at first: the body runs once before the first test
+long long loop_trips(int first, int bound) {
+  long long trips = (long long)bound - first;
+  return trips > 1 ? trips : 1;
+}
+
+// Counter after the last iteration, wrapping around like the increments would
+int loop_last(int first, long long trips) {
+  return (int)((uint32_t)first + (uint32_t)trips);
+}
+
+// acc after adding coefficient * i + constant for every counter value i of the trips iterations from first.
+// NOTE: everything is computed modulo 2^64 and truncated, which is what adding it up one int at a time gives.
+// trips * (trips - 1) does not overflow as trips stays below 2^32.
+int loop_series(int acc, int first, long long trips, int coefficient, int constant) {
+  uint64_t n = trips;
+  uint64_t sum = n * (uint64_t)(int64_t)first + n * (n - 1) / 2;
+  uint64_t total = (uint64_t)(int64_t)coefficient * sum + (uint64_t)(int64_t)constant * n;
+  return (int)(uint32_t)((uint32_t)acc + total);
+}
+
+// Whether code bytes of program and data bytes of data still fit the vm, sets vm.overflow when they do not
+bool vm_reserve(int code, int data) {
+  if (vm.ip + code < PROGRAM_CAPACITY && vm.data_offset + data < DATA_CAPACITY)
+    return true;
+  vm.overflow = true;
+  return false;
+}
+
+// NOTE: an instruction that does not fit is dropped, the compile checks vm.overflow once it is done. The blocks of
+// --lazy are compiled while the program runs and have no better place to stop.
 void vm_push_instr(Instr instr, Word arg) {
-  assert(vm.ip < STACK_CAPACITY);
-
-  static_assert(INSTR_COUNT == 30, "Update Instr is required");
-  switch (instr) {
-  case INSTR_INT:
-  case INSTR_FLOAT:
-    assert(vm.ip + 1 < STACK_CAPACITY);
-    vm.program[vm.ip++] = (Word){.word = instr};
-    vm.program[vm.ip++] = arg;
+  static_assert(OPERAND_COUNT == 8, "Update OperandKind is required");
+  switch (instr_info[instr].operand) {
+  case OPERAND_NONE:
+    if (!vm_reserve(1, 0))
+      return;
+    vm.program[vm.ip++] = OPCODE(instr, 0);
     break;
 
-  case INSTR_STRING: {
-    assert(vm.ip + 1 < STACK_CAPACITY);
-    vm.program[vm.ip++] = (Word){.word = instr};
+  case OPERAND_INT: {
+    int width_log2 = operand_width_log2(arg.integer);
+    if (!vm_reserve(1 + (1 << width_log2), 0))
+      return;
+    vm.program[vm.ip++] = OPCODE(instr, width_log2);
+    operand_write(vm.program + vm.ip, arg.integer, 1 << width_log2);
+    vm.ip += 1 << width_log2;
+  } break;
+
+  case OPERAND_FLOAT:
+    // NOTE: the operand is the bit pattern of the float
+    if (!vm_reserve(1 + sizeof(float), 0))
+      return;
+    vm.program[vm.ip++] = OPCODE(instr, 2);
+    operand_write(vm.program + vm.ip, arg.integer, sizeof(float));
+    vm.ip += sizeof(float);
+    break;
+
+  case OPERAND_DATA: {
+    // NOTE: data offsets have a fixed width so that the linker can relocate them. The length of the string is
+    // stored in the 2 bytes before it.
     SV string = *(SV *)arg.word;
+    if (!vm_reserve(1 + DATA_OFFSET_WIDTH, 2 + string.len))
+      return;
+    uint16_t len = string.len;
+    memcpy(vm.data + vm.data_offset, &len, sizeof(len));
+    vm.data_offset += sizeof(len);
+    vm.program[vm.ip++] = OPCODE(instr, DATA_OFFSET_WIDTH_LOG2);
+    operand_write(vm.program + vm.ip, vm.data_offset, DATA_OFFSET_WIDTH);
+    vm.ip += DATA_OFFSET_WIDTH;
     memcpy(vm.data + vm.data_offset, string.data, string.len);
-    vm.program[vm.ip++] = (Word){.integer = vm.data_offset};
     vm.data_offset += string.len;
     vm.data[vm.data_offset++] = '\0';
   } break;
 
-  case INSTR_LABEL:
-    assert(vm.labels_count < LABELS_CAPACITY);
-    vm.labels[vm.labels_count++] = (Label){*(SV *)arg.word, vm.ip};
+  case OPERAND_ADDR:
+    if (!vm_reserve(1 + LABEL_ADDR_WIDTH, 0))
+      return;
+    vm.program[vm.ip++] = OPCODE(instr, LABEL_ADDR_WIDTH_LOG2);
+    operand_write(vm.program + vm.ip, LABEL_ADDR_DUMMY, LABEL_ADDR_WIDTH);
+    vm.ip += LABEL_ADDR_WIDTH;
+    break;
+
+  case OPERAND_LOOP:
+    if (!vm_reserve(1 + LOOP_OPERAND_WIDTH, 0))
+      return;
+    vm.program[vm.ip++] = OPCODE(instr, LOOP_OPERAND_WIDTH_LOG2);
+    loop_operand_write(vm.program + vm.ip, *(const LoopOperand *)arg.word);
+    vm.ip += LOOP_OPERAND_WIDTH;
     break;
 
-  case INSTR_LABEL_ADDR:
-    vm.program[vm.ip++] = (Word){.word = instr};
-    vm.program[vm.ip++].word = (word_t)LABEL_ADDR_DUMMY;
+  case OPERAND_NATIVE:
+    if (!vm_reserve(1 + NATIVE_WIDTH, 0))
+      return;
+    vm.program[vm.ip++] = OPCODE(instr, NATIVE_WIDTH_LOG2);
+    operand_write(vm.program + vm.ip, arg.word, NATIVE_WIDTH);
+    vm.ip += NATIVE_WIDTH;
     break;
 
-  case INSTR_ADD:
-  case INSTR_SUB:
-  case INSTR_MUL:
-  case INSTR_DIV:
-  case INSTR_MOD:
-  case INSTR_ADDF:
-  case INSTR_SUBF:
-  case INSTR_MULF:
-  case INSTR_DIVF:
-  case INSTR_EQ:
-  case INSTR_NEQ:
-  case INSTR_LT:
-  case INSTR_LE:
-  case INSTR_GT:
-  case INSTR_GE:
-  case INSTR_DUMP:
-  case INSTR_DUP:
-  case INSTR_OVER:
-  case INSTR_SWAP:
-  case INSTR_DROP:
-  case INSTR_ROT:
-  case INSTR_JMP:
-  case INSTR_JZ:
-  case INSTR_JNZ:
-  case INSTR_DONE:
-    vm.program[vm.ip++] = (Word){.word = instr};
+  case OPERAND_LABEL:
+    if (vm.labels_count >= LABELS_CAPACITY) {
+      vm.overflow = true;
+      return;
+    }
+    vm.labels[vm.labels_count++] = (Label){*(SV *)arg.word, vm.ip};
     break;
 
   default:
@@ -310,722 +1449,5025 @@ void vm_push_instr(Instr instr, Word arg) {
   }
 }
 
-bool vm_run() {
-  vm.ip = 0;
-
-#ifdef TRACE_EXECUTION
-  vm_dump();
-  printf("\n");
-#endif
-
-  for (Instr instr = (Instr)vm.program[vm.ip].word; instr != INSTR_DONE;
-       instr = (Instr)vm.program[vm.ip].word) {
-    static_assert(INSTR_COUNT == 30, "Update Instr is required");
-    switch (instr) {
-    case INSTR_INT:
-    case INSTR_FLOAT: {
-      assert(vm.sp < STACK_CAPACITY);
-      assert(vm.ip + 1 < STACK_CAPACITY);
-      word_t word = vm.program[++vm.ip].word;
-      vm.stack[vm.sp++] = (Value){.type = instr == INSTR_INT ? VAL_INT : VAL_FLOAT, .word = word};
-      vm.ip += 1;
-    } break;
-
-    case INSTR_LABEL_ADDR: {
-      assert(vm.sp < STACK_CAPACITY);
-      assert(vm.ip + 1 < STACK_CAPACITY);
-      int addr = vm.program[++vm.ip].integer;
-      vm.stack[vm.sp++] = (Value){.type = VAL_INT, .integer = addr};
-      vm.ip += 1;
-    } break;
-
-    case INSTR_STRING: {
-      assert(vm.sp < STACK_CAPACITY);
-      assert(vm.ip + 1 < STACK_CAPACITY);
-      int offset = vm.program[++vm.ip].integer;
-      vm.stack[vm.sp++] = (Value){.type = VAL_STR, .cstr = vm.data + offset};
-      vm.ip += 1;
-    } break;
+VMStatus vm_run(VM *vm, long budget) {
+  // NOTE: the interpreter is decided once per call, the untraced loops pay nothing for tracing
+  if (vm->trace || vm->profile)
+    return vm_exec_traced(vm, budget);
+  if (vm->regs)
+    return vm_exec_regs(vm, budget);
+  return vm_exec(vm, budget);
+}
 
-    case INSTR_ADD:
-    case INSTR_SUB:
-    case INSTR_MUL:
-    case INSTR_DIV:
-    case INSTR_MOD: {
-      assert(vm.sp >= 2);
-      Value b = vm.stack[--vm.sp];
-      Value a = vm.stack[--vm.sp];
-      assert(a.type == VAL_INT && b.type == VAL_INT);
-      if (instr == INSTR_ADD) {
-        vm.stack[vm.sp++] =
-            (Value){.type = VAL_INT, .integer = a.integer + b.integer};
-      } else if (instr == INSTR_SUB) {
-        vm.stack[vm.sp++] =
-            (Value){.type = VAL_INT, .integer = a.integer - b.integer};
-      } else if (instr == INSTR_MUL) {
-        vm.stack[vm.sp++] =
-            (Value){.type = VAL_INT, .integer = a.integer * b.integer};
-      } else if (instr == INSTR_DIV) {
-        vm.stack[vm.sp++] =
-            (Value){.type = VAL_INT, .integer = a.integer / b.integer};
-      } else {
-        vm.stack[vm.sp++] =
-            (Value){.type = VAL_INT, .integer = a.integer % b.integer};
-      }
-      vm.ip += 1;
-    } break;
+// Runs vm to its end, through its snapshot points. Returns false when it failed instead of halting.
+bool vm_finish(VM *vm) {
+  VMStatus status;
+  while ((status = vm_run(vm, VM_BUDGET_UNLIMITED)) != VM_HALTED && status != VM_FAILED)
+    ;
+  return status == VM_HALTED;
+}
 
-    case INSTR_ADDF:
-    case INSTR_SUBF:
-    case INSTR_MULF:
-    case INSTR_DIVF: {
-      assert(vm.sp >= 2);
-      Value b = vm.stack[--vm.sp];
-      Value a = vm.stack[--vm.sp];
-      assert(a.type == VAL_FLOAT && b.type == VAL_FLOAT);
-      if (instr == INSTR_ADDF) {
-        vm.stack[vm.sp++] =
-            (Value){.type = VAL_FLOAT, .float_ = a.float_ + b.float_};
-      } else if (instr == INSTR_SUBF) {
-        vm.stack[vm.sp++] =
-            (Value){.type = VAL_FLOAT, .float_ = a.float_ - b.float_};
-      } else if (instr == INSTR_MULF) {
-        vm.stack[vm.sp++] =
-            (Value){.type = VAL_FLOAT, .float_ = a.float_ * b.float_};
-      } else {
-        vm.stack[vm.sp++] =
-            (Value){.type = VAL_FLOAT, .float_ = a.float_ / b.float_};
-      }
-      vm.ip += 1;
-    } break;
+// Runs the stack bytecode on the interpreter selected with --interpreter
+VMStatus vm_exec(VM *vm, long budget) {
+  // clang-format off
+  static_assert(INTERPRETER_COUNT == 3, "Update Interpreter is required");
+  switch (interpreter) {
+  case INTERPRETER_FAST:    return vm_exec_fast(vm, budget);
+  case INTERPRETER_CHECKED: return vm_exec_checked(vm, budget);
+  case INTERPRETER_TRACED:  return vm_exec_traced(vm, budget);
+  default:                  assert(0 && "unreachable");
+  }
+  // clang-format on
+}
 
-    case INSTR_EQ: {
-      assert(vm.sp >= 2);
-      Value b = vm.stack[--vm.sp];
-      Value a = vm.stack[--vm.sp];
-      assert(a.type == VAL_INT && b.type == VAL_INT);
-      vm.stack[vm.sp++] = (Value){VAL_INT, .integer = a.integer == b.integer};
-      vm.ip += 1;
-    } break;
-    case INSTR_NEQ: {
-      assert(vm.sp >= 2);
-      Value b = vm.stack[--vm.sp];
-      Value a = vm.stack[--vm.sp];
-      assert(a.type == VAL_INT && b.type == VAL_INT);
-      vm.stack[vm.sp++] = (Value){VAL_INT, .integer = a.integer != b.integer};
-      vm.ip += 1;
-    } break;
-    case INSTR_LT: {
-      assert(vm.sp >= 2);
-      Value b = vm.stack[--vm.sp];
-      Value a = vm.stack[--vm.sp];
-      assert(a.type == VAL_INT && b.type == VAL_INT);
-      vm.stack[vm.sp++] = (Value){VAL_INT, .integer = a.integer < b.integer};
-      vm.ip += 1;
-    } break;
-    case INSTR_LE: {
-      assert(vm.sp >= 2);
-      Value b = vm.stack[--vm.sp];
-      Value a = vm.stack[--vm.sp];
-      assert(a.type == VAL_INT && b.type == VAL_INT);
-      vm.stack[vm.sp++] = (Value){VAL_INT, .integer = a.integer <= b.integer};
-      vm.ip += 1;
-    } break;
-    case INSTR_GT: {
-      assert(vm.sp >= 2);
-      Value b = vm.stack[--vm.sp];
-      Value a = vm.stack[--vm.sp];
-      assert(a.type == VAL_INT && b.type == VAL_INT);
-      vm.stack[vm.sp++] = (Value){VAL_INT, .integer = a.integer > b.integer};
-      vm.ip += 1;
-    } break;
-    case INSTR_GE: {
-      assert(vm.sp >= 2);
-      Value b = vm.stack[--vm.sp];
-      Value a = vm.stack[--vm.sp];
-      assert(a.type == VAL_INT && b.type == VAL_INT);
-      vm.stack[vm.sp++] = (Value){VAL_INT, .integer = a.integer >= b.integer};
-      vm.ip += 1;
-    } break;
+// The interpreter loop, specialized by the compiler for every combination of the constant flags
+static inline __attribute__((always_inline)) VMStatus vm_exec_variant(VM *vm, long budget, const bool checked,
+                                                                      const bool traced) {
+  // NOTE: a limited budget makes the run preemptive: it also yields on every taken backward jump,
+  // so that a VM spinning in a polling loop gives its thread away early
+  bool preemptive = budget != VM_BUDGET_UNLIMITED;
+  long start_budget = budget;
+  VMStatus status = VM_YIELDED;
 
-    case INSTR_DUP: {
-      assert(vm.sp >= 1 && vm.sp + 1 < STACK_CAPACITY);
-      vm.stack[vm.sp] = vm.stack[vm.sp - 1];
-      vm.sp += 1;
-      vm.ip += 1;
-    } break;
+  for (;;) {
+    int ip = vm->ip;
+    uint8_t opcode = vm->program[ip];
+    Instr instr = OPCODE_INSTR(opcode);
+    if (instr == INSTR_DONE) {
+      status = VM_HALTED;
+      break;
+    }
+    if (budget == 0)
+      break;
+    budget -= 1;
+    if (traced)
+      vm_trace_before(vm, ip, instr);
 
-    case INSTR_OVER: {
-      assert(vm.sp >= 2 && vm.sp + 1 < STACK_CAPACITY);
-      vm.stack[vm.sp] = vm.stack[vm.sp - 2];
-      vm.sp += 1;
-      vm.ip += 1;
-    } break;
+#define CHECK(cond)                                 \
+  do {                                              \
+    if (checked && !(cond))                         \
+      vm_check_failed(vm, ip, instr, #cond);        \
+  } while (0)
+#define INSTR_CASE(name, mnemonic, operand_kind, pops, pushes, flow, group, ...)                  \
+  case INSTR_##name: {                                                                            \
+    CHECK(vm->sp >= pops);                                                                        \
+    CHECK(vm->sp - pops + pushes <= STACK_CAPACITY);                                              \
+    long long operand = 0;                                                                        \
+    if (OPERAND_##operand_kind != OPERAND_NONE)                                                   \
+      operand = operand_read(vm->program + ip + 1, OPCODE_WIDTH(opcode));                         \
+    vm->ip = ip + (OPERAND_##operand_kind == OPERAND_NONE ? 1 : 1 + OPCODE_WIDTH(opcode));        \
+    (void)operand;                                                                                \
+    __VA_ARGS__                                                                                   \
+  } break;
 
-    case INSTR_SWAP: {
-      assert(vm.sp >= 2);
-      Value tmp = vm.stack[vm.sp - 1];
-      vm.stack[vm.sp - 1] = vm.stack[vm.sp - 2];
-      vm.stack[vm.sp - 2] = tmp;
-      vm.ip += 1;
-    } break;
+    bool yield = false;
+    switch (instr) {
+      INSTR_TABLE(INSTR_CASE)
+    default:
+      CHECK(0 && "unknown opcode");
+    }
+#undef INSTR_CASE
+#undef CHECK
 
-    case INSTR_DROP: {
-      assert(vm.sp >= 1);
-      vm.sp -= 1;
-      vm.ip += 1;
-    } break;
+    if (traced)
+      vm_trace_after(vm, ip, instr);
+    if (yield)
+      break;
+  }
 
-    case INSTR_ROT: {
-      assert(vm.sp >= 3);
-      Value tmp = vm.stack[vm.sp - 3];
-      vm.stack[vm.sp - 3] = vm.stack[vm.sp - 2];
-      vm.stack[vm.sp - 2] = vm.stack[vm.sp - 1];
-      vm.stack[vm.sp - 1] = tmp;
-      vm.ip += 1;
-    } break;
+  vm->instr_count += start_budget - budget;
+  return status;
+}
 
-    case INSTR_JMP: {
-      assert(vm.sp >= 1);
-      Value addr = vm.stack[--vm.sp];
-      assert(addr.type == VAL_INT);
-      vm.ip = addr.integer;
-    } break;
+VMStatus vm_exec_fast(VM *vm, long budget) {
+  return vm_exec_variant(vm, budget, false, false);
+}
 
-    case INSTR_JZ:
-    case INSTR_JNZ: {
-      assert(vm.sp >= 2);
-      Value cond = vm.stack[--vm.sp];
-      Value addr = vm.stack[--vm.sp];
-      assert(cond.type == VAL_INT);
-      assert(addr.type == VAL_INT);
-      if (cond.integer == (instr == INSTR_JNZ))
-        vm.ip = addr.integer;
-      else
-        vm.ip += 1;
-    } break;
+VMStatus vm_exec_checked(VM *vm, long budget) {
+  return vm_exec_variant(vm, budget, true, false);
+}
 
-    case INSTR_DUMP:
-      assert(vm.sp >= 1);
-      value_print(vm.stack[--vm.sp]);
-      vm.ip += 1;
-      break;
+VMStatus vm_exec_traced(VM *vm, long budget) {
+  return vm_exec_variant(vm, budget, true, true);
+}
 
-    default:
-      assert(0 && "unreachable");
-    }
+void vm_check_failed(const VM *vm, int ip, Instr instr, const char *check) {
+  fprintf(stderr, "Error: %s at ip %d failed the check %s (sp = %d, rsp = %d)\n", instr_to_cstr(instr), ip, check,
+          vm->sp, vm->rsp);
+  abort();
+}
 
-#ifdef TRACE_EXECUTION
-    printf("%s\n", instr_to_cstr(instr));
-    vm_dump();
-    printf("\n");
-#endif
+// Records the instruction about to run in the trace of vm
+void vm_trace_before(VM *vm, int ip, Instr instr) {
+  // NOTE: recorded before executing, so a crashing instruction is the last record of the dump
+  Trace *trace = vm->trace;
+  if (trace) {
+    TraceRecord *record = &trace->records[trace->written++ & trace->mask];
+    record->ip = ip;
+    record->instr = instr;
+    record->sp = vm->sp;
+    record->top_type = vm->sp > 0 ? vm->stack[vm->sp - 1].type : VAL_COUNT;
+    record->top = vm->sp > 0 ? vm->stack[vm->sp - 1].word : 0;
   }
+}
 
-  return true;
+// Counts the instruction that ran in the profile of vm and prints it when the traced interpreter was asked for
+void vm_trace_after(VM *vm, int ip, Instr instr) {
+  Profile *profile = vm->profile;
+  if (profile) {
+    bool jump = instr_info[instr].flow == FLOW_JUMP;
+    profile->executed[ip] += 1;
+    profile->taken[ip] += jump && vm->ip != ip + instr_size(vm->program[ip]);
+  }
+  if (interpreter == INTERPRETER_TRACED) {
+    printf("%d: %s\n", ip, instr_to_cstr(instr));
+    vm_dump_stack(vm);
+  }
 }
 
-ArenaChunk *arena_chunk_create(int chunk_size) {
-  ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + chunk_size);
-  if (chunk == NULL) {
+
+void traces_init(int count, int records, const char *path) {
+  assert(records > 0 && (records & (records - 1)) == 0);
+  traces = calloc(count, sizeof(Trace));
+  TraceRecord *buffer = malloc((size_t)count * records * sizeof(TraceRecord));
+  if (traces == NULL || buffer == NULL) {
     fprintf(stderr, "Error: memory issue...");
     abort();
   }
-  chunk->next = NULL;
-  chunk->size = chunk_size;
-  chunk->offset = 0;
-  return chunk;
+  for (int i = 0; i < count; ++i)
+    traces[i] = (Trace){.records = buffer + (size_t)i * records, .mask = records - 1};
+
+  // NOTE: the file is opened up front so that a crash only has to write(2) into it
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (trace_fd < 0) {
+    fprintf(stderr, "Error: could not open the file %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  signal(SIGSEGV, trace_crash_handler);
+  signal(SIGABRT, trace_crash_handler);
+  signal(SIGFPE, trace_crash_handler);
+  signal(SIGILL, trace_crash_handler);
 }
 
-Arena arena_create(int chunk_size) {
-  return (Arena){arena_chunk_create(chunk_size)};
+Trace *trace_attach(VM *vm, const char *filename) {
+  Trace *trace = &traces[traces_count++];
+  trace->filename = filename;
+  vm->trace = trace;
+  return trace;
 }
 
-void arena_destroy(Arena *a) {
+// File layout: magic, vm count, inline threshold the programs were compiled with, then per vm: filename length, filename, records written, records kept
+// (oldest first). Only write(2) is used so that it is safe to call from a signal handler.
+void traces_dump(void) {
+  if (trace_fd < 0)
+    return;
+
+  uint32_t count = traces_count;
+  uint32_t threshold = inline_threshold;
+  write(trace_fd, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1);
+  write(trace_fd, &count, sizeof(count));
+  write(trace_fd, &threshold, sizeof(threshold));
+  for (int i = 0; i < traces_count; ++i) {
+    const Trace *trace = &traces[i];
+    uint32_t filename_len = strlen(trace->filename);
+    uint64_t capacity = trace->mask + 1;
+    uint64_t kept = trace->written < capacity ? trace->written : capacity;
+    uint64_t first = (trace->written - kept) & trace->mask;
+    uint64_t tail = capacity - first < kept ? capacity - first : kept;
+
+    write(trace_fd, &filename_len, sizeof(filename_len));
+    write(trace_fd, trace->filename, filename_len);
+    write(trace_fd, &trace->written, sizeof(trace->written));
+    write(trace_fd, &kept, sizeof(kept));
+    write(trace_fd, trace->records + first, tail * sizeof(TraceRecord));
+    write(trace_fd, trace->records, (kept - tail) * sizeof(TraceRecord));
+  }
+
+  close(trace_fd);
+  trace_fd = -1;
+}
+
+void trace_crash_handler(int sig) {
+  traces_dump();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+bool trace_decode(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "Error: could not open the file %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  char magic[sizeof(TRACE_MAGIC) - 1];
+  uint32_t count, threshold;
+  if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+      fread(&count, sizeof(count), 1, f) != 1 || fread(&threshold, sizeof(threshold), 1, f) != 1) {
+    fprintf(stderr, "Error: %s is not a step trace\n", path);
+    fclose(f);
+    return false;
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t filename_len;
+    uint64_t written, kept;
+    char filename[FILENAME_MAX];
+    if (fread(&filename_len, sizeof(filename_len), 1, f) != 1 || filename_len >= sizeof(filename) ||
+        fread(filename, filename_len, 1, f) != 1 || fread(&written, sizeof(written), 1, f) != 1 ||
+        fread(&kept, sizeof(kept), 1, f) != 1) {
+      fprintf(stderr, "Error: %s is truncated\n", path);
+      fclose(f);
+      return false;
+    }
+    filename[filename_len] = '\0';
+
+    // NOTE: recompiling the source the same way restores debug_locations for the traced program
+    inline_threshold = threshold;
+    bool has_locations = load_program(filename);
+
+    printf("vm %u: %s, %llu instructions traced, last %llu kept\n", i, filename,
+           (unsigned long long)written, (unsigned long long)kept);
+    for (uint64_t j = 0; j < kept; ++j) {
+      TraceRecord r;
+      if (fread(&r, sizeof(r), 1, f) != 1) {
+        fprintf(stderr, "Error: %s is truncated\n", path);
+        fclose(f);
+        return false;
+      }
+
+      printf("  %8llu  ip=%-4d %-16s sp=%-3u ", (unsigned long long)(written - kept + j), r.ip,
+             r.instr < INSTR_COUNT ? instr_to_cstr(r.instr) : "?", r.sp);
+      Word top = {.word = r.top};
+      // clang-format off
+      static_assert(VAL_COUNT == 3, "Update ValueType is required");
+      switch (r.top_type) {
+      case VAL_INT:   printf("top=%-12d", top.integer); break;
+      case VAL_FLOAT: printf("top=%-12g", top.float_); break;
+      case VAL_STR:   printf("top=%-12s", "<str>"); break;
+      default:        printf("%-16s", ""); break;
+      }
+      // clang-format on
+      if (has_locations && r.ip >= 0 && r.ip < PROGRAM_CAPACITY) {
+        Location loc = debug_locations[r.ip];
+        printf(" %s:%d:%d", loc.filename, loc.line, loc.col);
+      }
+      printf("\n");
+    }
+  }
+
+  fclose(f);
+  return true;
+}
+
+// Bytes of the instruction starting with opcode
+int instr_size(uint8_t opcode) {
+  // clang-format off
+  static_assert(OPERAND_COUNT == 8, "Update OperandKind is required");
+  switch (instr_info[OPCODE_INSTR(opcode)].operand) {
+  case OPERAND_NONE:  return 1;
+  case OPERAND_LABEL: return 0;
+  default:            return 1 + OPCODE_WIDTH(opcode);
+  }
+  // clang-format on
+}
+
+// Whether the operand of the instruction is a code address, which starts a block
+static inline bool instr_has_target(Instr instr) {
+  return instr_info[instr].operand == OPERAND_ADDR || instr == INSTR_LOOP;
+}
+
+// Marks where basic blocks start: the program entry, label addresses, call and par loop targets and after every
+// control transfer
+void program_leaders(const VM *vm, bool *leader) {
+  leader[0] = true;
+  for (int ip = 0; ip < vm->ip; ip += instr_size(vm->program[ip])) {
+    uint8_t opcode = vm->program[ip];
+    Instr instr = OPCODE_INSTR(opcode);
+    int next = ip + instr_size(opcode);
+    if (instr_has_target(instr)) {
+      int addr = operand_read(vm->program + ip + 1, LABEL_ADDR_WIDTH);
+      if (addr >= 0 && addr < vm->ip)
+        leader[addr] = true;
+    }
+    if (instr_info[instr].flow != FLOW_NEXT && next < vm->ip)
+      leader[next] = true;
+  }
+}
+
+// Splits the linked program of vm into blocks and finds their successors and which of them are reachable.
+// Fails when a jump does not take its target from a label address pushed in its own block.
+bool cfg_build(const VM *vm, Cfg *cfg) {
+  // NOTE: sized to the program, not to PROGRAM_CAPACITY, a small program touches little memory
+  bool *leader = calloc(vm->ip + 1, sizeof(bool));
+  cfg->blocks = calloc(vm->ip + 1, sizeof(CfgBlock));
+  cfg->block_of = malloc((vm->ip + 1) * sizeof(int));
+  CfgValue *stack = malloc(2 * STACK_CAPACITY * sizeof(CfgValue));
+  int *worklist = malloc((vm->ip + 1) * sizeof(int));
+  if (leader == NULL || cfg->blocks == NULL || cfg->block_of == NULL || stack == NULL || worklist == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  program_leaders(vm, leader);
+  cfg->count = 0;
+  for (int ip = 0; ip < vm->ip; ++ip)
+    cfg->block_of[ip] = -1;
+  for (int ip = 0; ip < vm->ip; ip += instr_size(vm->program[ip])) {
+    if (leader[ip])
+      cfg->block_of[ip] = cfg->count++;
+  }
+
+  bool ok = true;
+  CfgBlock *block = NULL;
+  int height = 0; // entries above the block entry, offset by STACK_CAPACITY in stack
+  const CfgValue unknown = {.label = -1, .producer = -1};
+  for (int ip = 0; ip < vm->ip && ok;) {
+    uint8_t opcode = vm->program[ip];
+    Instr instr = OPCODE_INSTR(opcode);
+    int next = ip + instr_size(opcode);
+    int operand = instr_size(opcode) > 1 ? operand_read(vm->program + ip + 1, OPCODE_WIDTH(opcode)) : 0;
+    if (leader[ip]) {
+      block = &cfg->blocks[cfg->block_of[ip]];
+      *block = (CfgBlock){.addr = ip, .taken = -1, .fall = -1, .target_addr = -1};
+      height = 0;
+      for (int i = 0; i < 2 * STACK_CAPACITY; ++i)
+        stack[i] = unknown;
+    }
+    block->last = ip;
+    block->end = next;
+
+    // NOTE: a block deeper than the stack overflows when it runs, its jump targets are left unknown
+    if (height < -STACK_CAPACITY + 3 || height > STACK_CAPACITY - 1) {
+      ok = false;
+      break;
+    }
+    CfgValue *top = &stack[STACK_CAPACITY + height - 1];
+    bool ends = false;
+    // NOTE: only --lazy emits them, its blocks are laid out in the order they are reached
+    if (instr_info[instr].group == GROUP_LAZY) {
+      ok = false;
+      break;
+    }
+    // clang-format off
+    switch (instr) {
+    case INSTR_INT:        top[1] = (CfgValue){.label = -1, .producer = -1, .boolean = operand == 0 || operand == 1}; height += 1; break;
+    case INSTR_LABEL_ADDR: top[1] = (CfgValue){.label = operand, .producer = ip}; height += 1; break;
+    case INSTR_EQ:   case INSTR_NEQ:  case INSTR_LT:   case INSTR_LE:   case INSTR_GT: case INSTR_GE:
+      top[-1] = (CfgValue){.label = -1, .producer = -1, .boolean = true};
+      height -= 1;
+      break;
+
+    case INSTR_CALL_NATIVE: {
+      const Native *native = &natives[operand_read(vm->program + ip + 1, NATIVE_WIDTH)];
+      height += native->pushes - native->pops;
+      if (height < -STACK_CAPACITY + native->pushes || height > STACK_CAPACITY) {
+        ok = false;
+        break;
+      }
+      for (int i = 1; i <= native->pushes; ++i)
+        stack[STACK_CAPACITY + height - i] = unknown;
+    } break;
+
+    case INSTR_DUP:  top[0].producer = -1; top[1] = top[0]; height += 1; break;
+    case INSTR_OVER: top[-1].producer = -1; top[1] = top[-1]; height += 1; break;
+    case INSTR_SWAP: { CfgValue a = top[-1]; top[-1] = top[0]; top[0] = a; } break;
+    case INSTR_ROT:  { CfgValue a = top[-2]; top[-2] = top[-1]; top[-1] = top[0]; top[0] = a; } break;
+
+    case INSTR_JMP:
+    case INSTR_JZ:
+    case INSTR_JNZ: {
+      CfgValue target = instr == INSTR_JMP ? top[0] : top[-1];
+      if (target.label < 0 || target.label >= vm->ip || cfg->block_of[target.label] < 0) {
+        ok = false;
+        break;
+      }
+      block->taken = cfg->block_of[target.label];
+      block->target_addr = target.producer;
+      block->boolean = instr != INSTR_JMP && top[0].boolean;
+      if (instr != INSTR_JMP && next < vm->ip)
+        block->fall = cfg->block_of[next];
+      ends = true;
+    } break;
+
+    case INSTR_LOOP: {
+      LoopOperand l = loop_operand_read(vm->program + ip + 1);
+      if (l.target < 0 || l.target >= vm->ip || cfg->block_of[l.target] < 0) {
+        ok = false;
+        break;
+      }
+      if (l.slot < 0)
+        top[0] = unknown;
+      block->taken = cfg->block_of[l.target];
+      if (next < vm->ip)
+        block->fall = cfg->block_of[next];
+      ends = true;
+    } break;
+
+    default: {
+      // NOTE: the values it pushes are not followed, its stack effect and where it goes are those of the table
+      const InstrInfo *info = &instr_info[instr];
+      assert(info->operand != OPERAND_LABEL && info->flow != FLOW_JUMP);
+      height += info->pushes - info->pops;
+      for (int i = 1; i <= info->pushes; ++i)
+        stack[STACK_CAPACITY + height - i] = unknown;
+      if (info->flow == FLOW_CALL && next < vm->ip)
+        block->fall = cfg->block_of[next];
+      ends = info->flow != FLOW_NEXT;
+    } break;
+    }
+    // clang-format on
+
+    if (!ends && next < vm->ip && leader[next])
+      block->fall = cfg->block_of[next];
+    ip = next;
+  }
+
+  // NOTE: every label address the reachable code pushes counts as used, whether it is jumped to or kept as a value
+  int pending = 0;
+  if (ok && cfg->count > 0) {
+    cfg->blocks[0].reachable = true;
+    worklist[pending++] = 0;
+  }
+  while (pending > 0) {
+    const CfgBlock *b = &cfg->blocks[worklist[--pending]];
+    if (b->fall >= 0 && !cfg->blocks[b->fall].reachable) {
+      cfg->blocks[b->fall].reachable = true;
+      worklist[pending++] = b->fall;
+    }
+    for (int ip = b->addr; ip < b->end; ip += instr_size(vm->program[ip])) {
+      Instr instr = OPCODE_INSTR(vm->program[ip]);
+      if (!instr_has_target(instr))
+        continue;
+      int addr = operand_read(vm->program + ip + 1, LABEL_ADDR_WIDTH);
+      int s = addr >= 0 && addr < vm->ip ? cfg->block_of[addr] : -1;
+      if (s >= 0 && !cfg->blocks[s].reachable) {
+        cfg->blocks[s].reachable = true;
+        worklist[pending++] = s;
+      }
+    }
+  }
+
+  free(worklist);
+  free(stack);
+  free(leader);
+  return ok;
+}
+
+// Lays the reachable blocks of the linked program of vm out again. Given a profile, every chain starts with the
+// hottest block left and goes on with its successor executed most often, inverting a conditional jump to it;
+// otherwise blocks keep their order. A jmp to the next block is dropped, a fall-through that does not follow
+// anymore gets one instead.
+// Returns false and keeps the program when a jump target is not known.
+bool program_layout(VM *vm, const Profile *profile) {
+  Cfg *cfg = malloc(sizeof(Cfg));
+  if (cfg == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  if (!cfg_build(vm, cfg)) {
+    free(cfg->blocks);
+    free(cfg->block_of);
+    free(cfg);
+    return false;
+  }
+
+  int *order = malloc(cfg->count * sizeof(int));
+  int *new_addr = malloc(cfg->count * sizeof(int));
+  bool *invert = calloc(cfg->count, sizeof(bool));
+  int capacity = vm->ip + cfg->count * (2 + LABEL_ADDR_WIDTH);
+  uint8_t *code = calloc(capacity, 1);
+  Location *locations = calloc(capacity, sizeof(Location));
+  if (order == NULL || new_addr == NULL || invert == NULL || code == NULL || locations == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+
+  int order_count = 0;
+  for (;;) {
+    int seed = -1;
+    for (int i = 0; i < cfg->count; ++i) {
+      const CfgBlock *b = &cfg->blocks[i];
+      if (!b->reachable || b->placed)
+        continue;
+      if (seed < 0 || (profile && profile->executed[b->addr] > profile->executed[cfg->blocks[seed].addr]))
+        seed = i;
+      // NOTE: the program entry stays at address 0
+      if (profile == NULL || order_count == 0)
+        break;
+    }
+    if (seed < 0)
+      break;
+
+    for (int i = seed; i >= 0;) {
+      CfgBlock *b = &cfg->blocks[i];
+      b->placed = true;
+      order[order_count++] = i;
+
+      // NOTE: without a profile only fall-throughs are followed, which keeps the order of the source
+      Instr instr = OPCODE_INSTR(vm->program[b->last]);
+      bool taken_free = profile && b->taken >= 0 && !cfg->blocks[b->taken].placed;
+      bool fall_free = b->fall >= 0 && !cfg->blocks[b->fall].placed;
+      uint64_t taken = profile ? profile->taken[b->last] : 0;
+      uint64_t fall = profile ? profile->executed[b->last] - taken : 0;
+      bool conditional = instr == INSTR_JZ || instr == INSTR_JNZ;
+      if (instr == INSTR_JMP) {
+        i = taken_free ? b->taken : -1;
+      } else if (conditional && taken_free && b->fall >= 0 && b->boolean && b->target_addr >= 0 &&
+                 (!fall_free || taken > fall)) {
+        invert[i] = true;
+        i = b->taken;
+      } else {
+        i = fall_free ? b->fall : -1;
+      }
+    }
+  }
+
+  int size = 0;
+  for (int k = 0; k < order_count; ++k) {
+    int i = order[k];
+    const CfgBlock *b = &cfg->blocks[i];
+    int next = k + 1 < order_count ? order[k + 1] : -1;
+    // a jmp to the next block is dropped along with the label address right before it
+    bool elide = OPCODE_INSTR(vm->program[b->last]) == INSTR_JMP && b->taken == next &&
+                 b->target_addr == b->last - 1 - LABEL_ADDR_WIDTH;
+    int end = elide ? b->target_addr : b->end;
+    new_addr[i] = size;
+    memcpy(code + size, vm->program + b->addr, end - b->addr);
+    memcpy(locations + size, debug_locations + b->addr, (end - b->addr) * sizeof(Location));
+
+    int fall = b->fall;
+    if (invert[i]) {
+      uint8_t *jump = code + size + (b->last - b->addr);
+      *jump = OPCODE(OPCODE_INSTR(*jump) == INSTR_JZ ? INSTR_JNZ : INSTR_JZ, 0);
+      operand_write(code + size + (b->target_addr - b->addr) + 1, cfg->blocks[fall].addr, LABEL_ADDR_WIDTH);
+      fall = b->taken;
+    }
+    size += end - b->addr;
+
+    if (fall >= 0 && fall != next) {
+      code[size] = OPCODE(INSTR_LABEL_ADDR, LABEL_ADDR_WIDTH_LOG2);
+      operand_write(code + size + 1, cfg->blocks[fall].addr, LABEL_ADDR_WIDTH);
+      code[size + 1 + LABEL_ADDR_WIDTH] = OPCODE(INSTR_JMP, 0);
+      for (int j = 0; j < 2 + LABEL_ADDR_WIDTH; ++j)
+        locations[size + j] = debug_locations[b->last];
+      size += 2 + LABEL_ADDR_WIDTH;
+    }
+  }
+
+  // NOTE: label addresses, call and loop targets are still those of the old program, they all start blocks
+  bool result = size <= PROGRAM_CAPACITY;
+  if (result) {
+    for (int ip = 0; ip < size; ip += instr_size(code[ip])) {
+      Instr instr = OPCODE_INSTR(code[ip]);
+      if (!instr_has_target(instr))
+        continue;
+      int addr = operand_read(code + ip + 1, LABEL_ADDR_WIDTH);
+      if (addr >= 0 && addr < vm->ip && cfg->block_of[addr] >= 0)
+        operand_write(code + ip + 1, new_addr[cfg->block_of[addr]], LABEL_ADDR_WIDTH);
+    }
+    memset(vm->program, 0, vm->ip);
+    memcpy(vm->program, code, size);
+    memcpy(debug_locations, locations, size * sizeof(Location));
+    vm->ip = size;
+  }
+
+  free(locations);
+  free(code);
+  free(invert);
+  free(new_addr);
+  free(order);
+  free(cfg->blocks);
+  free(cfg->block_of);
+  free(cfg);
+  return result;
+}
+
+Profile *profile_create(const VM *vm) {
+  Profile *profile = calloc(1, sizeof(Profile));
+  if (profile == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  profile->program_hash = fnv1a((const char *)vm->program, vm->ip);
+  return profile;
+}
+
+// File layout: magic, hash of the profiled program, entry count, then per executed address: address, executions, jumps taken
+bool profile_write(const Profile *profile, const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "Error: could not open the file %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  uint32_t count = 0;
+  for (int ip = 0; ip < PROGRAM_CAPACITY; ++ip)
+    count += profile->executed[ip] > 0;
+  fwrite(PROFILE_MAGIC, sizeof(PROFILE_MAGIC) - 1, 1, f);
+  fwrite(&profile->program_hash, sizeof(profile->program_hash), 1, f);
+  fwrite(&count, sizeof(count), 1, f);
+  for (uint32_t ip = 0; ip < PROGRAM_CAPACITY; ++ip) {
+    if (profile->executed[ip] == 0)
+      continue;
+    fwrite(&ip, sizeof(ip), 1, f);
+    fwrite(&profile->executed[ip], sizeof(profile->executed[ip]), 1, f);
+    fwrite(&profile->taken[ip], sizeof(profile->taken[ip]), 1, f);
+  }
+  bool ok = !ferror(f);
+  fclose(f);
+  if (!ok)
+    fprintf(stderr, "Error: could not write the file %s\n", path);
+  return ok;
+}
+
+// Reads a profile recorded for the program of vm into *profile, left NULL when it was recorded for another program
+bool profile_read(const char *path, const VM *vm, Profile **profile) {
+  *profile = NULL;
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "Error: could not open the file %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  char magic[sizeof(PROFILE_MAGIC) - 1];
+  uint64_t hash;
+  uint32_t count;
+  if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, PROFILE_MAGIC, sizeof(magic)) != 0 ||
+      fread(&hash, sizeof(hash), 1, f) != 1 || fread(&count, sizeof(count), 1, f) != 1) {
+    fprintf(stderr, "Error: %s is not a step profile\n", path);
+    fclose(f);
+    return false;
+  }
+  // NOTE: a stale profile is expected after editing the program, it only costs the layout
+  if (hash != fnv1a((const char *)vm->program, vm->ip)) {
+    fprintf(stderr, "Warning: %s was recorded for another version of the program, ignoring it\n", path);
+    fclose(f);
+    return true;
+  }
+
+  Profile *p = profile_create(vm);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t ip;
+    uint64_t executed, taken;
+    if (fread(&ip, sizeof(ip), 1, f) != 1 || fread(&executed, sizeof(executed), 1, f) != 1 ||
+        fread(&taken, sizeof(taken), 1, f) != 1 || ip >= PROGRAM_CAPACITY) {
+      fprintf(stderr, "Error: %s is truncated\n", path);
+      fclose(f);
+      free(p);
+      return false;
+    }
+    p->executed[ip] = executed;
+    p->taken[ip] = taken;
+  }
+  fclose(f);
+  *profile = p;
+  return true;
+}
+
+RegInstr *reg_emit(RegTranslator *t, RegOp op) {
+  RegProgram *p = t->p;
+  if (p->count >= p->capacity) {
+    p->capacity = p->capacity ? p->capacity * 2 : 256;
+    p->code = realloc(p->code, p->capacity * sizeof(RegInstr));
+    if (p->code == NULL) {
+      fprintf(stderr, "Error: memory issue...");
+      abort();
+    }
+  }
+  p->code[p->count] = (RegInstr){.op = op};
+  return &p->code[p->count++];
+}
+
+// Abstract stack entry at a position relative to the base; entries below the base start as their own register
+RegOperand *reg_at(RegTranslator *t, int position) {
+  assert(position >= -STACK_CAPACITY && position < STACK_CAPACITY);
+  for (; t->low > position; t->low -= 1)
+    t->stack[STACK_CAPACITY + t->low - 1] = (RegOperand){.reg = t->low - 1};
+  return &t->stack[STACK_CAPACITY + position];
+}
+
+void reg_push(RegTranslator *t, RegOperand operand) {
+  if (!operand.is_const && operand.reg >= REG_TEMP)
+    t->temp_refs[operand.reg - REG_TEMP] += 1;
+  *reg_at(t, t->height++) = operand;
+}
+
+// The caller owns the entry and releases it once an instruction has consumed it
+RegOperand reg_pop(RegTranslator *t) {
+  return *reg_at(t, --t->height);
+}
+
+void reg_release(RegTranslator *t, RegOperand operand) {
+  if (!operand.is_const && operand.reg >= REG_TEMP)
+    t->temp_refs[operand.reg - REG_TEMP] -= 1;
+}
+
+// A free scratch register, owned by the caller
+RegOperand reg_temp(RegTranslator *t) {
+  int temp = 0;
+  while (temp < t->temps && t->temp_refs[temp] > 0)
+    temp += 1;
+  assert(temp < 2 * STACK_CAPACITY);
+  if (temp == t->temps)
+    t->temps += 1;
+  t->temp_refs[temp] = 1;
+  return (RegOperand){.reg = REG_TEMP + temp};
+}
+
+// Moves a constant (and an entry register, if asked) to a scratch register; takes over the caller's ownership
+RegOperand reg_in_temp(RegTranslator *t, RegOperand operand, bool entry_too) {
+  if (operand.is_const) {
+    RegOperand temp = reg_temp(t);
+    RegInstr *instr = reg_emit(t, REG_LOADK);
+    instr->d = temp.reg;
+    instr->k = operand.k;
+    return temp;
+  }
+  if (entry_too && operand.reg < REG_TEMP) {
+    RegOperand temp = reg_temp(t);
+    RegInstr *instr = reg_emit(t, REG_MOV);
+    instr->d = temp.reg;
+    instr->a = operand.reg;
+    return temp;
+  }
+  return operand;
+}
+
+// Pops the two topmost entries and pushes the register instr computes from them
+void reg_binop(RegTranslator *t, Instr instr) {
+  RegOperand b = reg_pop(t);
+  RegOperand a = reg_in_temp(t, reg_pop(t), false);
+  RegInstr *binop = reg_emit(t, (b.is_const ? REG_ADDK : REG_ADD) + (instr - INSTR_ADD));
+  reg_release(t, a);
+  reg_release(t, b);
+  RegOperand d = reg_temp(t);
+  binop->d = d.reg;
+  binop->a = a.reg;
+  binop->b = b.reg;
+  binop->k = b.k;
+  reg_push(t, d);
+  reg_release(t, d);
+}
+
+// A scratch register holding slot, owned by the caller
+RegOperand reg_load(RegTranslator *t, int slot) {
+  RegOperand d = reg_temp(t);
+  RegInstr *load = reg_emit(t, REG_LOAD);
+  load->d = d.reg;
+  load->target = slot;
+  return d;
+}
+
+// Pops the top entry into op, REG_STORE or REG_DUMP
+void reg_use(RegTranslator *t, RegOp op, int slot) {
+  RegOperand value = reg_in_temp(t, reg_pop(t), false);
+  RegInstr *use = reg_emit(t, op);
+  use->a = value.reg;
+  use->target = slot;
+  reg_release(t, value);
+}
+
+// Writes the abstract stack back, position p to register p, so that the next block finds its values in place
+void reg_flush(RegTranslator *t) {
+  // NOTE: registers below the base that are about to be overwritten are read first
+  for (int p = t->low; p < t->height; ++p) {
+    RegOperand *entry = reg_at(t, p);
+    if (entry->is_const || entry->reg >= REG_TEMP || entry->reg == p || entry->reg >= t->height)
+      continue;
+    RegOperand *overwritten = reg_at(t, entry->reg);
+    if (!overwritten->is_const && overwritten->reg == entry->reg)
+      continue;
+    int reg = entry->reg;
+    RegOperand temp = reg_in_temp(t, *entry, true);
+    for (int q = p; q < t->height; ++q) {
+      if (!reg_at(t, q)->is_const && reg_at(t, q)->reg == reg) {
+        *reg_at(t, q) = temp;
+        t->temp_refs[temp.reg - REG_TEMP] += 1;
+      }
+    }
+    reg_release(t, temp);
+  }
+
+  for (int p = t->low; p < t->height; ++p) {
+    RegOperand *entry = reg_at(t, p);
+    if (!entry->is_const && entry->reg == p)
+      continue;
+    RegInstr *instr = reg_emit(t, entry->is_const ? REG_LOADK : REG_MOV);
+    instr->d = p;
+    instr->a = entry->reg;
+    instr->k = entry->k;
+  }
+}
+
+// Translates the linked program of vm block by block. Jumps must take their target from a label address pushed
+// in the same block; otherwise the reason is reported and NULL returned, and the stack interpreter runs the program.
+RegProgram *regs_translate(const VM *vm) {
+  static_assert(REG_GE - REG_ADD == INSTR_GE - INSTR_ADD, "Update RegOp is required");
+  static_assert(REG_GEK - REG_ADDK == INSTR_GE - INSTR_ADD, "Update RegOp is required");
+  RegTranslator *t = calloc(1, sizeof(RegTranslator));
+  RegProgram *p = calloc(1, sizeof(RegProgram));
+  bool *leader = calloc(PROGRAM_CAPACITY, sizeof(bool));
+  if (t == NULL || p == NULL || leader == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  t->p = p;
+  memcpy(p->data, vm->data, sizeof(p->data));
+
+  program_leaders(vm, leader);
+  for (int ip = 0; ip < PROGRAM_CAPACITY; ++ip)
+    p->block_of[ip] = -1;
+  for (int ip = 0; ip < vm->ip; ip += instr_size(vm->program[ip])) {
+    if (leader[ip])
+      p->block_of[ip] = p->blocks_count++;
+  }
+  p->blocks = calloc(p->blocks_count, sizeof(RegBlock));
+  if (p->blocks == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+
+  const char *failure = NULL;
+  int failure_ip = 0;
+  RegBlock *block = NULL;
+  for (int ip = 0; ip < vm->ip && failure == NULL;) {
+    uint8_t opcode = vm->program[ip];
+    Instr instr = OPCODE_INSTR(opcode);
+    int next = ip + instr_size(opcode);
+    int operand = instr_size(opcode) > 1 ? operand_read(vm->program + ip + 1, OPCODE_WIDTH(opcode)) : 0;
+    if (leader[ip]) {
+      block = &p->blocks[p->block_of[ip]];
+      block->addr = ip;
+      block->first = p->count;
+      t->height = t->low = t->temps = 0;
+    }
+
+    RegInstr *end = NULL; // terminator of the block
+    // clang-format off
+    switch (instr) {
+    case INSTR_INT:
+    case INSTR_LABEL_ADDR: reg_push(t, (RegOperand){.is_const = true, .k = {.type = VAL_INT, .integer = operand}}); break;
+    case INSTR_FLOAT:      reg_push(t, (RegOperand){.is_const = true, .k = {.type = VAL_FLOAT, .integer = operand}}); break;
+    case INSTR_STRING:     reg_push(t, (RegOperand){.is_const = true, .k = string_literal(p->data, operand)}); break;
+
+    case INSTR_ADD:  case INSTR_SUB:  case INSTR_MUL:  case INSTR_DIV:  case INSTR_MOD:
+    case INSTR_ADDF: case INSTR_SUBF: case INSTR_MULF: case INSTR_DIVF:
+    case INSTR_EQ:   case INSTR_NEQ:  case INSTR_LT:   case INSTR_LE:   case INSTR_GT: case INSTR_GE:
+      reg_binop(t, instr);
+      break;
+
+    case INSTR_DUP:  reg_push(t, *reg_at(t, t->height - 1)); break;
+    case INSTR_OVER: reg_push(t, *reg_at(t, t->height - 2)); break;
+    case INSTR_DROP: reg_release(t, reg_pop(t)); break;
+    case INSTR_SWAP: {
+      RegOperand top = *reg_at(t, t->height - 1);
+      *reg_at(t, t->height - 1) = *reg_at(t, t->height - 2);
+      *reg_at(t, t->height - 2) = top;
+    } break;
+    case INSTR_ROT: {
+      RegOperand third = *reg_at(t, t->height - 3);
+      *reg_at(t, t->height - 3) = *reg_at(t, t->height - 2);
+      *reg_at(t, t->height - 2) = *reg_at(t, t->height - 1);
+      *reg_at(t, t->height - 1) = third;
+    } break;
+
+    case INSTR_STORE:
+    case INSTR_DUMP:
+      reg_use(t, instr == INSTR_STORE ? REG_STORE : REG_DUMP, operand);
+      break;
+
+    case INSTR_LOAD: {
+      RegOperand d = reg_load(t, operand);
+      reg_push(t, d);
+      reg_release(t, d);
+    } break;
+
+    case INSTR_LOOP: {
+      // NOTE: translated as the instructions it stands for, see compile_loop
+      LoopOperand l = loop_operand_read(vm->program + ip + 1);
+      if (l.slot >= 0) {
+        RegOperand counter = reg_load(t, l.slot);
+        reg_push(t, counter);
+        reg_release(t, counter);
+      }
+      reg_push(t, (RegOperand){.is_const = true, .k = {.type = VAL_INT, .integer = 1}});
+      reg_binop(t, INSTR_ADD);
+      reg_push(t, *reg_at(t, t->height - 1));
+      if (l.slot >= 0)
+        reg_use(t, REG_STORE, l.slot);
+      if (l.bound_slot >= 0) {
+        RegOperand bound = reg_load(t, l.bound_slot);
+        reg_push(t, bound);
+        reg_release(t, bound);
+      } else {
+        reg_push(t, (RegOperand){.is_const = true, .k = {.type = VAL_INT, .integer = l.value}});
+      }
+      reg_binop(t, INSTR_LT);
+      RegOperand cond = reg_in_temp(t, reg_pop(t), true);
+      reg_flush(t);
+      end = reg_emit(t, REG_JNZ);
+      end->a = cond.reg;
+      end->target = p->block_of[l.target];
+      end->next = next < vm->ip ? p->block_of[next] : -1;
+      reg_release(t, cond);
+    } break;
+    case INSTR_TRIPS: {
+      LoopOperand l = loop_operand_read(vm->program + ip + 1);
+      RegOperand constant = {.is_const = true, .k = {.type = VAL_INT, .integer = l.value}};
+      RegOperand bound = l.bound_slot >= 0 ? reg_load(t, l.bound_slot) : reg_in_temp(t, constant, false);
+      RegInstr *trips = reg_emit(t, REG_TRIPS);
+      trips->a = bound.reg;
+      trips->target = l.slot;
+      reg_release(t, bound);
+    } break;
+    case INSTR_SERIES: {
+      LoopOperand l = loop_operand_read(vm->program + ip + 1);
+      RegInstr *series = reg_emit(t, REG_SERIES);
+      series->target = l.slot;
+      series->next = l.target;
+      series->k = (Value){.type = VAL_INT, .integer = l.value};
+    } break;
+
+    case INSTR_JMP:
+    case INSTR_JZ:
+    case INSTR_JNZ: {
+      // NOTE: the condition is read after the flush, which may overwrite the register it is in
+      RegOperand cond = instr == INSTR_JMP ? (RegOperand){0} : reg_in_temp(t, reg_pop(t), true);
+      RegOperand addr = reg_pop(t);
+      if (!addr.is_const || addr.k.type != VAL_INT || addr.k.integer < 0 || addr.k.integer >= vm->ip ||
+          p->block_of[addr.k.integer] < 0) {
+        failure = "jump to a computed address";
+        failure_ip = ip;
+        break;
+      }
+      reg_flush(t);
+      end = reg_emit(t, instr == INSTR_JMP ? REG_JMP : instr == INSTR_JZ ? REG_JZ : REG_JNZ);
+      end->a = cond.reg;
+      end->target = p->block_of[addr.k.integer];
+      end->next = next < vm->ip ? p->block_of[next] : -1;
+      reg_release(t, cond);
+    } break;
+
+    case INSTR_CALL:
+      reg_flush(t);
+      end = reg_emit(t, REG_CALL);
+      end->target = p->block_of[operand];
+      end->next = p->block_of[next];
+      break;
+    case INSTR_RET:
+      reg_flush(t);
+      end = reg_emit(t, REG_RET);
+      break;
+    case INSTR_SNAPSHOT:
+      reg_flush(t);
+      end = reg_emit(t, REG_SNAPSHOT);
+      end->next = p->block_of[next];
+      break;
+    case INSTR_DONE:
+      reg_flush(t);
+      end = reg_emit(t, REG_DONE);
+      end->target = ip;
+      break;
+
+    default:
+      // NOTE: every core instruction is translated above, LABEL emits nothing
+      assert(instr_info[instr].group != GROUP_CORE && "unreachable");
+      failure = instr_group_names[instr_info[instr].group];
+      failure_ip = ip;
+      break;
+    }
+    // clang-format on
+
+    if (failure == NULL && end == NULL && next < vm->ip && leader[next]) {
+      reg_flush(t);
+      end = reg_emit(t, REG_JMP);
+      end->target = p->block_of[next];
+    }
+    if (end) {
+      // NOTE: scratch registers go right above the stack the block leaves, which the flush alone writes
+      int temps_base = t->height > 0 ? t->height : 0;
+      for (RegInstr *i = &p->code[block->first]; i <= end; ++i) {
+        i->d = i->d >= REG_TEMP ? temps_base + i->d - REG_TEMP : i->d;
+        i->a = i->a >= REG_TEMP ? temps_base + i->a - REG_TEMP : i->a;
+        i->b = i->b >= REG_TEMP ? temps_base + i->b - REG_TEMP : i->b;
+      }
+      end->height = t->height;
+      end->cost = end - &p->code[block->first] + 1;
+      block->low = t->low;
+      block->high = temps_base + t->temps;
+    }
+    ip = next;
+  }
+
+  free(leader);
+  free(t);
+  if (failure) {
+    fprintf(stderr, "Warning: %s at ip %d, running the stack bytecode instead of registers\n", failure, failure_ip);
+    regs_free(p);
+    return NULL;
+  }
+  return p;
+}
+
+void regs_free(RegProgram *p) {
+  if (p == NULL)
+    return;
+  free(p->code);
+  free(p->blocks);
+  free(p);
+}
+
+#define REG_BINOP(in_type, in_member, out_type, out_member, operator_)                            \
+  do {                                                                                          \
+    Value b = i->op >= REG_ADDK ? i->k : r[i->b];                                               \
+    assert(r[i->a].type == (in_type) && b.type == (in_type));                                   \
+    r[i->d] = (Value){.type = (out_type), .out_member = r[i->a].in_member operator_ b.in_member}; \
+    i += 1;                                                                                     \
+  } while (0)
+
+// Runs the register translation of the program from vm->ip, which must start a block. vm->ip and vm->sp are
+// only kept up to date between blocks, where the stack interpreter can take over.
+VMStatus vm_exec_regs(VM *vm, long budget) {
+  const RegProgram *p = vm->regs;
+  bool preemptive = budget != VM_BUDGET_UNLIMITED;
+  long start_budget = budget;
+  VMStatus status = VM_YIELDED;
+
+  if (OPCODE_INSTR(vm->program[vm->ip]) == INSTR_DONE)
+    return VM_HALTED;
+  if (p->block_of[vm->ip] < 0)
+    return vm_exec(vm, budget);
+
+  Value *r = vm->stack + vm->sp;
+  const RegBlock *block = &p->blocks[p->block_of[vm->ip]];
+  assert(r + block->low >= vm->stack && r + block->high <= vm->stack + STACK_CAPACITY);
+  const RegInstr *i = &p->code[block->first];
+  for (;;) {
+    int target;
+    // clang-format off
+    static_assert(REG_OP_COUNT == 44, "Update RegOp is required");
+    switch ((RegOp)i->op) {
+    case REG_MOV:   r[i->d] = r[i->a]; i += 1; break;
+    case REG_LOADK: r[i->d] = i->k; i += 1; break;
+    case REG_LOAD:  r[i->d] = vm->slots[i->target]; i += 1; break;
+    case REG_STORE: vm->slots[i->target] = r[i->a]; i += 1; break;
+    case REG_DUMP:  value_print(r[i->a]); i += 1; break;
+    case REG_TRIPS:
+      assert(vm->slots[i->target].type == VAL_INT && r[i->a].type == VAL_INT);
+      vm->loop_first = vm->slots[i->target].integer;
+      vm->loop_trips = loop_trips(vm->loop_first, r[i->a].integer);
+      vm->slots[i->target].integer = loop_last(vm->loop_first, vm->loop_trips);
+      i += 1;
+      break;
+    case REG_SERIES:
+      assert(vm->slots[i->target].type == VAL_INT);
+      vm->slots[i->target].integer =
+          loop_series(vm->slots[i->target].integer, vm->loop_first, vm->loop_trips, i->next, i->k.integer);
+      i += 1;
+      break;
+
+    case REG_ADD:  case REG_ADDK:  REG_BINOP(VAL_INT, integer, VAL_INT, integer, +); break;
+    case REG_SUB:  case REG_SUBK:  REG_BINOP(VAL_INT, integer, VAL_INT, integer, -); break;
+    case REG_MUL:  case REG_MULK:  REG_BINOP(VAL_INT, integer, VAL_INT, integer, *); break;
+    case REG_DIV:  case REG_DIVK:  REG_BINOP(VAL_INT, integer, VAL_INT, integer, /); break;
+    case REG_MOD:  case REG_MODK:  REG_BINOP(VAL_INT, integer, VAL_INT, integer, %); break;
+    case REG_ADDF: case REG_ADDFK: REG_BINOP(VAL_FLOAT, float_, VAL_FLOAT, float_, +); break;
+    case REG_SUBF: case REG_SUBFK: REG_BINOP(VAL_FLOAT, float_, VAL_FLOAT, float_, -); break;
+    case REG_MULF: case REG_MULFK: REG_BINOP(VAL_FLOAT, float_, VAL_FLOAT, float_, *); break;
+    case REG_DIVF: case REG_DIVFK: REG_BINOP(VAL_FLOAT, float_, VAL_FLOAT, float_, /); break;
+    case REG_EQ:   case REG_EQK:   REG_BINOP(VAL_INT, integer, VAL_INT, integer, ==); break;
+    case REG_NEQ:  case REG_NEQK:  REG_BINOP(VAL_INT, integer, VAL_INT, integer, !=); break;
+    case REG_LT:   case REG_LTK:   REG_BINOP(VAL_INT, integer, VAL_INT, integer, <); break;
+    case REG_LE:   case REG_LEK:   REG_BINOP(VAL_INT, integer, VAL_INT, integer, <=); break;
+    case REG_GT:   case REG_GTK:   REG_BINOP(VAL_INT, integer, VAL_INT, integer, >); break;
+    case REG_GE:   case REG_GEK:   REG_BINOP(VAL_INT, integer, VAL_INT, integer, >=); break;
+    // clang-format on
+
+    case REG_JMP:
+      target = i->target;
+      goto branch;
+    case REG_JZ:
+    case REG_JNZ:
+      assert(r[i->a].type == VAL_INT);
+      target = (r[i->a].integer != 0) == (i->op == REG_JNZ) ? i->target : i->next;
+      goto branch;
+    case REG_CALL:
+      assert(vm->rsp < RSTACK_CAPACITY);
+      vm->rstack[vm->rsp++] = p->blocks[i->next].addr;
+      target = i->target;
+      goto branch;
+    case REG_RET:
+      assert(vm->rsp >= 1);
+      target = p->block_of[vm->rstack[--vm->rsp]];
+      goto branch;
+
+    case REG_SNAPSHOT:
+    case REG_DONE:
+      budget -= i->cost;
+      r += i->height;
+      vm->ip = i->op == REG_DONE ? i->target : p->blocks[i->next].addr;
+      status = i->op == REG_DONE ? VM_HALTED : VM_SNAPSHOT;
+      goto leave;
+
+    default:
+      assert(0 && "unreachable");
+    }
+    continue;
+
+  branch:
+    budget -= i->cost;
+    r += i->height;
+    bool backward = i->op <= REG_JNZ && p->blocks[target].addr <= block->addr;
+    block = &p->blocks[target];
+    if (preemptive && (budget <= 0 || backward)) {
+      vm->ip = block->addr;
+      break;
+    }
+    assert(r + block->low >= vm->stack && r + block->high <= vm->stack + STACK_CAPACITY);
+    i = &p->code[block->first];
+  }
+
+leave:
+  vm->sp = r - vm->stack;
+  vm->instr_count += start_budget - budget;
+  return status;
+}
+
+// Highest stack depth reached since vm_reset, found from the slots that have been written
+int vm_max_sp(const VM *vm) {
+  int sp = STACK_CAPACITY;
+  while (sp > 0 && vm->stack[sp - 1].type == VAL_COUNT)
+    sp -= 1;
+  return sp;
+}
+
+// Restores the state a snapshot was taken with (a copy of the VM when it returned VM_SNAPSHOT).
+// NOTE: program, data and labels never change while running, so only the execution state is copied
+void vm_restore(VM *vm, const VM *snapshot) {
+  vm->ip = snapshot->ip;
+  vm->sp = snapshot->sp;
+  vm->rsp = snapshot->rsp;
+  memcpy(vm->stack, snapshot->stack, snapshot->sp * sizeof(Value));
+  memcpy(vm->rstack, snapshot->rstack, snapshot->rsp * sizeof(int));
+  memcpy(vm->slots, snapshot->slots, sizeof(vm->slots));
+  vm->instr_count = snapshot->instr_count;
+  vm->input_pos = snapshot->input_pos;
+  vm->input_records = snapshot->input_records;
+  vm->input_end = snapshot->input_end;
+  arena_release(&vm->strings, snapshot->strings.tail, snapshot->strings_mark);
+}
+
+void vm_reset(VM *vm) {
+  vm->ip = 0;
+  vm->sp = 0;
+  vm->rsp = 0;
+  memset(vm->slots, 0, sizeof(vm->slots));
+  // NOTE: slots never written keep VAL_COUNT, see vm_max_sp
+  for (int i = 0; i < STACK_CAPACITY; ++i)
+    vm->stack[i].type = VAL_COUNT;
+  vm->instr_count = 0;
+  vm->input_pos = 0;
+  vm->input_records = 0;
+  vm->input_end = false;
+  arena_destroy(&vm->strings);
+}
+
+ArenaChunk *arena_chunk_create(int chunk_size) {
+  ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+  if (chunk == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  chunk->next = NULL;
+  chunk->size = chunk_size;
+  chunk->offset = 0;
+  return chunk;
+}
+
+Arena arena_create(int chunk_size) {
+  ArenaChunk *chunk = arena_chunk_create(chunk_size);
+  return (Arena){chunk, chunk};
+}
+
+void arena_destroy(Arena *a) {
   ArenaChunk *chunk = a->chunk;
   while (chunk) {
     ArenaChunk *next = chunk->next;
     free(chunk);
     chunk = next;
   }
-  a->chunk = NULL;
+  a->chunk = NULL;
+  a->tail = NULL;
+}
+
+// Frees everything allocated since tail was at offset, everything when tail is NULL
+void arena_release(Arena *a, ArenaChunk *tail, int offset) {
+  if (tail == NULL) {
+    arena_destroy(a);
+    return;
+  }
+  ArenaChunk *chunk = tail->next;
+  while (chunk) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  tail->next = NULL;
+  tail->offset = offset;
+  a->tail = tail;
+}
+
+void *arena_alloc(Arena *a, int size) {
+  // NOTE: new chunks are appended, so fixed-size allocations (tokens) stay in allocation order.
+  // An allocation larger than the chunks gets a chunk of its own.
+  ArenaChunk *chunk = a->tail;
+  if (chunk->offset + size > chunk->size) {
+    chunk = arena_chunk_create(size > a->chunk->size ? size : a->chunk->size);
+    a->tail->next = chunk;
+    a->tail = chunk;
+  }
+
+  void *ptr = chunk->mem + chunk->offset;
+  chunk->offset += size;
+  return ptr;
+}
+
+#define TOKENS_CHUNK_SIZE (1024 * sizeof(Token))
+_Thread_local Arena tokens;
+_Thread_local int tp;         // token pointer
+_Thread_local ArenaChunk *cp; // chunk pointer
+
+void tokens_init(void) { tokens = arena_create(TOKENS_CHUNK_SIZE); }
+void tokens_free(void) { arena_destroy(&tokens); }
+
+Token *make_token(const Token *source) {
+  Token *token = arena_alloc(&tokens, sizeof(Token));
+  *token = *source;
+  return token;
+}
+
+int front_end_jobs(void) {
+  return module_jobs > 0 ? module_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+// Tokenizes source into the token arena of this thread, splitting sources of several LEX_PART_MIN_BYTES at
+// newlines and lexing the parts concurrently. Lines are lexed independently of each other (strings cannot span
+// lines), so the stitched token stream is the same as the one of a single thread.
+bool tokenize(const char *source, const char *filename) {
+  if (NULL == source)
+    return true;
+
+  Location loc = {.filename = filename, .col = 1, .line = 0};
+  int size = strlen(source);
+  int parts_count = front_end_jobs();
+  if (parts_count > size / LEX_PART_MIN_BYTES)
+    parts_count = size / LEX_PART_MIN_BYTES;
+  if (parts_count <= 1)
+    return tokenize_lines((SV){source, size}, loc, true);
+
+  LexPart *parts = calloc(parts_count, sizeof(LexPart));
+  pthread_t *threads = malloc(parts_count * sizeof(pthread_t));
+  if (parts == NULL || threads == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+
+  // NOTE: the last part must not be empty, its lines decide the location of TOK_EOF
+  const char *begin = source, *end = source + size;
+  int count = 0;
+  for (int i = 1; i <= parts_count && begin < end; ++i) {
+    const char *target = source + (long)size * i / parts_count;
+    const char *split = i < parts_count ? memchr(target, '\n', end - target) : NULL;
+    split = split ? split + 1 : end;
+    if (split <= begin)
+      continue;
+    parts[count++] = (LexPart){.source = {begin, split - begin}, .loc = loc, .eof = split == end};
+    begin = split;
+  }
+
+  for (int i = 0; i < count; ++i)
+    pthread_create(&threads[i], NULL, lex_count_lines, &parts[i]);
+  for (int i = 0; i < count; ++i)
+    pthread_join(threads[i], NULL);
+  for (int i = 1; i < count; ++i)
+    parts[i].loc.line += parts[i - 1].loc.line;
+  for (int i = count - 1; i > 0; --i)
+    parts[i].loc.line = parts[i - 1].loc.line;
+  parts[0].loc.line = 0;
+
+  for (int i = 0; i < count; ++i)
+    pthread_create(&threads[i], NULL, lex_part, &parts[i]);
+  for (int i = 0; i < count; ++i)
+    pthread_join(threads[i], NULL);
+
+  // NOTE: next_token walks the chunks in order, so the parts are stitched by chaining their chunks
+  bool result = true;
+  for (int i = 0; i < count; ++i) {
+    tokens.tail->next = parts[i].tokens.chunk;
+    tokens.tail = parts[i].tokens.tail;
+    result = result && parts[i].ok;
+  }
+
+  free(threads);
+  free(parts);
+  return result;
+}
+
+// Tokenizes source, a new version of old, reusing the tokens old_tokens has for the lines both share at their
+// start and at their end. Only the lines in between are lexed; the tokens after them move by the lines the
+// edit added or removed. The stream is the one tokenize would give, and reused counts the tokens not lexed.
+// NOTE: an edit still costs time in the size of the file, not of the change: the shared ends are found by comparing
+// both versions and every reused token is copied, the compiler retypes the tokens of the stream in place
+bool tokenize_edit(SV old, const Arena *old_tokens, SV source, const char *filename, int *reused) {
+  int common = old.len < source.len ? old.len : source.len;
+  int prefix = 0;
+  while (prefix < common && old.data[prefix] == source.data[prefix])
+    prefix += 1;
+  // NOTE: both ends are cut back to whole lines, as tokens never span lines
+  while (!at_line_start(source, prefix))
+    prefix -= 1;
+  int suffix = 0;
+  while (suffix < common - prefix && old.data[old.len - 1 - suffix] == source.data[source.len - 1 - suffix])
+    suffix += 1;
+  while (suffix > 0 && !(at_line_start(old, old.len - suffix) && at_line_start(source, source.len - suffix)))
+    suffix -= 1;
+  // NOTE: the location of TOK_EOF comes from the last line, which is lexed again unless the shared end has it
+  if (suffix == 0) {
+    int last = source.len > 0 && source.data[source.len - 1] == '\n' ? source.len - 1 : source.len;
+    while (!at_line_start(source, last))
+      last -= 1;
+    if (prefix > last)
+      prefix = last;
+  }
+
+  int prefix_lines = 0, old_lines = 0, new_lines = 0;
+  for (const char *p = source.data; (p = memchr(p, '\n', source.data + prefix - p)); ++p)
+    prefix_lines += 1;
+  for (const char *p = old.data + prefix; (p = memchr(p, '\n', old.data + old.len - suffix - p)); ++p)
+    old_lines += 1;
+  for (const char *p = source.data + prefix; (p = memchr(p, '\n', source.data + source.len - suffix - p)); ++p)
+    new_lines += 1;
+
+  *reused = 0;
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass == 1) {
+      SV middle = {source.data + prefix, source.len - suffix - prefix};
+      if (!tokenize_lines(middle, (Location){.filename = filename, .line = prefix_lines, .col = 1}, suffix == 0))
+        return false;
+      if (suffix == 0)
+        return true;
+    }
+    for (const ArenaChunk *chunk = old_tokens->chunk; chunk; chunk = chunk->next) {
+      for (const Token *t = (const Token *)chunk->mem; (const char *)(t + 1) <= chunk->mem + chunk->offset; ++t) {
+        int offset = t->source.data - old.data;
+        Token token = *t;
+        if (pass == 0 && offset < prefix) {
+          token.source.data = source.data + offset;
+        } else if (pass == 1 && offset >= old.len - suffix) {
+          token.source.data = source.data + offset + source.len - old.len;
+          token.Location.line += new_lines - old_lines;
+        } else {
+          continue;
+        }
+        make_token(&token);
+        *reused += 1;
+      }
+    }
+  }
+  return true;
+}
+
+static inline bool at_line_start(SV sv, int at) {
+  return at == 0 || sv.data[at - 1] == '\n';
+}
+
+// Counts the lines of a part into its loc.line, the first step of turning them into line numbers
+void *lex_count_lines(void *arg) {
+  LexPart *part = arg;
+  int lines = 0;
+  const char *end = part->source.data + part->source.len;
+  for (const char *p = part->source.data; (p = memchr(p, '\n', end - p)); ++p)
+    lines += 1;
+  // NOTE: a last line without a newline is a line too
+  if (part->source.len > 0 && end[-1] != '\n')
+    lines += 1;
+  part->loc.line = lines;
+  return NULL;
+}
+
+void *lex_part(void *arg) {
+  LexPart *part = arg;
+  tokens_init();
+  part->ok = tokenize_lines(part->source, part->loc, part->eof);
+  part->tokens = tokens;
+  return NULL;
+}
+
+// Cuts the next token off line, which starts with it: a string, without its quotes, or a word. Returns false on a
+// string that does not end on its line.
+static inline bool lex_next(SV *line, SV *text, bool *string) {
+  *string = *line->data == '"';
+  if (!*string) {
+    const char *space = memchr(line->data, ' ', line->len);
+    int len = space ? space - line->data : line->len;
+    *text = sv_stripr((SV){line->data, len});
+    *line = space ? (SV){space + 1, line->len - len - 1} : (SV){line->data + len, 0};
+    return true;
+  }
+  int i = 1;
+  while (i < line->len && line->data[i] != '"')
+    i += 1;
+  if (i >= line->len)
+    return false;
+  *text = sv_slice(*line, 1, i - 1);
+  *line = sv_slice(*line, i + 1, line->len - i - 1);
+  return true;
+}
+
+// Tokenizes lines; loc.line is the number of lines before them and loc.col the column the first one starts at.
+// Only the end of the source gets TOK_EOF.
+bool tokenize_lines(SV sv, Location loc, bool eof) {
+  Location prev_loc = loc;
+  int last_token_len = 0;
+  int first_col = loc.col;
+  while (true) {
+    SV line = sv_chop(&sv, svl("\n"));
+    if (line.len <= 0) {
+      if (!eof)
+        return true;
+      if (loc.line == prev_loc.line)
+        loc.col += last_token_len;
+      make_token(&(Token){loc, sv, TOK_EOF});
+      return true;
+    }
+
+    const char *line_start = line.data - (first_col - 1);
+    first_col = 1;
+    loc.line += 1;
+    loc.col = 1;
+
+    while (line.len > 0) {
+      line = sv_strip(line);
+      if (line.len <= 0)
+        break;
+
+      SV token_text;
+      TokenType type = TOK_COUNT;
+      bool string;
+      if (!lex_next(&line, &token_text, &string))
+        return false; // TODO: parse error
+      if (string) {
+        loc.col = token_text.data - line_start;
+        type = TOK_STR;
+      } else {
+        loc.col = token_text.data - line_start + 1;
+
+        if ((token_text.len > 0 && isdigit(token_text.data[0])) || (token_text.len > 1 && token_text.data[0] == '-' && isdigit(token_text.data[1]))) {
+          type = TOK_INT;
+          SV tmp = token_text;
+          while (tmp.len > 0) {
+            sv_chop(&tmp, svl("."));
+            if (tmp.data[-1] == '.') {
+              if (type != TOK_FLOAT)
+                type = TOK_FLOAT;
+              else
+                return false; // TODO: parse error
+            } else
+              break;
+          }
+        } else if (token_text.len > 0 && token_text.data[0] == '\'') {
+          type = TOK_LABEL;
+        } else if (token_text.len > 0 && token_text.data[0] == '&') {
+          type = TOK_LABEL_ADDR;
+        } else if (token_text.len > 1 && token_text.data[0] == '@') {
+          type = TOK_LOAD;
+        } else if (token_text.len > 1 && token_text.data[0] == '!' && !sv_eq(token_text, keywords[TOK_NEQ])) {
+          type = TOK_STORE;
+        } else {
+          // keyword
+          for (int i = 0; i < TOK_KW_COUNT; ++i) {
+            if (sv_eq(token_text, keywords[i])) {
+              type = (TokenType)i;
+              break;
+            }
+          }
+          // anything else names a definition, resolved by compile
+          if (TOK_COUNT == type)
+            type = TOK_WORD;
+        }
+      }
+      last_token_len = token_text.len;
+      prev_loc = loc;
+      make_token(&(Token){loc, token_text, type});
+    }
+  }
+
+  return true;
+}
+
+Token *next_token(void) {
+  if (!cp)
+    cp = tokens.chunk;
+
+  // NOTE: chunks of parts lexed in parallel may be empty
+  while ((tp + 1) * (int)sizeof(Token) > cp->offset) {
+    tp = 0;
+    cp = cp->next;
+    if (!cp) {
+      fprintf(stderr, "Error: Unexpected EOF");
+      exit(1);
+    }
+  }
+
+  Token *token_arr = (Token *)cp->mem;
+
+  return &token_arr[tp++];
+}
+
+void token_print(const Token *token) {
+  static_assert(TOK_COUNT == 52, "Update TokenType is required");
+  switch (token->type) {
+  case TOK_INT:
+    printf("int %.*s\n", token->source.len, token->source.data);
+    break;
+  case TOK_FLOAT:
+    printf("float %.*s\n", token->source.len, token->source.data);
+    break;
+  case TOK_STR:
+    printf("str %.*s\n", token->source.len, token->source.data);
+    break;
+  case TOK_PLUS:
+  case TOK_MINUS:
+  case TOK_STAR:
+  case TOK_SLASH:
+  case TOK_MOD:
+  case TOK_PLUS_DOT:
+  case TOK_MINUS_DOT:
+  case TOK_STAR_DOT:
+  case TOK_SLASH_DOT:
+  case TOK_EQ:
+  case TOK_NEQ:
+  case TOK_LT:
+  case TOK_LE:
+  case TOK_GT:
+  case TOK_GE:
+  case TOK_DOT:
+  case TOK_DUP:
+  case TOK_OVER:
+  case TOK_SWAP:
+  case TOK_DROP:
+  case TOK_ROT:
+  case TOK_JMP:
+  case TOK_JZ:
+  case TOK_JNZ:
+  case TOK_COLON:
+  case TOK_SEMICOLON:
+  case TOK_SNAPSHOT:
+  case TOK_INCLUDE:
+  case TOK_CONCAT:
+  case TOK_LENGTH:
+  case TOK_COMPARE:
+  case TOK_SUBSTR:
+  case TOK_TO_INT:
+  case TOK_TO_FLOAT:
+  case TOK_TO_STRING:
+  case TOK_READ_INT:
+  case TOK_READ_FLOAT:
+  case TOK_READ_LINE:
+  case TOK_END_OF_INPUT:
+  case TOK_PAR_SUM:
+  case TOK_PAR_MIN:
+  case TOK_PAR_MAX:
+  case TOK_LABEL:
+  case TOK_LABEL_ADDR:
+    printf("%.*s\n", token->source.len, token->source.data);
+    break;
+  case TOK_WORD:
+    printf("word %.*s\n", token->source.len, token->source.data);
+    break;
+  case TOK_STORE:
+  case TOK_LOAD:
+    printf("%.*s\n", token->source.len, token->source.data);
+    break;
+  case TOK_EOF:
+    printf("EOF\n");
+    break;
+  default:
+    assert(0 && "unreachable");
+  }
+}
+
+static inline const char *value_chars(const Value *value) {
+  return value->len <= STRING_INLINE_CAPACITY ? value->small : value->cstr;
+}
+
+// The string literal at offset in data, a view of it unless it fits inline
+Value string_literal(const char *data, int offset) {
+  uint16_t len;
+  memcpy(&len, data + offset - sizeof(len), sizeof(len));
+  Value value = {.type = VAL_STR, .len = len};
+  if (len <= STRING_INLINE_CAPACITY)
+    memcpy(value.small, data + offset, len);
+  else
+    value.cstr = (char *)data + offset;
+  return value;
+}
+
+// Room for a string that does not fit inline. The strings of a vm are only freed together, so building one
+// costs a bump of the arena pointer and a malloc per chunk.
+char *strings_alloc(VM *vm, int size) {
+  if (vm->strings.chunk == NULL)
+    vm->strings = arena_create(STRINGS_CHUNK_SIZE);
+  return arena_alloc(&vm->strings, size);
+}
+
+Value string_make(VM *vm, const char *chars, int len) {
+  Value value = {.type = VAL_STR, .len = len};
+  char *dest = len <= STRING_INLINE_CAPACITY ? value.small : (value.cstr = strings_alloc(vm, len));
+  memcpy(dest, chars, len);
+  return value;
+}
+
+Value string_concat(VM *vm, Value a, Value b) {
+  Value value = {.type = VAL_STR, .len = a.len + b.len};
+  char *dest = value.len <= STRING_INLINE_CAPACITY ? value.small : (value.cstr = strings_alloc(vm, value.len));
+  memcpy(dest, value_chars(&a), a.len);
+  memcpy(dest + a.len, value_chars(&b), b.len);
+  return value;
+}
+
+// -1, 0 or 1 as a sorts before, with or after b, byte by byte
+int string_compare(Value a, Value b) {
+  int result = memcmp(value_chars(&a), value_chars(&b), a.len < b.len ? a.len : b.len);
+  if (result == 0)
+    result = a.len - b.len;
+  return (result > 0) - (result < 0);
+}
+
+// count bytes of a from start, both clamped to the string
+Value string_substr(VM *vm, Value a, int start, int count) {
+  start = start < 0 ? 0 : start > a.len ? a.len : start;
+  count = count < 0 ? 0 : count > a.len - start ? a.len - start : count;
+  // NOTE: a substring too long to be inline can only come from a string outside the value, which lives as long
+  if (count > STRING_INLINE_CAPACITY)
+    return (Value){.type = VAL_STR, .len = count, .cstr = a.cstr + start};
+  return string_make(vm, value_chars(&a) + start, count);
+}
+
+Value value_to_int(Value value) {
+  static_assert(VAL_COUNT == 3, "Update ValueType is required");
+  switch (value.type) {
+  case VAL_INT:
+    return value;
+  case VAL_FLOAT:
+    return (Value){.type = VAL_INT, .integer = (int)value.float_};
+  case VAL_STR: {
+    // NOTE: strings are not terminated, a number has to be copied out of them to be parsed
+    char buffer[64];
+    int len = value.len < (int)sizeof(buffer) - 1 ? value.len : (int)sizeof(buffer) - 1;
+    memcpy(buffer, value_chars(&value), len);
+    buffer[len] = '\0';
+    return (Value){.type = VAL_INT, .integer = (int)strtol(buffer, NULL, 10)};
+  }
+  default:
+    assert(0 && "unreachable");
+  }
+}
+
+Value value_to_float(Value value) {
+  static_assert(VAL_COUNT == 3, "Update ValueType is required");
+  switch (value.type) {
+  case VAL_INT:
+    return (Value){.type = VAL_FLOAT, .float_ = value.integer};
+  case VAL_FLOAT:
+    return value;
+  case VAL_STR: {
+    char buffer[64];
+    int len = value.len < (int)sizeof(buffer) - 1 ? value.len : (int)sizeof(buffer) - 1;
+    memcpy(buffer, value_chars(&value), len);
+    buffer[len] = '\0';
+    return (Value){.type = VAL_FLOAT, .float_ = strtof(buffer, NULL)};
+  }
+  default:
+    assert(0 && "unreachable");
+  }
+}
+
+// Formats ints and floats the way `.` prints them
+Value value_to_string(VM *vm, Value value) {
+  char buffer[32];
+  static_assert(VAL_COUNT == 3, "Update ValueType is required");
+  switch (value.type) {
+  case VAL_INT:
+    return string_make(vm, buffer, snprintf(buffer, sizeof(buffer), "%d", value.integer));
+  case VAL_FLOAT:
+    return string_make(vm, buffer, snprintf(buffer, sizeof(buffer), "%g", value.float_));
+  case VAL_STR:
+    return value;
+  default:
+    assert(0 && "unreachable");
+  }
+}
+
+// Maps the input or reserves the space it is read into, see Input. When that fails it stays empty, so the first read
+// finds its end.
+void input_open(void) {
+  const char *name = input_path ? input_path : "stdin";
+  int fd = input_path ? open(input_path, O_RDONLY) : STDIN_FILENO;
+  struct stat st;
+  input.ended = true;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "Error: could not open the input %s: %s\n", name, strerror(errno));
+    input_failed = true;
+    return;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    input.mapped = true;
+    if (st.st_size > 0) {
+      void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map the input %s: %s\n", name, strerror(errno));
+        input_failed = true;
+      } else {
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        input.data = data;
+        input.len = st.st_size;
+      }
+    }
+    if (input_path)
+      close(fd);
+    return;
+  }
+
+  // NOTE: only the pages read into are backed, a pipe or a terminal is read as far as the reads need and no further
+  long reserve = 2 * INPUT_RESERVE;
+  void *data = MAP_FAILED;
+  while (data == MAP_FAILED && reserve > INPUT_CHUNK_SIZE) {
+    reserve /= 2;
+    data = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Error: could not reserve memory for the input %s: %s\n", name, strerror(errno));
+    input_failed = true;
+    return;
+  }
+  input.data = data;
+  input.reserved = reserve;
+  input.fd = fd;
+  input.ended = false;
+}
+
+// Reads an input that is not mapped until from pos on it holds what a read needs: a whole field, up to a blank after
+// its first non-blank, a whole line or all of it. Returns the length of the input read so far, the end for the read.
+long input_fill(long pos, InputNeed need) {
+  if (input.mapped)
+    return input.len;
+  // NOTE: what is before len is never written again, only a read that needs more than that takes the lock
+  long len = atomic_load_explicit(&input.len, memory_order_acquire);
+  long scanned = pos;
+  bool field_started = false, locked = false;
+  for (;;) {
+    bool whole = false;
+    if (need == INPUT_LINE) {
+      whole = scanned < len && memchr(input.data + scanned, '\n', len - scanned);
+      scanned = len;
+    } else if (need == INPUT_FIELD) {
+      for (; scanned < len && !whole; ++scanned) {
+        bool blank = input_blank(input.data[scanned]);
+        whole = blank && field_started;
+        field_started = field_started || !blank;
+      }
+    }
+    if (whole)
+      break;
+    if (!locked) {
+      pthread_mutex_lock(&input_lock);
+      locked = true;
+      len = input.len; // another vm may have read more meanwhile
+      continue;
+    }
+    if (input.ended)
+      break;
+
+    const char *name = input_path ? input_path : "stdin";
+    long room = input.reserved - len;
+    if (room == 0) {
+      fprintf(stderr, "Error: the input %s is larger than the %ld bytes reserved for it\n", name, input.reserved);
+      input.ended = true;
+      break;
+    }
+    ssize_t n = read(input.fd, input.data + len, room < INPUT_CHUNK_SIZE ? room : INPUT_CHUNK_SIZE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      fprintf(stderr, "Error: could not read the input %s: %s\n", name, strerror(errno));
+    if (n <= 0) {
+      input.ended = true;
+      if (input_path)
+        close(input.fd);
+    } else {
+      len += n;
+      atomic_store_explicit(&input.len, len, memory_order_release);
+    }
+  }
+  if (locked)
+    pthread_mutex_unlock(&input_lock);
+  return len;
+}
+
+const Input *input_get(VM *vm) {
+  if (vm->input == NULL) {
+    pthread_once(&input_once, input_open);
+    vm->input = &input;
+  }
+  return vm->input;
+}
+
+// NOTE: a block --lazy has not compiled yet may read as well
+bool program_reads_input(const VM *vm) {
+  if (vm->lazy && vm->lazy->compiled < vm->lazy->deferred)
+    return true;
+  for (int ip = 0; ip < vm->program_size; ip += instr_size(vm->program[ip])) {
+    if (instr_info[OPCODE_INSTR(vm->program[ip])].group == GROUP_INPUT)
+      return true;
+  }
+  return false;
+}
+
+static inline bool input_blank(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// The next field as an int: an optional sign and digits, up to the blank after it. Like to-int, a field that
+// does not start with a number reads as 0. At the end of the input it pushes 0 and sets the flag of eof.
+Value input_read_int(VM *vm) {
+  const Input *in = input_get(vm);
+  long len = input_fill(vm->input_pos, INPUT_FIELD);
+  const char *p = in->data + vm->input_pos, *end = in->data + len;
+  while (p < end && input_blank(*p))
+    ++p;
+  if (p == end) {
+    vm->input_pos = len;
+    vm->input_end = true;
+    return (Value){.type = VAL_INT, .integer = 0};
+  }
+
+  bool negative = *p == '-';
+  if (*p == '-' || *p == '+')
+    ++p;
+  unsigned value = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p)
+    value = 10 * value + (*p - '0');
+  while (p < end && !input_blank(*p))
+    ++p;
+  vm->input_pos = p - in->data;
+  vm->input_records += 1;
+  return (Value){.type = VAL_INT, .integer = (int)(negative ? 0u - value : value)};
+}
+
+// The next field as a float, decimal with an optional exponent, read the way read-int reads ints
+Value input_read_float(VM *vm) {
+  static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const Input *in = input_get(vm);
+  long len = input_fill(vm->input_pos, INPUT_FIELD);
+  const char *p = in->data + vm->input_pos, *end = in->data + len;
+  while (p < end && input_blank(*p))
+    ++p;
+  if (p == end) {
+    vm->input_pos = len;
+    vm->input_end = true;
+    return (Value){.type = VAL_FLOAT, .float_ = 0};
+  }
+
+  bool negative = *p == '-';
+  if (*p == '-' || *p == '+')
+    ++p;
+  // NOTE: digits that no longer fit in the mantissa only scale it, a float keeps far fewer anyway
+  uint64_t mantissa = 0;
+  int exponent = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+    if (mantissa <= (UINT64_MAX - 9) / 10)
+      mantissa = 10 * mantissa + (*p - '0');
+    else
+      exponent += 1;
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && *p >= '0' && *p <= '9'; ++p) {
+      if (mantissa <= (UINT64_MAX - 9) / 10) {
+        mantissa = 10 * mantissa + (*p - '0');
+        exponent -= 1;
+      }
+    }
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    ++p;
+    bool exponent_negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+      ++p;
+    int e = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p)
+      e = e < 1000 ? 10 * e + (*p - '0') : e;
+    exponent += exponent_negative ? -e : e;
+  }
+  while (p < end && !input_blank(*p))
+    ++p;
+
+  double value = (double)mantissa;
+  if (exponent >= 0 && exponent <= 22)
+    value *= powers[exponent];
+  else if (exponent < 0 && exponent >= -22)
+    value /= powers[-exponent];
+  else
+    value *= pow(10, exponent);
+  vm->input_pos = p - in->data;
+  vm->input_records += 1;
+  return (Value){.type = VAL_FLOAT, .float_ = negative ? -value : value};
+}
+
+// The rest of the current line without its line break, a view of the input unless it fits inline. At the end
+// of the input it pushes an empty string and sets the flag of eof.
+Value input_read_line(VM *vm) {
+  const Input *in = input_get(vm);
+  const char *p = in->data + vm->input_pos, *end = in->data + input_fill(vm->input_pos, INPUT_LINE);
+  if (p == end) {
+    vm->input_end = true;
+    return (Value){.type = VAL_STR, .len = 0};
+  }
+
+  const char *newline = memchr(p, '\n', end - p);
+  const char *line_end = newline ? newline : end;
+  vm->input_pos = (newline ? newline + 1 : end) - in->data;
+  vm->input_records += 1;
+  if (line_end > p && line_end[-1] == '\r')
+    --line_end;
+  Value value = {.type = VAL_STR, .len = line_end - p};
+  if (value.len <= STRING_INLINE_CAPACITY)
+    memcpy(value.small, p, value.len);
+  else
+    value.cstr = (char *)p;
+  return value;
+}
+
+// Makes name callable from programs compiled afterwards, taking pops values from the stack and leaving pushes.
+// NOTE: keywords are lexed before words are resolved, a native cannot replace one
+bool native_register(const char *name, int pops, int pushes, NativeFn fn) {
+  if (natives_count == NATIVES_CAPACITY || native_find(sv(name)) || pops < 0 || pushes < 0) {
+    fprintf(stderr, "Error: could not register the native '%s'\n", name);
+    return false;
+  }
+  natives[natives_count++] = (Native){sv(name), pops, pushes, fn};
+  return true;
+}
+
+const Native *native_find(SV name) {
+  for (int i = 0; i < natives_count; ++i)
+    if (sv_eq(natives[i].name, name))
+      return &natives[i];
+  return NULL;
+}
+
+void native_sqrt(VM *vm, Value *args) {
+  (void)vm;
+  args[0] = (Value){.type = VAL_FLOAT, .float_ = sqrtf(value_to_float(args[0]).float_)};
+}
+
+void native_pow(VM *vm, Value *args) {
+  (void)vm;
+  args[0] = (Value){.type = VAL_FLOAT, .float_ = powf(value_to_float(args[0]).float_, value_to_float(args[1]).float_)};
+}
+
+void native_sin(VM *vm, Value *args) {
+  (void)vm;
+  args[0] = (Value){.type = VAL_FLOAT, .float_ = sinf(value_to_float(args[0]).float_)};
+}
+
+void native_cos(VM *vm, Value *args) {
+  (void)vm;
+  args[0] = (Value){.type = VAL_FLOAT, .float_ = cosf(value_to_float(args[0]).float_)};
+}
+
+void native_exp(VM *vm, Value *args) {
+  (void)vm;
+  args[0] = (Value){.type = VAL_FLOAT, .float_ = expf(value_to_float(args[0]).float_)};
+}
+
+void native_log(VM *vm, Value *args) {
+  (void)vm;
+  args[0] = (Value){.type = VAL_FLOAT, .float_ = logf(value_to_float(args[0]).float_)};
+}
+
+void native_floor(VM *vm, Value *args) {
+  (void)vm;
+  args[0] = (Value){.type = VAL_INT, .integer = (int)floorf(value_to_float(args[0]).float_)};
+}
+
+void native_abs(VM *vm, Value *args) {
+  (void)vm;
+  int a = value_to_int(args[0]).integer;
+  args[0] = (Value){.type = VAL_INT, .integer = a < 0 ? -a : a};
+}
+
+void native_min(VM *vm, Value *args) {
+  (void)vm;
+  int a = value_to_int(args[0]).integer, b = value_to_int(args[1]).integer;
+  args[0] = (Value){.type = VAL_INT, .integer = a < b ? a : b};
+}
+
+void native_max(VM *vm, Value *args) {
+  (void)vm;
+  int a = value_to_int(args[0]).integer, b = value_to_int(args[1]).integer;
+  args[0] = (Value){.type = VAL_INT, .integer = a > b ? a : b};
+}
+
+// floor of the square root, 0 for negative numbers
+void native_isqrt(VM *vm, Value *args) {
+  (void)vm;
+  int n = value_to_int(args[0]).integer;
+  int root = n > 0 ? (int)sqrt((double)n) : 0;
+  // NOTE: the double is exact for every int, the correction only guards against the rounding of sqrt
+  while ((long long)root * root > n)
+    root -= 1;
+  while ((long long)(root + 1) * (root + 1) <= n)
+    root += 1;
+  args[0] = (Value){.type = VAL_INT, .integer = root};
+}
+
+// FNV-1a of the bytes of a string, or of the 4 bytes of an int or float
+void native_hash(VM *vm, Value *args) {
+  (void)vm;
+  const char *data = args[0].type == VAL_STR ? value_chars(&args[0]) : (const char *)&args[0].integer;
+  int len = args[0].type == VAL_STR ? args[0].len : (int)sizeof(args[0].integer);
+  args[0] = (Value){.type = VAL_INT, .integer = (int)(fnv1a(data, len) & INT_MAX)};
+}
+
+void natives_init(void) {
+  // clang-format off
+  native_register("sqrt",  1, 1, native_sqrt);
+  native_register("pow",   2, 1, native_pow);
+  native_register("sin",   1, 1, native_sin);
+  native_register("cos",   1, 1, native_cos);
+  native_register("exp",   1, 1, native_exp);
+  native_register("log",   1, 1, native_log);
+  native_register("floor", 1, 1, native_floor);
+  native_register("abs",   1, 1, native_abs);
+  native_register("min",   2, 1, native_min);
+  native_register("max",   2, 1, native_max);
+  native_register("isqrt", 1, 1, native_isqrt);
+  native_register("hash",  1, 1, native_hash);
+  // clang-format on
+}
+
+void value_print(Value value) {
+  static_assert(VAL_COUNT == 3, "Update ValueType is required");
+  switch (value.type) {
+  case VAL_INT:
+    printf("%d\n", value.integer);
+    break;
+  case VAL_STR:
+    printf("%.*s\n", value.len, value_chars(&value));
+    break;
+  case VAL_FLOAT:
+    printf("%g\n", value.float_);
+    break;
+  default:
+    assert(0 && "unreachable");
+  }
+}
+
+void vm_dump_stack(const VM *vm) {
+  printf("stack[%d]:\n", vm->sp);
+  for (int i = 0; i < vm->sp; ++i) {
+    printf("  ");
+    value_print(vm->stack[i]);
+  }
+}
+
+void vm_dump(const VM *vm) {
+  printf("VM:\n");
+
+  printf("ip = %d\n", vm->ip);
+  printf("program:\n");
+  for (int ip = 0; ip < PROGRAM_CAPACITY; ip += instr_size(vm->program[ip])) {
+    uint8_t opcode = vm->program[ip];
+    Instr instr = OPCODE_INSTR(opcode);
+    if (instr == INSTR_DONE || instr >= INSTR_COUNT)
+      break;
+
+    const InstrInfo *info = &instr_info[instr];
+    long long operand = info->operand == OPERAND_NONE ? 0 : operand_read(vm->program + ip + 1, OPCODE_WIDTH(opcode));
+    static_assert(OPERAND_COUNT == 8, "Update OperandKind is required");
+    switch (info->operand) {
+    case OPERAND_NONE:
+      printf("%s ", info->mnemonic);
+      break;
+    case OPERAND_INT:
+    case OPERAND_ADDR:
+      printf("%s(%lld) ", info->mnemonic, operand);
+      break;
+    case OPERAND_FLOAT: {
+      Word value = {.integer = operand};
+      printf("%s(%g) ", info->mnemonic, value.float_);
+    } break;
+    case OPERAND_DATA:
+      printf("%s(\"%s\") ", info->mnemonic, vm->data + operand);
+      break;
+    case OPERAND_NATIVE:
+      printf("%s(%.*s) ", info->mnemonic, svf(natives[operand].name));
+      break;
+    case OPERAND_LOOP: {
+      LoopOperand l = loop_operand_read(vm->program + ip + 1);
+      printf("%s(%d, %d, %d, %d) ", info->mnemonic, l.target, l.slot, l.bound_slot, l.value);
+    } break;
+    case OPERAND_LABEL:
+    case OPERAND_COUNT:
+      assert(0 && "unreachable");
+    }
+  }
+  printf("\n");
+
+  vm_dump_stack(vm);
+
+  printf("data: is not supported yet\n");
+}
+
+const char *instr_to_cstr(Instr instr) {
+  assert(instr < INSTR_COUNT);
+  return instr_info[instr].name;
+}
+
+int compiler_get_label_addr(SV label_name) {
+  for (int i = 0; i < vm.labels_count; ++i) {
+    if (sv_eq(label_name, vm.labels[i].name))
+      return vm.labels[i].addr;
+  }
+  return -1;
+}
+
+void token_list_push(TokenList *list, Token *token) {
+  if (list->count >= list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->items = realloc(list->items, list->capacity * sizeof(Token *));
+    if (list->items == NULL) {
+      fprintf(stderr, "Error: memory issue...");
+      abort();
+    }
+  }
+  list->items[list->count++] = token;
+}
+
+Definition *compiler_get_definition(Compiler *c, SV name) {
+  for (int i = 0; i < c->defs_count; ++i) {
+    if (sv_eq(name, c->defs[i].name))
+      return &c->defs[i];
+  }
+  return NULL;
+}
+
+// Slot of a variable, allocated the first time the name is stored to or loaded from
+int compiler_get_slot(Compiler *c, SV name) {
+  for (int i = 0; i < c->slots_count; ++i) {
+    if (sv_eq(name, c->slots[i]))
+      return i;
+  }
+  if (c->slots_count >= SLOTS_CAPACITY)
+    return -1;
+  c->slots[c->slots_count] = name;
+  return c->slots_count++;
+}
+
+void compiler_error(const Token *token, const char *message) {
+  fprintf(stderr, "%s:%d:%d: Error: %s '%.*s'\n", token->Location.filename, token->Location.line,
+          token->Location.col, message, svf(token->source));
+}
+
+// Whether the body of def (transitively) uses target; visited guards against cycles not going through target
+bool compiler_reaches(Compiler *c, Definition *def, Definition *target, bool *visited) {
+  int index = def - c->defs;
+  if (visited[index])
+    return false;
+  visited[index] = true;
+
+  for (int i = 0; i < def->body.count; ++i) {
+    const Token *token = def->body.items[i];
+    if (token->type != TOK_WORD)
+      continue;
+    Definition *callee = compiler_get_definition(c, token->source);
+    if (callee == target || (callee && compiler_reaches(c, callee, target, visited)))
+      return true;
+  }
+  return false;
+}
+
+// The word after a par keyword, kept in the token list in place of the keyword and typed as it; NULL on errors
+Token *compiler_par_token(Token *par) {
+  Token *body = next_token();
+  if (body->type != TOK_WORD) {
+    compiler_error(body, "expected the definition a par loop runs, got");
+    return NULL;
+  }
+  body->type = par->type;
+  return body;
+}
+
+// First token of def, or of a definition it calls, that an iteration of a par loop must not run because it
+// escapes the iteration: storing a variable, printing, taking a snapshot, reading the input, another par loop
+// or calling a word of another module, whose body is not known here. NULL when there is none.
+const Token *compiler_par_effect(Compiler *c, Definition *def, bool *visited) {
+  int index = def - c->defs;
+  if (visited[index])
+    return NULL;
+  visited[index] = true;
+
+  for (int i = 0; i < def->body.count; ++i) {
+    const Token *token = def->body.items[i];
+    TokenType type = token->type;
+    if (type == TOK_STORE || type == TOK_DOT || type == TOK_SNAPSHOT || (type >= TOK_READ_INT && type <= TOK_PAR_MAX))
+      return token;
+    if (type != TOK_WORD)
+      continue;
+    Definition *callee = compiler_get_definition(c, token->source);
+    if (callee == NULL && native_find(token->source) == NULL)
+      return token;
+    const Token *effect = callee ? compiler_par_effect(c, callee, visited) : NULL;
+    if (effect)
+      return effect;
+  }
+  return NULL;
+}
+
+bool token_is_int(const Token *token, int value) {
+  return token->type == TOK_INT && atoi(token->source.data) == value;
+}
+
+// Whether token loads (TOK_LOAD) or stores (TOK_STORE) the variable name
+bool token_is_var(const Token *token, TokenType type, SV name) {
+  return token->type == type && sv_eq(sva(token->source), name);
+}
+
+// Matches the end of a counted loop at tokens, returns its token count or 0:
+//   1 + &L over B < jnz              counter on the top of the stack
+//   @i 1 + dup !i B < &L swap jnz    counter in a variable
+// where the bound B is an int or a variable other than the counter
+int compiler_loop_tail(Token **tokens, int count, CountedLoop *loop) {
+  *loop = (CountedLoop){0};
+  int n = 0;
+  if (count >= 10 && tokens[0]->type == TOK_LOAD && token_is_int(tokens[1], 1) && tokens[2]->type == TOK_PLUS &&
+      tokens[3]->type == TOK_DUP && token_is_var(tokens[4], TOK_STORE, sva(tokens[0]->source)) &&
+      tokens[6]->type == TOK_LT && tokens[7]->type == TOK_LABEL_ADDR && tokens[8]->type == TOK_SWAP &&
+      tokens[9]->type == TOK_JNZ) {
+    loop->counter = sva(tokens[0]->source);
+    loop->label = sva(tokens[7]->source);
+    loop->bound = tokens[5];
+    n = 10;
+  } else if (count >= 7 && token_is_int(tokens[0], 1) && tokens[1]->type == TOK_PLUS &&
+             tokens[2]->type == TOK_LABEL_ADDR && tokens[3]->type == TOK_OVER && tokens[5]->type == TOK_LT &&
+             tokens[6]->type == TOK_JNZ) {
+    loop->label = sva(tokens[2]->source);
+    loop->bound = tokens[4];
+    n = 7;
+  }
+  if (n == 0 || (loop->bound->type != TOK_INT && loop->bound->type != TOK_LOAD) ||
+      (loop->counter.len > 0 && token_is_var(loop->bound, TOK_LOAD, loop->counter)))
+    return 0;
+  return n;
+}
+
+// Matches the term of an update at tokens, returns its token count or 0: @i, K, @i K * or K @i *
+int compiler_loop_term(Token **tokens, int count, LoopUpdate *update) {
+  if (count >= 3 && tokens[2]->type == TOK_STAR) {
+    const Token *var = tokens[0]->type == TOK_LOAD ? tokens[0] : tokens[1];
+    const Token *k = tokens[0]->type == TOK_LOAD ? tokens[1] : tokens[0];
+    int coefficient = atoi(k->source.data);
+    if (var->type == TOK_LOAD && k->type == TOK_INT && coefficient >= INT16_MIN && coefficient <= INT16_MAX) {
+      *update = (LoopUpdate){.var = sva(var->source), .coefficient = coefficient};
+      return 3;
+    }
+  }
+  if (count >= 1 && tokens[0]->type == TOK_LOAD) {
+    *update = (LoopUpdate){.var = sva(tokens[0]->source), .coefficient = 1};
+    return 1;
+  }
+  if (count >= 1 && tokens[0]->type == TOK_INT) {
+    *update = (LoopUpdate){.constant = atoi(tokens[0]->source.data)};
+    return 1;
+  }
+  return 0;
+}
+
+// Matches `@acc term + !acc` or `term @acc + !acc` at tokens, returns its token count or 0
+int compiler_loop_update(Token **tokens, int count, LoopUpdate *update) {
+  if (count >= 1 && tokens[0]->type == TOK_LOAD) {
+    SV acc = sva(tokens[0]->source);
+    int n = compiler_loop_term(tokens + 1, count - 1, update);
+    if (n > 0 && count >= n + 3 && tokens[n + 1]->type == TOK_PLUS && token_is_var(tokens[n + 2], TOK_STORE, acc)) {
+      update->acc = acc;
+      return n + 3;
+    }
+  }
+  int n = compiler_loop_term(tokens, count, update);
+  if (n > 0 && count >= n + 3 && tokens[n]->type == TOK_LOAD && tokens[n + 1]->type == TOK_PLUS &&
+      token_is_var(tokens[n + 2], TOK_STORE, sva(tokens[n]->source))) {
+    update->acc = sva(tokens[n]->source);
+    return n + 3;
+  }
+  return 0;
+}
+
+// Compiles the counted loop starting at tokens, if there is one, and returns its token count; 0 when there is
+// none, -1 on errors. A loop over a variable whose body only adds terms of the counter to other variables runs
+// in closed form: TRIPS computes the iterations and leaves the counter as the last one would, then one SERIES
+// per update adds what all the iterations would have. Any other counted loop keeps its body, and its end becomes
+// a LOOP. The label stays where it is either way, as other code may jump to it.
+int compile_loop(Compiler *c, Token **tokens, int count) {
+  CountedLoop loop;
+  LoopUpdate updates[LOOP_UPDATES_CAPACITY];
+  int updates_count = 0;
+  int n = 0;
+  bool closed = tokens[0]->type == TOK_LABEL;
+  if (closed) {
+    n = 1;
+    while (updates_count < LOOP_UPDATES_CAPACITY && !compiler_loop_tail(tokens + n, count - n, &loop)) {
+      int length = compiler_loop_update(tokens + n, count - n, &updates[updates_count]);
+      if (length == 0)
+        break;
+      updates_count += 1;
+      n += length;
+    }
+    int length = compiler_loop_tail(tokens + n, count - n, &loop);
+    closed = length > 0 && loop.counter.len > 0 && sv_eq(loop.label, sva(tokens[0]->source));
+    for (int i = 0; i < updates_count && closed; ++i) {
+      const LoopUpdate *u = &updates[i];
+      closed = !sv_eq(u->acc, loop.counter) && !token_is_var(loop.bound, TOK_LOAD, u->acc) &&
+               (u->var.len == 0 || sv_eq(u->var, loop.counter));
+    }
+    if (!closed)
+      return 0;
+    n += length;
+  } else {
+    n = compiler_loop_tail(tokens, count, &loop);
+    if (n == 0)
+      return 0;
+  }
+
+  LoopOperand operand = {.slot = -1, .bound_slot = -1};
+  bool slots_ok = true;
+  if (loop.counter.len > 0) {
+    operand.slot = compiler_get_slot(c, loop.counter);
+    slots_ok = operand.slot >= 0;
+  }
+  if (loop.bound->type == TOK_LOAD) {
+    operand.bound_slot = compiler_get_slot(c, sva(loop.bound->source));
+    slots_ok = slots_ok && operand.bound_slot >= 0;
+  } else {
+    operand.value = atoi(loop.bound->source.data);
+  }
+  for (int i = 0; i < updates_count; ++i)
+    slots_ok = slots_ok && compiler_get_slot(c, updates[i].acc) >= 0;
+  if (!slots_ok) {
+    compiler_error(tokens[0], "too many variables at");
+    return -1;
+  }
+
+  // NOTE: slots are relocated in place, at their offset in the operand
+  if (closed && !compile_token(c, tokens[0]))
+    return -1;
+  int instr_start = vm.ip;
+  if (closed) {
+    module_add_reloc(c->module, RELOC_SLOT, vm.ip + 1 + 2, (SV){0}, tokens[0]->Location);
+    if (operand.bound_slot >= 0)
+      module_add_reloc(c->module, RELOC_SLOT, vm.ip + 1 + 3, (SV){0}, tokens[0]->Location);
+    vm_push_instr(INSTR_TRIPS, (Word){.word = (word_t)&operand});
+    for (int i = 0; i < updates_count; ++i) {
+      LoopOperand series = {.target = updates[i].coefficient, .slot = compiler_get_slot(c, updates[i].acc),
+                            .bound_slot = -1, .value = updates[i].constant};
+      module_add_reloc(c->module, RELOC_SLOT, vm.ip + 1 + 2, (SV){0}, tokens[0]->Location);
+      vm_push_instr(INSTR_SERIES, (Word){.word = (word_t)&series});
+    }
+  } else {
+    assert(c->ulc < LABELS_CAPACITY);
+    c->unresolved_labels[c->ulc++] = (Label){loop.label, vm.ip + 1};
+    if (operand.slot >= 0)
+      module_add_reloc(c->module, RELOC_SLOT, vm.ip + 1 + 2, (SV){0}, tokens[0]->Location);
+    if (operand.bound_slot >= 0)
+      module_add_reloc(c->module, RELOC_SLOT, vm.ip + 1 + 3, (SV){0}, tokens[0]->Location);
+    vm_push_instr(INSTR_LOOP, (Word){.word = (word_t)&operand});
+  }
+
+  for (int ip = instr_start; ip < vm.ip; ++ip)
+    debug_locations[ip] = tokens[0]->Location;
+  return n;
+}
+
+bool compile_token(Compiler *c, Token *token) {
+  int instr_start = vm.ip;
+  // clang-format off
+  static_assert(TOK_COUNT == 52, "Update TokenType is required");
+  switch (token->type) {
+  case TOK_INT: {
+    int i = atoi(token->source.data);
+    vm_push_instr(INSTR_INT, (Word){.integer=i});
+  } break;
+
+  case TOK_FLOAT: {
+    float f = strtof(token->source.data, NULL);
+    vm_push_instr(INSTR_FLOAT, (Word){.float_=f});
+  } break;
+
+  case TOK_STR: {
+    SV string = {(char *)token->source.data, token->source.len};
+    module_add_reloc(c->module, RELOC_DATA, vm.ip+1, (SV){0}, token->Location);
+    vm_push_instr(INSTR_STRING, (Word){.word=(word_t)&string});
+  } break;
+
+  case TOK_LABEL: {
+    SV label_name = sva(token->source); // skip '
+    vm_push_instr(INSTR_LABEL, (Word){.word=(word_t)&label_name});
+  } break;
+
+  case TOK_LABEL_ADDR: {
+    SV label_name = sva(token->source); // skip &
+    // NOTE: INSTR_LABEL_ADDR pushes intstruction and reserves the next word for operand to be back-patched later
+    assert(c->ulc < LABELS_CAPACITY);
+    c->unresolved_labels[c->ulc++] = (Label){label_name, vm.ip+1};
+    vm_push_instr(INSTR_LABEL_ADDR, word0);
+  } break;
+
+  case TOK_WORD: {
+    Definition *def = compiler_get_definition(c, token->source);
+    const Native *native = def ? NULL : native_find(token->source);
+    if (native) {
+      // NOTE: the linker writes the entry index again, code from the module cache may come from a host that
+      // registered its natives in another order
+      module_add_reloc(c->module, RELOC_NATIVE, vm.ip+1, token->source, token->Location);
+      vm_push_instr(INSTR_CALL_NATIVE, (Word){.word = native - natives});
+      break;
+    }
+    if (def == NULL) {
+      // NOTE: words of other modules are called by name, the linker reports the ones nobody defines
+      module_add_reloc(c->module, RELOC_CALL, vm.ip+1, token->source, token->Location);
+      vm_push_instr(INSTR_CALL, word0);
+      break;
+    }
+    if (def->inline_) {
+      for (int i = 0; i < def->body.count; ++i)
+        if (!compile_token(c, def->body.items[i]))
+          return false;
+      return true;
+    }
+    // NOTE: the call target is back-patched once the definition is emitted after the main program
+    assert(c->ucc < LABELS_CAPACITY);
+    c->unresolved_calls[c->ucc++] = (Label){def->name, vm.ip+1};
+    vm_push_instr(INSTR_CALL, word0);
+  } break;
+
+  case TOK_PAR_SUM:
+  case TOK_PAR_MIN:
+  case TOK_PAR_MAX: {
+    Definition *def = compiler_get_definition(c, token->source);
+    if (def == NULL) {
+      compiler_error(token, "par loops run a definition of their module, got");
+      return false;
+    }
+    bool visited[DEFINITIONS_CAPACITY] = {0};
+    const Token *effect = compiler_par_effect(c, def, visited);
+    if (effect) {
+      compiler_error(effect, "the body of a par loop can only compute its result, not");
+      return false;
+    }
+    assert(c->ucc < LABELS_CAPACITY);
+    c->unresolved_calls[c->ucc++] = (Label){def->name, vm.ip+1};
+    vm_push_instr(INSTR_PAR_SUM + (token->type - TOK_PAR_SUM), word0);
+  } break;
+
+  case TOK_PLUS:      vm_push_instr(INSTR_ADD, word0); break;
+  case TOK_MINUS:     vm_push_instr(INSTR_SUB, word0); break;
+  case TOK_STAR:      vm_push_instr(INSTR_MUL, word0); break;
+  case TOK_SLASH:     vm_push_instr(INSTR_DIV, word0); break;
+  case TOK_MOD:       vm_push_instr(INSTR_MOD, word0); break;
+  case TOK_PLUS_DOT:  vm_push_instr(INSTR_ADDF, word0); break;
+  case TOK_MINUS_DOT: vm_push_instr(INSTR_SUBF, word0); break;
+  case TOK_STAR_DOT:  vm_push_instr(INSTR_MULF, word0); break;
+  case TOK_SLASH_DOT: vm_push_instr(INSTR_DIVF, word0); break;
+  case TOK_EQ:        vm_push_instr(INSTR_EQ, word0); break;
+  case TOK_NEQ:       vm_push_instr(INSTR_NEQ, word0); break;
+  case TOK_LT:        vm_push_instr(INSTR_LT, word0); break;
+  case TOK_LE:        vm_push_instr(INSTR_LE, word0); break;
+  case TOK_GT:        vm_push_instr(INSTR_GT, word0); break;
+  case TOK_GE:        vm_push_instr(INSTR_GE, word0); break;
+  case TOK_DUP:       vm_push_instr(INSTR_DUP, word0); break;
+  case TOK_DOT:       vm_push_instr(INSTR_DUMP, word0); break;
+  case TOK_OVER:      vm_push_instr(INSTR_OVER, word0); break;
+  case TOK_SWAP:      vm_push_instr(INSTR_SWAP, word0); break;
+  case TOK_DROP:      vm_push_instr(INSTR_DROP, word0); break;
+  case TOK_ROT:       vm_push_instr(INSTR_ROT, word0); break;
+  case TOK_JMP:       vm_push_instr(INSTR_JMP, word0); break;
+  case TOK_JZ:        vm_push_instr(INSTR_JZ, word0); break;
+  case TOK_JNZ:       vm_push_instr(INSTR_JNZ, word0); break;
+  case TOK_SNAPSHOT:  vm_push_instr(INSTR_SNAPSHOT, word0); break;
+  case TOK_CONCAT:    vm_push_instr(INSTR_CONCAT, word0); break;
+  case TOK_LENGTH:    vm_push_instr(INSTR_LENGTH, word0); break;
+  case TOK_COMPARE:   vm_push_instr(INSTR_COMPARE, word0); break;
+  case TOK_SUBSTR:    vm_push_instr(INSTR_SUBSTR, word0); break;
+  case TOK_TO_INT:    vm_push_instr(INSTR_TO_INT, word0); break;
+  case TOK_TO_FLOAT:  vm_push_instr(INSTR_TO_FLOAT, word0); break;
+  case TOK_TO_STRING: vm_push_instr(INSTR_TO_STRING, word0); break;
+  case TOK_READ_INT:  vm_push_instr(INSTR_READ_INT, word0); break;
+  case TOK_READ_FLOAT: vm_push_instr(INSTR_READ_FLOAT, word0); break;
+  case TOK_READ_LINE: vm_push_instr(INSTR_READ_LINE, word0); break;
+  case TOK_END_OF_INPUT: vm_push_instr(INSTR_END_OF_INPUT, word0); break;
+  case TOK_STORE:
+  case TOK_LOAD: {
+    int slot = compiler_get_slot(c, sva(token->source)); // skip ! or @
+    if (slot < 0) {
+      compiler_error(token, "too many variables at");
+      return false;
+    }
+    module_add_reloc(c->module, RELOC_SLOT, vm.ip+1, (SV){0}, token->Location);
+    vm_push_instr(token->type == TOK_STORE ? INSTR_STORE : INSTR_LOAD, (Word){.integer=slot});
+  } break;
+
+  case TOK_INCLUDE: {
+    // NOTE: the first pass of compile made the string after `include` the token, the module runs where it is included
+    char path[PATH_MAX];
+    if (!module_resolve(c->module->filename, token->source, path)) {
+      compiler_error(token, "could not include");
+      return false;
+    }
+    const char *resolved = arena_strdup(&c->module->strings, path);
+    module_add_reloc(c->module, RELOC_INCLUDE, vm.ip+1, sv(resolved), token->Location);
+    vm_push_instr(INSTR_CALL, word0);
+  } break;
+
+  case TOK_COLON:
+  case TOK_SEMICOLON:
+    compiler_error(token, "unexpected");
+    return false;
+  default:
+    assert(0 && "unreachable");
+  }
+  // clang-format on
+
+  for (int ip = instr_start; ip < vm.ip; ++ip)
+    debug_locations[ip] = token->Location;
+  return true;
+}
+
+// Compiles the tokens of a module into the vm of this thread, then moves the code out to the module.
+// Definitions `: name ... ;` are emitted after the top-level code, each ending with ret, and called with
+// INSTR_CALL. Small ones (up to inline_threshold tokens, no labels, not recursive) are inlined in the module.
+bool compile(Module *module) {
+  Compiler *c = calloc(1, sizeof(Compiler));
+  TokenList main_tokens = {0};
+  bool result = true;
+  if (c == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  c->module = module;
+  memset(&vm, 0, sizeof(vm));
+  // NOTE: the thread may be the one running the linked program, its locations are put back at the end
+  Location *linked_locations = debug_locations;
+  debug_locations = debug_locations_alloc();
+
+  // First pass: split the top-level code from the definitions
+  Token *token = next_token();
+  for (; token->type != TOK_EOF; token = next_token()) {
+    if (token->type == TOK_SEMICOLON) {
+      compiler_error(token, "unexpected");
+      result = false;
+      goto defer;
+    }
+    if (token->type == TOK_INCLUDE) {
+      Token *path = next_token();
+      if (path->type != TOK_STR) {
+        compiler_error(path, "expected a file name after include, got");
+        result = false;
+        goto defer;
+      }
+      path->type = TOK_INCLUDE;
+      token_list_push(&main_tokens, path);
+      continue;
+    }
+    if (token->type >= TOK_PAR_SUM && token->type <= TOK_PAR_MAX && (token = compiler_par_token(token)) == NULL) {
+      result = false;
+      goto defer;
+    }
+    if (token->type != TOK_COLON) {
+      token_list_push(&main_tokens, token);
+      continue;
+    }
+
+    Token *name = next_token();
+    if (name->type != TOK_WORD) {
+      compiler_error(name, "expected a definition name, got");
+      result = false;
+      goto defer;
+    }
+    if (compiler_get_definition(c, name->source)) {
+      compiler_error(name, "redefinition of");
+      result = false;
+      goto defer;
+    }
+    assert(c->defs_count < DEFINITIONS_CAPACITY);
+    Definition *def = &c->defs[c->defs_count++];
+    def->name = name->source;
+
+    bool has_labels = false;
+    Token *token = next_token();
+    for (; token->type != TOK_SEMICOLON; token = next_token()) {
+      if (token->type == TOK_EOF || token->type == TOK_COLON) {
+        compiler_error(name, "unterminated definition");
+        result = false;
+        goto defer;
+      }
+      if (token->type == TOK_INCLUDE) {
+        compiler_error(token, "unexpected in a definition");
+        result = false;
+        goto defer;
+      }
+      if (token->type >= TOK_PAR_SUM && token->type <= TOK_PAR_MAX && (token = compiler_par_token(token)) == NULL) {
+        result = false;
+        goto defer;
+      }
+      has_labels = has_labels || token->type == TOK_LABEL;
+      token_list_push(&def->body, token);
+    }
+    def->end = token->Location;
+    def->inline_ = !has_labels && def->body.count <= inline_threshold;
+  }
+  Location end = token->Location;
+
+  for (int i = 0; i < c->defs_count; ++i) {
+    bool visited[DEFINITIONS_CAPACITY] = {0};
+    if (c->defs[i].inline_ && compiler_reaches(c, &c->defs[i], &c->defs[i], visited))
+      c->defs[i].inline_ = false;
+  }
+
+  // Second pass: code generation
+  int entry = main_tokens.count; // the code before the first label, with --lazy
+  if (module->lazy) {
+    entry = 0;
+    while (entry < main_tokens.count && main_tokens.items[entry]->type != TOK_LABEL)
+      entry += 1;
+  }
+  for (int i = 0; i < entry;) {
+    int n = compile_loop(c, main_tokens.items + i, entry - i);
+    if (n < 0 || (n == 0 && !compile_token(c, main_tokens.items[i]))) {
+      result = false;
+      goto defer;
+    }
+    i += n > 0 ? n : 1;
+  }
+  if (module->lazy && !compile_lazy_blocks(c, &main_tokens, entry)) {
+    result = false;
+    goto defer;
+  }
+  // NOTE: with --lazy the last block ends with its own DONE, this one is what par loops return to
+  vm_push_instr(module->is_main ? INSTR_DONE : INSTR_RET, word0);
+  debug_locations[vm.ip - 1] = end;
+
+  // NOTE: inlined definitions get a body as well, other modules can only call them
+  for (int i = 0; i < c->defs_count; ++i) {
+    Definition *def = &c->defs[i];
+    def->addr = vm.ip;
+    for (int j = 0; j < def->body.count;) {
+      int n = compile_loop(c, def->body.items + j, def->body.count - j);
+      if (n < 0 || (n == 0 && !compile_token(c, def->body.items[j]))) {
+        result = false;
+        goto defer;
+      }
+      j += n > 0 ? n : 1;
+    }
+    vm_push_instr(INSTR_RET, word0);
+    debug_locations[vm.ip - 1] = def->end;
+    module_add_export(module, def->name, def->addr);
+  }
+
+  if (vm.overflow) {
+    fprintf(stderr, "%s: Error: the module does not fit the program, its data or its labels\n", module->filename);
+    result = false;
+    goto defer;
+  }
+
+  // Third pass: labels and calls resolution, relative to the start of the module
+  if (c->lazy && vm.labels_count > 0) {
+    c->lazy->labels_count = vm.labels_count;
+    c->lazy->labels = malloc(vm.labels_count * sizeof(Label));
+    if (c->lazy->labels == NULL) {
+      fprintf(stderr, "Error: memory issue...");
+      abort();
+    }
+    memcpy(c->lazy->labels, vm.labels, vm.labels_count * sizeof(Label));
+  }
+  for (int i = 0; i < c->ulc; ++i) {
+    SV name = c->unresolved_labels[i].name;
+    int addr = c->lazy ? lazy_label_addr(c->lazy, NULL, name) : compiler_get_label_addr(name);
+    if (addr < 0) {
+      fprintf(stderr, "%s: Error: unknown label '%.*s'\n", module->filename, svf(c->unresolved_labels[i].name));
+      result = false;
+      goto defer;
+    }
+    operand_write(vm.program + c->unresolved_labels[i].addr, addr, LABEL_ADDR_WIDTH);
+    module_add_reloc(module, RELOC_CODE, c->unresolved_labels[i].addr, (SV){0},
+                     debug_locations[c->unresolved_labels[i].addr]);
+  }
+  for (int i = 0; i < c->ucc; ++i) {
+    Definition *def = compiler_get_definition(c, c->unresolved_calls[i].name);
+    operand_write(vm.program + c->unresolved_calls[i].addr, def->addr, LABEL_ADDR_WIDTH);
+    module_add_reloc(module, RELOC_CODE, c->unresolved_calls[i].addr, (SV){0},
+                     debug_locations[c->unresolved_calls[i].addr]);
+  }
+  // NOTE: the labels of the blocks left for later are checked now, compiling them can only run out of space or
+  // call a word no module defines
+  for (int i = 0; c->lazy && i < c->lazy->refs_count; ++i) {
+    const Token *t = &c->lazy->refs[i];
+    if (t->type == TOK_LABEL_ADDR && lazy_label_addr(c->lazy, NULL, sva(t->source)) < 0) {
+      compiler_error(t, "unknown label");
+      result = false;
+      goto defer;
+    }
+  }
+
+  module->code_size = vm.ip;
+  module->data_size = vm.data_offset;
+  module->slots_count = c->slots_count;
+  module->code = malloc(vm.ip);
+  module->locations = malloc(vm.ip * sizeof(Location));
+  module->data = malloc(vm.data_offset + 1);
+  if (module->code == NULL || module->locations == NULL || module->data == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  memcpy(module->code, vm.program, vm.ip);
+  memcpy(module->locations, debug_locations, vm.ip * sizeof(Location));
+  memcpy(module->data, vm.data, vm.data_offset);
+
+defer:
+  free(debug_locations);
+  debug_locations = linked_locations;
+  free(main_tokens.items);
+  // NOTE: the blocks compiled when they are reached need the compiler and its definitions, lazy_release frees them
+  if (result && c->lazy)
+    return true;
+  for (int i = 0; i < c->defs_count; ++i)
+    free(c->defs[i].body.items);
+  free(c);
+  return result;
+}
+
+// Tokenizes the main module for --lazy. The code before the first label, the definitions and the labeled blocks
+// that include a module are lexed now; the other blocks are only skimmed for their range and the variables and
+// labels they use, and lexed when they are reached. m->lazy stays NULL when the module has no labeled block.
+bool tokenize_lazy(Module *m, SV source) {
+  LazyProgram *p = calloc(1, sizeof(LazyProgram));
+  if (p == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  Token *defs = NULL; // definitions of the last block: their colon, its source stretched up to the semicolon
+  int defs_count = 0, defs_capacity = 0;
+  bool result = true;
+  bool in_def = false;
+  int line_no = 0;
+  const char *end = source.data + source.len;
+  for (const char *line_start = source.data, *next; result && line_start < end; line_start = next) {
+    next = memchr(line_start, '\n', end - line_start);
+    next = next ? next + 1 : end;
+    SV line = {line_start, next - line_start};
+    line_no += 1;
+    while (line.len > 0) {
+      line = sv_strip(line);
+      if (line.len <= 0)
+        break;
+      SV text;
+      bool string;
+      if (!lex_next(&line, &text, &string)) {
+        result = false;
+        break;
+      }
+      Location at = {.filename = m->filename, .line = line_no, .col = text.data - line_start + 1};
+      if (string)
+        continue;
+
+      if (in_def) {
+        in_def = !sv_eq(text, keywords[TOK_SEMICOLON]);
+        if (!in_def && p->blocks_count > 0)
+          defs[defs_count - 1].source.len = text.data + text.len - defs[defs_count - 1].source.data;
+        continue;
+      }
+      if (sv_eq(text, keywords[TOK_COLON])) {
+        in_def = true;
+        if (p->blocks_count == 0)
+          continue;
+        if (defs_count >= defs_capacity) {
+          defs_capacity = defs_capacity ? defs_capacity * 2 : 16;
+          defs = realloc(defs, defs_capacity * sizeof(Token));
+          if (defs == NULL) {
+            fprintf(stderr, "Error: memory issue...");
+            abort();
+          }
+        }
+        defs[defs_count++] = (Token){at, text, TOK_COLON};
+        continue;
+      }
+
+      if (text.data[0] == '\'') {
+        if (p->blocks_count == 0) {
+          result = tokenize_lines((SV){source.data, text.data - source.data}, (Location){m->filename, 0, 1}, false);
+        } else {
+          result = tokenize_lazy_block(p, defs, defs_count, text.data);
+          defs_count = 0;
+        }
+        if (p->blocks_count >= p->blocks_capacity) {
+          p->blocks_capacity = p->blocks_capacity ? p->blocks_capacity * 2 : 64;
+          p->blocks = realloc(p->blocks, p->blocks_capacity * sizeof(LazyBlock));
+          if (p->blocks == NULL) {
+            fprintf(stderr, "Error: memory issue...");
+            abort();
+          }
+        }
+        p->blocks[p->blocks_count++] = (LazyBlock){.label = sva(text), .source = text, .loc = at, .addr = -1};
+        continue;
+      }
+      if (p->blocks_count == 0)
+        continue;
+      if (sv_eq(text, keywords[TOK_INCLUDE])) {
+        p->blocks[p->blocks_count - 1].upfront = true;
+        continue;
+      }
+      TokenType type = TOK_COUNT;
+      if (text.len > 1 && text.data[0] == '@')
+        type = TOK_LOAD;
+      else if (text.len > 1 && text.data[0] == '!' && !sv_eq(text, keywords[TOK_NEQ]))
+        type = TOK_STORE;
+      else if (text.data[0] == '&')
+        type = TOK_LABEL_ADDR;
+      if (type == TOK_COUNT)
+        continue;
+      bool known = false;
+      for (int i = 0; !known && i < p->refs_count; ++i)
+        known = sv_eq(text, p->refs[i].source);
+      if (known)
+        continue;
+      if (p->refs_count >= p->refs_capacity) {
+        p->refs_capacity = p->refs_capacity ? p->refs_capacity * 2 : 16;
+        p->refs = realloc(p->refs, p->refs_capacity * sizeof(Token));
+        if (p->refs == NULL) {
+          fprintf(stderr, "Error: memory issue...");
+          abort();
+        }
+      }
+      p->refs[p->refs_count++] = (Token){at, text, type};
+    }
+  }
+
+  if (result && p->blocks_count == 0) {
+    result = tokenize_lines(source, (Location){m->filename, 0, 1}, true);
+  } else if (result) {
+    // NOTE: a definition left open runs to the end, compile reports it
+    if (in_def)
+      defs[defs_count - 1].source.len = end - defs[defs_count - 1].source.data;
+    result = tokenize_lazy_block(p, defs, defs_count, end) &&
+             tokenize_lines((SV){end, 0}, (Location){m->filename, line_no, 1}, true);
+  }
+  free(defs);
+  if (!result || p->blocks_count == 0) {
+    free(p->blocks);
+    free(p->refs);
+    free(p);
+    return result;
+  }
+  for (int i = 0; i < p->blocks_count; ++i)
+    p->deferred += !p->blocks[i].upfront;
+  m->lazy = p;
+  return true;
+}
+
+// Ends the last block of p at end and lexes what of it is compiled up front: the whole block when it includes a
+// module, its definitions otherwise
+bool tokenize_lazy_block(LazyProgram *p, const Token *defs, int defs_count, const char *end) {
+  LazyBlock *b = &p->blocks[p->blocks_count - 1];
+  b->source.len = end - b->source.data;
+  if (b->upfront)
+    return tokenize_lines(b->source, (Location){b->loc.filename, b->loc.line - 1, b->loc.col}, false);
+  for (int i = 0; i < defs_count; ++i) {
+    const Token *d = &defs[i];
+    if (!tokenize_lines(d->source, (Location){d->Location.filename, d->Location.line - 1, d->Location.col}, false))
+      return false;
+  }
+  return true;
+}
+
+// Emits the stubs of the labeled blocks of the main module and compiles the ones that include a module, whose
+// tokens main_tokens has from entry on. The variables of all the blocks get their slots now, the linker only
+// reserves the ones it knows of.
+bool compile_lazy_blocks(Compiler *c, TokenList *main_tokens, int entry) {
+  LazyProgram *p = c->module->lazy;
+  p->compiler = c;
+  p->scratch.filename = c->module->filename;
+  c->lazy = p;
+
+  for (int i = 0; i < p->refs_count; ++i) {
+    const Token *t = &p->refs[i];
+    if (t->type != TOK_LABEL_ADDR && compiler_get_slot(c, sva(t->source)) < 0) {
+      compiler_error(t, "too many variables at");
+      return false;
+    }
+  }
+
+  p->blocks_table_size = 1;
+  while (p->blocks_table_size < 2 * p->blocks_count + 1)
+    p->blocks_table_size *= 2;
+  p->blocks_table = malloc(p->blocks_table_size * sizeof(int));
+  if (p->blocks_table == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  for (int i = 0; i < p->blocks_table_size; ++i)
+    p->blocks_table[i] = -1;
+  for (int i = 0; i < p->blocks_count; ++i) {
+    SV label = p->blocks[i].label;
+    int k = fnv1a(label.data, label.len) & (p->blocks_table_size - 1);
+    while (p->blocks_table[k] >= 0 && !sv_eq(label, p->blocks[p->blocks_table[k]].label))
+      k = (k + 1) & (p->blocks_table_size - 1);
+    if (p->blocks_table[k] < 0)
+      p->blocks_table[k] = i;
+  }
+
+  // NOTE: the stubs follow the entry, which falls through into the first one; their operand has the width of an
+  // address so that a GOTO fits over it
+  for (int i = 0; i < p->blocks_count; ++i) {
+    LazyBlock *b = &p->blocks[i];
+    if (!vm_reserve(1 + LABEL_ADDR_WIDTH, 0))
+      return true;
+    b->stub = vm.ip;
+    vm.program[vm.ip] = OPCODE(INSTR_LAZY, LABEL_ADDR_WIDTH_LOG2);
+    operand_write(vm.program + vm.ip + 1, i, LABEL_ADDR_WIDTH);
+    vm.ip += 1 + LABEL_ADDR_WIDTH;
+    for (int ip = b->stub; ip < vm.ip; ++ip)
+      debug_locations[ip] = b->loc;
+  }
+
+  // NOTE: every label of main_tokens starts the next block compiled up front
+  int k = -1;
+  for (int i = entry; i < main_tokens->count; ++i) {
+    if (main_tokens->items[i]->type == TOK_LABEL) {
+      do
+        k += 1;
+      while (k < p->blocks_count && !p->blocks[k].upfront);
+      assert(k < p->blocks_count);
+      p->blocks[k].tokens = main_tokens->items + i;
+    }
+    p->blocks[k].tokens_count += 1;
+  }
+  for (int i = 0; i < p->blocks_count; ++i) {
+    LazyBlock *b = &p->blocks[i];
+    if (!b->upfront)
+      continue;
+    b->addr = vm.ip;
+    if (!compile_lazy_block(c, b))
+      return false;
+    vm.program[b->stub] = OPCODE(INSTR_GOTO, LABEL_ADDR_WIDTH_LOG2);
+    operand_write(vm.program + b->stub + 1, b->addr, LABEL_ADDR_WIDTH);
+    module_add_reloc(c->module, RELOC_CODE, b->stub + 1, (SV){0}, debug_locations[b->stub]);
+    b->tokens = NULL;
+    b->tokens_count = 0;
+  }
+  return true;
+}
+
+// Emits the tokens of b at vm.ip, then falls through into the stub of the next block or ends the program
+bool compile_lazy_block(Compiler *c, LazyBlock *b) {
+  for (int i = 0; i < b->tokens_count;) {
+    int n = compile_loop(c, b->tokens + i, b->tokens_count - i);
+    if (n < 0 || (n == 0 && !compile_token(c, b->tokens[i])))
+      return false;
+    i += n > 0 ? n : 1;
+  }
+  const Token *last = b->tokens[b->tokens_count - 1];
+  int end_start = vm.ip;
+  if (b == &c->lazy->blocks[c->lazy->blocks_count - 1]) {
+    vm_push_instr(INSTR_DONE, word0);
+  } else {
+    vm_push_instr(INSTR_GOTO, word0);
+    operand_write(vm.program + vm.ip - LABEL_ADDR_WIDTH, b[1].stub, LABEL_ADDR_WIDTH);
+    module_add_reloc(c->module, RELOC_CODE, vm.ip - LABEL_ADDR_WIDTH, (SV){0}, last->Location);
+  }
+  for (int ip = end_start; ip < vm.ip; ++ip)
+    debug_locations[ip] = last->Location;
+  return true;
+}
+
+// Address of a label of the main module compiled with --lazy: the own block it is compiled in, a label of the code
+// compiled up front or the stub of a block. -1 when there is no such label.
+int lazy_label_addr(const LazyProgram *p, const LazyBlock *own, SV name) {
+  if (own && sv_eq(name, own->label))
+    return own->addr;
+  for (int i = 0; i < p->labels_count; ++i) {
+    if (sv_eq(name, p->labels[i].name))
+      return p->labels[i].addr;
+  }
+  int k = fnv1a(name.data, name.len) & (p->blocks_table_size - 1);
+  for (; p->blocks_table[k] >= 0; k = (k + 1) & (p->blocks_table_size - 1)) {
+    if (sv_eq(name, p->blocks[p->blocks_table[k]].label))
+      return p->blocks[p->blocks_table[k]].stub;
+  }
+  return -1;
+}
+
+// Runs the LAZY stub of block index at ip: compiles the block unless another vm of the program already did,
+// copies it into vm and patches the stub into a GOTO to it. Returns the address of the block, -1 when it could
+// not be compiled, which stops the vm with VM_FAILED.
+int lazy_enter(VM *vm, int ip, int index) {
+  LazyProgram *p = vm->lazy;
+  LazyBlock *b = &p->blocks[index];
+  pthread_mutex_lock(&lazy_lock);
+  if (!lazy_compiler_started) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, lazy_compiler, NULL);
+    pthread_detach(thread);
+    lazy_compiler_started = true;
+  }
+  while (b->code == NULL) {
+    if (lazy_job) {
+      pthread_cond_wait(&lazy_cond, &lazy_lock);
+      continue;
+    }
+    LazyJob job = {.p = p, .block = b};
+    lazy_job = &job;
+    pthread_cond_broadcast(&lazy_cond);
+    while (!job.done)
+      pthread_cond_wait(&lazy_cond, &lazy_lock);
+    if (job.overflow) {
+      fprintf(stderr, "Error: the block '%.*s' reached at ip %d does not fit the program, its data or its labels\n",
+              svf(b->label), ip);
+      pthread_mutex_unlock(&lazy_lock);
+      return -1;
+    }
+    if (!job.ok) {
+      fprintf(stderr, "Error: could not compile the block '%.*s' reached at ip %d\n", svf(b->label), ip);
+      pthread_mutex_unlock(&lazy_lock);
+      return -1;
+    }
+  }
+  pthread_mutex_unlock(&lazy_lock);
+
+  memcpy(vm->program + b->addr, b->code, b->code_size);
+  memcpy(vm->data + b->data_offset, b->data, b->data_size);
+  // NOTE: the locations go to the thread that linked the program, the others have none
+  if (debug_locations)
+    memcpy(debug_locations + b->addr, b->locations, b->code_size * sizeof(Location));
+  vm->program[ip] = OPCODE(INSTR_GOTO, LABEL_ADDR_WIDTH_LOG2);
+  operand_write(vm->program + ip + 1, b->addr, LABEL_ADDR_WIDTH);
+  return b->addr;
+}
+
+// Thread compiling the blocks of the programs compiled with --lazy, one posted job at a time
+void *lazy_compiler(void *arg) {
+  (void)arg;
+  // NOTE: allocated once, every block writes the locations of the code it emits
+  debug_locations = debug_locations_alloc();
+  pthread_mutex_lock(&lazy_lock);
+  for (;;) {
+    while (lazy_job == NULL || lazy_job->done)
+      pthread_cond_wait(&lazy_cond, &lazy_lock);
+    double start = now_seconds();
+    lazy_compile(lazy_job);
+    lazy_job->p->compiled += lazy_job->ok;
+    lazy_job->p->compile_time += now_seconds() - start;
+    if (lazy_job->ok && lazy_job->p->compiled == lazy_job->p->deferred)
+      lazy_release(lazy_job->p);
+    lazy_job->done = true;
+    lazy_job = NULL;
+    pthread_cond_broadcast(&lazy_cond);
+  }
+  return NULL;
+}
+
+// Lexes a block and compiles it at the end of its program, into the vm of this thread that has nothing else
+void lazy_compile(LazyJob *job) {
+  LazyProgram *p = job->p;
+  LazyBlock *b = job->block;
+  Compiler *c = p->compiler;
+  c->module = &p->scratch;
+  c->ulc = c->ucc = 0;
+  vm.ip = p->code_end;
+  vm.data_offset = p->data_end;
+  vm.labels_count = 0;
+  vm.overflow = false;
+  b->addr = vm.ip;
+
+  tokens_init();
+  tp = 0;
+  cp = NULL;
+  TokenList block = {0};
+  job->ok = tokenize_lines(b->source, (Location){b->loc.filename, b->loc.line - 1, b->loc.col}, true);
+  // NOTE: the definitions of the block were compiled up front, compile found their end
+  for (Token *t; job->ok && (t = next_token())->type != TOK_EOF;) {
+    if (t->type == TOK_COLON) {
+      while (t->type != TOK_SEMICOLON)
+        t = next_token();
+      continue;
+    }
+    if (t->type >= TOK_PAR_SUM && t->type <= TOK_PAR_MAX && (t = compiler_par_token(t)) == NULL) {
+      job->ok = false;
+      break;
+    }
+    token_list_push(&block, t);
+  }
+  b->tokens = block.items;
+  b->tokens_count = block.count;
+  job->ok = job->ok && compile_lazy_block(c, b);
+  job->overflow = vm.overflow;
+  job->ok = job->ok && !job->overflow;
+
+  // NOTE: the main module is linked first, its code, data and slots are where it was compiled; only the calls of
+  // other modules are relocated
+  for (int i = 0; job->ok && i < c->ulc; ++i) {
+    int addr = lazy_label_addr(p, b, c->unresolved_labels[i].name);
+    assert(addr >= 0);
+    operand_write(vm.program + c->unresolved_labels[i].addr, addr, LABEL_ADDR_WIDTH);
+  }
+  for (int i = 0; job->ok && i < c->ucc; ++i) {
+    Definition *def = compiler_get_definition(c, c->unresolved_calls[i].name);
+    operand_write(vm.program + c->unresolved_calls[i].addr, def->addr, LABEL_ADDR_WIDTH);
+  }
+  for (int i = 0; job->ok && i < p->scratch.relocs_count; ++i) {
+    const Reloc *r = &p->scratch.relocs[i];
+    if (r->kind != RELOC_CALL)
+      continue;
+    int addr = lazy_export_addr(p, r->name);
+    if (addr < 0) {
+      fprintf(stderr, "%s:%d:%d: Error: unknown word '%.*s'\n", r->loc.filename, r->loc.line, r->loc.col,
+              svf(r->name));
+      job->ok = false;
+      break;
+    }
+    operand_write(vm.program + r->offset, addr, LABEL_ADDR_WIDTH);
+  }
+  p->scratch.relocs_count = 0;
+  free(block.items);
+  b->tokens = NULL;
+  b->tokens_count = 0;
+  tokens_free();
+  if (!job->ok) {
+    b->addr = -1;
+    return;
+  }
+
+  b->code_size = vm.ip - b->addr;
+  b->data_offset = p->data_end;
+  b->data_size = vm.data_offset - p->data_end;
+  b->code = malloc(b->code_size);
+  b->locations = malloc(b->code_size * sizeof(Location));
+  b->data = malloc(b->data_size + 1);
+  if (b->code == NULL || b->locations == NULL || b->data == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  memcpy(b->code, vm.program + b->addr, b->code_size);
+  memcpy(b->locations, debug_locations + b->addr, b->code_size * sizeof(Location));
+  memcpy(b->data, vm.data + b->data_offset, b->data_size);
+  p->code_end = vm.ip;
+  p->data_end = vm.data_offset;
+}
+
+// Frees what only compiling blocks needs once the last one left for later is compiled: the compiler with its
+// definitions, the tokens and the source they point into. The labels of the blocks are not read anymore either.
+void lazy_release(LazyProgram *p) {
+  Compiler *c = p->compiler;
+  for (int i = 0; i < c->defs_count; ++i)
+    free(c->defs[i].body.items);
+  free(c);
+  free(p->refs);
+  free(p->exports);
+  arena_destroy(&p->tokens_arena);
+  arena_destroy(&p->source);
+  arena_destroy(&p->exports_names);
+  p->compiler = NULL;
+  p->refs = NULL;
+  p->exports = NULL;
+}
+
+// Linked address of a word of another module that a block compiled late calls, -1 when no module defines it
+int lazy_export_addr(const LazyProgram *p, SV name) {
+  if (p->exports == NULL)
+    return -1;
+  int k = fnv1a(name.data, name.len) & (p->exports_size - 1);
+  for (; p->exports[k].name.data; k = (k + 1) & (p->exports_size - 1)) {
+    if (sv_eq(name, p->exports[k].name))
+      return p->exports[k].addr;
+  }
+  return -1;
+}
+
+Location *debug_locations_alloc(void) {
+  Location *locations = calloc(PROGRAM_CAPACITY, sizeof(Location));
+  if (locations == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  return locations;
+}
+
+char *arena_strdup(Arena *a, const char *cstr) {
+  int len = strlen(cstr);
+  char *copy = arena_alloc(a, len + 1);
+  if (copy == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  memcpy(copy, cstr, len + 1);
+  return copy;
+}
+
+uint64_t fnv1a(const char *data, int len) {
+  uint64_t hash = 14695981039346656037ull;
+  for (int i = 0; i < len; ++i) {
+    hash ^= (uint8_t)data[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+void module_add_reloc(Module *m, RelocKind kind, int offset, SV name, Location loc) {
+  if (m->relocs_count >= m->relocs_capacity) {
+    m->relocs_capacity = m->relocs_capacity ? m->relocs_capacity * 2 : 64;
+    m->relocs = realloc(m->relocs, m->relocs_capacity * sizeof(Reloc));
+    if (m->relocs == NULL) {
+      fprintf(stderr, "Error: memory issue...");
+      abort();
+    }
+  }
+  m->relocs[m->relocs_count++] = (Reloc){kind, offset, name, loc};
+}
+
+void module_add_export(Module *m, SV name, int addr) {
+  if (m->exports_count >= m->exports_capacity) {
+    m->exports_capacity = m->exports_capacity ? m->exports_capacity * 2 : 64;
+    m->exports = realloc(m->exports, m->exports_capacity * sizeof(Export));
+    if (m->exports == NULL) {
+      fprintf(stderr, "Error: memory issue...");
+      abort();
+    }
+  }
+  m->exports[m->exports_count++] = (Export){name, addr};
+}
+
+// Canonical path of an included file, relative to the directory of the including one
+bool module_resolve(const char *including, SV path, char *resolved) {
+  char joined[PATH_MAX];
+  const char *slash = strrchr(including, '/');
+  int dir_len = (path.len == 0 || path.data[0] != '/') && slash ? slash - including + 1 : 0;
+  if (dir_len + path.len >= PATH_MAX)
+    return false;
+  memcpy(joined, including, dir_len);
+  memcpy(joined + dir_len, path.data, path.len);
+  joined[dir_len + path.len] = '\0';
+  return realpath(joined, resolved) != NULL;
+}
+
+void module_cache_file(const Module *m, char *cache_file) {
+  uint64_t hash = fnv1a(m->path, strlen(m->path));
+  snprintf(cache_file, PATH_MAX, "%s/%016llx.stepmod", module_cache_dir, (unsigned long long)hash);
+}
+
+// Fills the module from its cache file; false, leaving the module empty, when the file is missing or stale
+bool module_cache_load(Module *m, const ModuleCacheHeader *header, const char *cache_file) {
+  FILE *f = fopen(cache_file, "rb");
+  if (f == NULL)
+    return false;
+
+  bool result = false;
+  ModuleCacheHeader cached;
+  char path[PATH_MAX];
+  int32_t count;
+  if (fread(&cached, sizeof(cached), 1, f) != 1 || memcmp(&cached, header, sizeof(cached)) != 0 ||
+      fread(path, header->path_len, 1, f) != 1 || memcmp(path, m->path, header->path_len) != 0)
+    goto defer;
+
+  if (fread(&count, sizeof(count), 1, f) != 1 || count < 0 || count > PROGRAM_CAPACITY)
+    goto defer;
+  m->code_size = count;
+  m->code = malloc(count + 1);
+  m->locations = malloc((count + 1) * sizeof(Location));
+  if (m->code == NULL || m->locations == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  if (fread(m->code, 1, count, f) != (size_t)count)
+    goto defer;
+  for (int i = 0; i < count; ++i) {
+    int32_t line_col[2];
+    if (fread(line_col, sizeof(line_col), 1, f) != 1)
+      goto defer;
+    m->locations[i] = (Location){.filename = m->filename, .line = line_col[0], .col = line_col[1]};
+  }
+
+  if (fread(&count, sizeof(count), 1, f) != 1 || count < 0 || count > DATA_CAPACITY)
+    goto defer;
+  m->data_size = count;
+  m->data = malloc(count + 1);
+  if (m->data == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  if (fread(m->data, 1, count, f) != (size_t)count)
+    goto defer;
+
+  if (fread(&count, sizeof(count), 1, f) != 1 || count < 0 || count > SLOTS_CAPACITY)
+    goto defer;
+  m->slots_count = count;
+
+  if (fread(&count, sizeof(count), 1, f) != 1 || count < 0)
+    goto defer;
+  for (int i = 0; i < count; ++i) {
+    int32_t fields[5]; // kind, offset, line, col, name length
+    if (fread(fields, sizeof(fields), 1, f) != 1 || fields[0] < 0 || fields[0] >= RELOC_COUNT || fields[1] < 0 ||
+        fields[1] >= m->code_size || fields[4] < 0 || fields[4] >= PATH_MAX ||
+        (fields[4] > 0 && fread(path, fields[4], 1, f) != 1))
+      goto defer;
+    path[fields[4]] = '\0';
+    SV name = fields[4] > 0 ? sv(arena_strdup(&m->strings, path)) : (SV){0};
+    module_add_reloc(m, fields[0], fields[1], name, (Location){m->filename, fields[2], fields[3]});
+  }
+
+  if (fread(&count, sizeof(count), 1, f) != 1 || count < 0)
+    goto defer;
+  for (int i = 0; i < count; ++i) {
+    int32_t fields[2]; // addr, name length
+    if (fread(fields, sizeof(fields), 1, f) != 1 || fields[0] < 0 || fields[0] >= m->code_size || fields[1] <= 0 ||
+        fields[1] >= PATH_MAX || fread(path, fields[1], 1, f) != 1)
+      goto defer;
+    path[fields[1]] = '\0';
+    module_add_export(m, sv(arena_strdup(&m->strings, path)), fields[0]);
+  }
+  result = true;
+
+defer:
+  if (!result) {
+    free(m->code);
+    free(m->locations);
+    free(m->data);
+    m->code = NULL;
+    m->locations = NULL;
+    m->data = NULL;
+    m->code_size = m->data_size = m->slots_count = 0;
+    m->relocs_count = m->exports_count = 0;
+  }
+  fclose(f);
+  return result;
+}
+
+// NOTE: the cache only saves time, a module that cannot be written is silently compiled again next time
+void module_cache_store(const Module *m, const ModuleCacheHeader *header, const char *cache_file) {
+  char tmp[PATH_MAX + 32];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", cache_file, (int)getpid());
+  mkdir(module_cache_dir, 0777);
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL)
+    return;
+
+  int32_t count = m->code_size;
+  fwrite(header, sizeof(*header), 1, f);
+  fwrite(m->path, header->path_len, 1, f);
+  fwrite(&count, sizeof(count), 1, f);
+  fwrite(m->code, 1, count, f);
+  for (int i = 0; i < count; ++i) {
+    int32_t line_col[2] = {m->locations[i].line, m->locations[i].col};
+    fwrite(line_col, sizeof(line_col), 1, f);
+  }
+  count = m->data_size;
+  fwrite(&count, sizeof(count), 1, f);
+  fwrite(m->data, 1, count, f);
+  count = m->slots_count;
+  fwrite(&count, sizeof(count), 1, f);
+
+  count = m->relocs_count;
+  fwrite(&count, sizeof(count), 1, f);
+  for (int i = 0; i < m->relocs_count; ++i) {
+    const Reloc *r = &m->relocs[i];
+    int32_t fields[5] = {r->kind, r->offset, r->loc.line, r->loc.col, r->name.len};
+    fwrite(fields, sizeof(fields), 1, f);
+    fwrite(r->name.data, 1, r->name.len, f);
+  }
+  count = m->exports_count;
+  fwrite(&count, sizeof(count), 1, f);
+  for (int i = 0; i < m->exports_count; ++i) {
+    int32_t fields[2] = {m->exports[i].addr, m->exports[i].name.len};
+    fwrite(fields, sizeof(fields), 1, f);
+    fwrite(m->exports[i].name.data, 1, m->exports[i].name.len, f);
+  }
+
+  // NOTE: written aside and renamed, so concurrent runs never read a partial module
+  bool ok = !ferror(f);
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp, cache_file) != 0)
+    unlink(tmp);
+}
+
+// Takes the module from the cache or reads, tokenizes and compiles it, on the calling thread
+bool module_load(Module *m, int64_t compiler_mtime) {
+  struct stat st;
+  if (stat(m->path, &st) < 0) {
+    fprintf(stderr, "Error: could not open the file %s: %s\n", m->filename, strerror(errno));
+    return false;
+  }
+
+  ModuleCacheHeader header = {
+      .compiler_mtime = compiler_mtime,
+      .source_mtime = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec,
+      .source_size = st.st_size,
+      .inline_threshold = inline_threshold,
+      .path_len = strlen(m->path),
+  };
+  memcpy(header.magic, MODULE_CACHE_MAGIC, sizeof(header.magic));
+  m->source_mtime = header.source_mtime;
+  m->source_size = header.source_size;
+  char cache_file[PATH_MAX];
+  // NOTE: a main module compiled with --lazy keeps its source for later, the cache has none
+  bool cacheable = module_cache_dir && !(lazy_blocks && m->is_main);
+  if (cacheable) {
+    module_cache_file(m, cache_file);
+    if (module_cache_load(m, &header, cache_file)) {
+      m->cached = true;
+      return true;
+    }
+  }
+
+  double start = now_seconds();
+  int size = get_file_size(m->filename);
+  if (size < 0)
+    return false;
+  // NOTE: a module loaded before under --watch still has its previous source and tokens, only the lines that
+  // changed since are lexed again
+  Arena old_source = m->source, old_tokens = m->tokens;
+  m->source = arena_create(size + 1);
+  m->tokens = (Arena){0};
+  bool result = read_entire_file(m->filename, &m->source);
+  m->read_time = now_seconds() - start;
+
+  tokens_init();
+  tp = 0;
+  cp = NULL;
+  start = now_seconds();
+  if (result && old_tokens.chunk) {
+    SV old = {old_source.chunk->mem, strlen(old_source.chunk->mem)};
+    SV source = {m->source.chunk->mem, strlen(m->source.chunk->mem)};
+    result = tokenize_edit(old, &old_tokens, source, m->filename, &m->tokens_reused);
+  } else if (lazy_blocks && m->is_main) {
+    result = result && tokenize_lazy(m, (SV){m->source.chunk->mem, strlen(m->source.chunk->mem)});
+    m->tokens_reused = 0;
+  } else {
+    result = result && tokenize(m->source.chunk->mem, m->filename);
+    m->tokens_reused = 0;
+  }
+  m->tokenize_time = now_seconds() - start;
+  m->tokens_lexed = arena_used(&tokens) / sizeof(Token) - m->tokens_reused;
+  if (old_tokens.chunk)
+    arena_destroy(&old_tokens);
+  if (old_source.chunk)
+    arena_destroy(&old_source);
+
+  // NOTE: the compiler retypes tokens in place, the stream the next load reuses is copied before
+  if (result && watching) {
+    m->tokens = arena_create(arena_used(&tokens));
+    for (const ArenaChunk *chunk = tokens.chunk; chunk; chunk = chunk->next) {
+      if (chunk->offset > 0)
+        memcpy(arena_alloc(&m->tokens, chunk->offset), chunk->mem, chunk->offset);
+    }
+  }
+
+  start = now_seconds();
+  result = result && compile(m);
+  m->compile_time = now_seconds() - start;
+  m->tokens_bytes = arena_used(&tokens);
+  if (result && m->lazy) {
+    m->lazy->tokens_arena = tokens;
+    m->lazy->source = m->source;
+    tokens = (Arena){0};
+    m->source = (Arena){0};
+    if (m->lazy->deferred == 0)
+      lazy_release(m->lazy);
+  } else {
+    tokens_free();
+    // NOTE: compile freed the compiler of a lazy program it failed, the rest is freed with it
+    if (m->lazy) {
+      free(m->lazy->blocks);
+      free(m->lazy->blocks_table);
+      free(m->lazy->refs);
+      free(m->lazy);
+      m->lazy = NULL;
+    }
+  }
+
+  if (result && cacheable)
+    module_cache_store(m, &header, cache_file);
+  return result;
+}
+
+Module *module_loader_find(ModuleLoader *l, const char *path) {
+  for (int i = 0; i < l->count; ++i) {
+    if (strcmp(l->modules[i]->path, path) == 0)
+      return l->modules[i];
+  }
+  return NULL;
+}
+
+// Queues a module unless it is known already; the caller holds the lock
+Module *module_loader_add(ModuleLoader *l, const char *path) {
+  Module *m = module_loader_find(l, path);
+  if (m)
+    return m;
+  if (l->count >= MODULES_CAPACITY) {
+    fprintf(stderr, "Error: more than %d modules\n", MODULES_CAPACITY);
+    return NULL;
+  }
+
+  m = calloc(1, sizeof(Module));
+  if (m == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  // NOTE: the path is never freed, debug_locations of the linked program point to it
+  m->path = strdup(path);
+  m->filename = m->path;
+  char cwd[PATH_MAX];
+  int cwd_len = getcwd(cwd, sizeof(cwd)) ? strlen(cwd) : 0;
+  if (cwd_len > 0 && strncmp(m->path, cwd, cwd_len) == 0 && m->path[cwd_len] == '/')
+    m->filename = m->path + cwd_len + 1;
+  m->strings = arena_create(PATH_MAX);
+  l->modules[l->count++] = m;
+  return m;
+}
+
+// Loads queued modules until none is left and no other thread can queue more
+void *module_loader_worker(void *arg) {
+  ModuleLoader *l = arg;
+  pthread_mutex_lock(&l->lock);
+  while (true) {
+    while (l->next == l->count && l->pending > 0)
+      pthread_cond_wait(&l->cond, &l->lock);
+    if (l->next == l->count || l->failed)
+      break;
+
+    Module *m = l->modules[l->next++];
+    l->pending += 1;
+    pthread_mutex_unlock(&l->lock);
+    bool ok = module_load(m, l->compiler_mtime);
+    pthread_mutex_lock(&l->lock);
+
+    for (int i = 0; ok && i < m->relocs_count; ++i) {
+      if (m->relocs[i].kind == RELOC_INCLUDE)
+        ok = module_loader_add(l, m->relocs[i].name.data) != NULL;
+    }
+    m->loaded = ok;
+    l->failed = l->failed || !ok;
+    l->pending -= 1;
+    pthread_cond_broadcast(&l->cond);
+  }
+  pthread_mutex_unlock(&l->lock);
+  return NULL;
+}
+
+// Lays the modules out depth-first from the main one in include order, whichever thread compiled them first
+bool module_place(Module *m, ModuleLoader *l, Module **order, int *order_count) {
+  if (m->link_state == 2)
+    return true;
+  if (m->link_state == 1) {
+    fprintf(stderr, "Error: %s is included in a cycle\n", m->filename);
+    return false;
+  }
+  m->link_state = 1;
+  order[(*order_count)++] = m;
+  for (int i = 0; i < m->relocs_count; ++i) {
+    if (m->relocs[i].kind == RELOC_INCLUDE &&
+        !module_place(module_loader_find(l, m->relocs[i].name.data), l, order, order_count))
+      return false;
+  }
+  m->link_state = 2;
+  return true;
+}
+
+// Links the loaded modules into the global vm, the main module first
+bool module_link(ModuleLoader *l) {
+  Module *order[MODULES_CAPACITY];
+  int order_count = 0;
+  // NOTE: --watch links the same modules again
+  for (int i = 0; i < l->count; ++i)
+    l->modules[i]->link_state = 0;
+  if (!module_place(l->modules[0], l, order, &order_count))
+    return false;
+
+  int code_size = 0, data_size = 0, slots_count = 0, exports_count = 0;
+  for (int i = 0; i < order_count; ++i) {
+    Module *m = order[i];
+    m->code_base = code_size;
+    m->data_base = data_size;
+    m->slots_base = slots_count;
+    code_size += m->code_size;
+    data_size += m->data_size;
+    slots_count += m->slots_count;
+    exports_count += m->exports_count;
+  }
+  if (code_size >= PROGRAM_CAPACITY || data_size >= DATA_CAPACITY || slots_count > SLOTS_CAPACITY) {
+    fprintf(stderr, "Error: the program does not fit the vm (%d bytes of code, %d of data, %d variables)\n",
+            code_size, data_size, slots_count);
+    return false;
+  }
+
+  // Definitions of all the modules in one open addressing table, keyed by name
+  int table_size = 1;
+  while (table_size < 2 * exports_count + 1)
+    table_size *= 2;
+  Export **table = calloc(table_size, sizeof(Export *));
+  int *table_bases = calloc(table_size, sizeof(int));
+  const char **table_files = calloc(table_size, sizeof(char *));
+  if (table == NULL || table_bases == NULL || table_files == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+
+  bool result = true;
+  for (int i = 0; i < order_count; ++i) {
+    Module *m = order[i];
+    for (int j = 0; j < m->exports_count; ++j) {
+      Export *e = &m->exports[j];
+      int k = fnv1a(e->name.data, e->name.len) & (table_size - 1);
+      while (table[k] && !sv_eq(table[k]->name, e->name))
+        k = (k + 1) & (table_size - 1);
+      if (table[k]) {
+        fprintf(stderr, "Error: '%.*s' is defined in both %s and %s\n", svf(e->name), table_files[k], m->filename);
+        result = false;
+        goto defer;
+      }
+      table[k] = e;
+      table_bases[k] = m->code_base;
+      table_files[k] = m->filename;
+    }
+  }
+
+  memset(&vm, 0, sizeof(vm));
+  if (debug_locations == NULL)
+    debug_locations = debug_locations_alloc();
+  for (int i = 0; i < order_count; ++i) {
+    Module *m = order[i];
+    memcpy(vm.program + m->code_base, m->code, m->code_size);
+    memcpy(debug_locations + m->code_base, m->locations, m->code_size * sizeof(Location));
+    memcpy(vm.data + m->data_base, m->data, m->data_size);
+
+    for (int j = 0; j < m->relocs_count; ++j) {
+      const Reloc *r = &m->relocs[j];
+      uint8_t *operand = vm.program + m->code_base + r->offset;
+      static_assert(RELOC_COUNT == 6, "Update RelocKind is required");
+      switch (r->kind) {
+      case RELOC_CODE:
+        operand_write(operand, operand_read(operand, LABEL_ADDR_WIDTH) + m->code_base, LABEL_ADDR_WIDTH);
+        break;
+      case RELOC_DATA:
+        operand_write(operand, operand_read(operand, DATA_OFFSET_WIDTH) + m->data_base, DATA_OFFSET_WIDTH);
+        break;
+      case RELOC_SLOT:
+        operand_write(operand, operand_read(operand, 1) + m->slots_base, 1);
+        break;
+      case RELOC_CALL: {
+        int k = fnv1a(r->name.data, r->name.len) & (table_size - 1);
+        while (table[k] && !sv_eq(table[k]->name, r->name))
+          k = (k + 1) & (table_size - 1);
+        if (table[k] == NULL) {
+          fprintf(stderr, "%s:%d:%d: Error: unknown word '%.*s'\n", r->loc.filename, r->loc.line, r->loc.col,
+                  svf(r->name));
+          result = false;
+          goto defer;
+        }
+        operand_write(operand, table_bases[k] + table[k]->addr, LABEL_ADDR_WIDTH);
+      } break;
+      case RELOC_INCLUDE:
+        operand_write(operand, module_loader_find(l, r->name.data)->code_base, LABEL_ADDR_WIDTH);
+        break;
+      case RELOC_NATIVE: {
+        const Native *native = native_find(r->name);
+        if (native == NULL) {
+          fprintf(stderr, "%s:%d:%d: Error: native '%.*s' is not registered\n", r->loc.filename, r->loc.line,
+                  r->loc.col, svf(r->name));
+          result = false;
+          goto defer;
+        }
+        operand_write(operand, native - natives, NATIVE_WIDTH);
+      } break;
+      default:
+        assert(0 && "unreachable");
+      }
+    }
+  }
+  vm.ip = code_size;
+  vm.data_offset = data_size;
+  // NOTE: the main module is placed first, its blocks compiled with --lazy go after the whole program
+  vm.lazy = order[0]->lazy;
+  if (vm.lazy) {
+    vm.lazy->code_end = code_size;
+    vm.lazy->data_end = data_size;
+  }
+  // NOTE: the blocks compiled late call the words of other modules by name, the modules are freed by then
+  if (vm.lazy && vm.lazy->compiler) {
+    LazyProgram *p = vm.lazy;
+    p->exports_size = table_size;
+    p->exports = calloc(table_size, sizeof(Label));
+    p->exports_names = arena_create(1024);
+    if (p->exports == NULL) {
+      fprintf(stderr, "Error: memory issue...");
+      abort();
+    }
+    for (int k = 0; k < table_size; ++k) {
+      if (table[k] == NULL)
+        continue;
+      char *name = arena_alloc(&p->exports_names, table[k]->name.len);
+      memcpy(name, table[k]->name.data, table[k]->name.len);
+      p->exports[k] = (Label){{name, table[k]->name.len}, table_bases[k] + table[k]->addr};
+    }
+  }
+
+defer:
+  free(table);
+  free(table_bases);
+  free(table_files);
+  return result;
 }
 
-void *arena_alloc(Arena *a, int size) {
-  if (a->chunk->size < size)
-    return NULL;
+void module_free(Module *m) {
+  free(m->code);
+  free(m->locations);
+  free(m->data);
+  free(m->relocs);
+  free(m->exports);
+  arena_destroy(&m->strings);
+  if (m->source.chunk)
+    arena_destroy(&m->source);
+  if (m->tokens.chunk)
+    arena_destroy(&m->tokens);
+  free(m);
+}
 
-  ArenaChunk *chunk = a->chunk;
-  while (chunk && chunk->offset + size > chunk->size)
-    chunk = chunk->next;
+// Drops what loading m produced before it is loaded again, keeping the source and tokens module_load reuses
+void module_unload(Module *m) {
+  free(m->code);
+  free(m->locations);
+  free(m->data);
+  free(m->relocs);
+  free(m->exports);
+  arena_destroy(&m->strings);
+  m->code = NULL;
+  m->locations = NULL;
+  m->data = NULL;
+  m->relocs = NULL;
+  m->exports = NULL;
+  m->code_size = m->data_size = m->slots_count = 0;
+  m->relocs_count = m->relocs_capacity = m->exports_count = m->exports_capacity = 0;
+  m->strings = arena_create(PATH_MAX);
+  m->loaded = m->cached = false;
+}
+
+double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-  if (!chunk) {
-    chunk = arena_chunk_create(a->chunk->size);
-    chunk->next = a->chunk;
+void runqueue_init(RunQueue *q, int capacity) {
+  pthread_mutex_init(&q->lock, NULL);
+  q->tasks = malloc(capacity * sizeof(Task *));
+  if (q->tasks == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
   }
+  q->capacity = capacity;
+  q->head = 0;
+  q->count = 0;
+}
 
-  void *ptr = chunk->mem + chunk->offset;
-  chunk->offset += size;
-  return ptr;
+// Returns how many tasks the queue holds with this one
+int runqueue_push(RunQueue *q, Task *task) {
+  pthread_mutex_lock(&q->lock);
+  assert(q->count < q->capacity);
+  q->tasks[(q->head + q->count++) % q->capacity] = task;
+  int count = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return count;
 }
 
-#define TOKENS_CHUNK_SIZE (1024 * sizeof(Token))
-Arena tokens;
-int tp;         // token pointer
-ArenaChunk *cp; // chunk pointer
+// NOTE: the owner takes from the head, so a yielded task waits behind everything that was ready before it
+Task *runqueue_pop(RunQueue *q) {
+  Task *task = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->count > 0) {
+    task = q->tasks[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count -= 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return task;
+}
 
-void tokens_init(void) { tokens = arena_create(TOKENS_CHUNK_SIZE); }
-void tokens_free(void) { arena_destroy(&tokens); }
+// Queues a ready task. When the queue already held one, a sleeping worker is woken to steal from it.
+void scheduler_push(Scheduler *s, RunQueue *q, Task *task) {
+  atomic_fetch_add(&s->queued, 1);
+  if (runqueue_push(q, task) > 1)
+    scheduler_wake(s, false);
+}
 
-Token *make_token(const Token *source) {
-  Token *token = arena_alloc(&tokens, sizeof(Token));
-  *token = *source;
-  return token;
+// NOTE: a worker going to sleep counts itself in sleeping before it checks queued one last time, and a push
+// counts in queued before it checks sleeping, so one of them always sees the other
+void scheduler_wake(Scheduler *s, bool all) {
+  if (atomic_load(&s->sleeping) == 0)
+    return;
+  pthread_mutex_lock(&s->idle_lock);
+  if (all)
+    pthread_cond_broadcast(&s->wake);
+  else
+    pthread_cond_signal(&s->wake);
+  pthread_mutex_unlock(&s->idle_lock);
 }
 
-bool tokenize(const char *source, const char *filename) {
-  if (NULL == source)
-    return true;
+// Takes half of the first non-empty victim queue (from its tail), keeps one task and queues the rest locally
+Task *scheduler_steal(Scheduler *s, Worker *thief) {
+  Task *stolen[SCHED_STEAL_BATCH];
+  int n = 0;
 
-  Location loc = {.filename = filename, .col = 1, .line = 0};
-  Location prev_loc = loc;
-  int last_token_len = 0;
-  SV sv = sv(source);
-  while (true) {
-    SV line = sv_chop(&sv, svl("\n"));
-    if (line.len <= 0) {
-      if (loc.line == prev_loc.line)
-        loc.col += last_token_len;
-      make_token(&(Token){loc, sv, TOK_EOF});
-      return true;
+  for (int i = 1; i < s->workers_count && n == 0; ++i) {
+    RunQueue *victim = &s->workers[(thief->id + i) % s->workers_count].queue;
+    pthread_mutex_lock(&victim->lock);
+    n = (victim->count + 1) / 2;
+    if (n > SCHED_STEAL_BATCH)
+      n = SCHED_STEAL_BATCH;
+    for (int j = 0; j < n; ++j) {
+      victim->count -= 1;
+      stolen[j] = victim->tasks[(victim->head + victim->count) % victim->capacity];
     }
+    pthread_mutex_unlock(&victim->lock);
+  }
 
-    const char *line_start = line.data;
-    loc.line += 1;
-    loc.col = 1;
+  if (n == 0)
+    return NULL;
 
-    while (line.len > 0) {
-      line = sv_strip(line);
-      if (line.len <= 0)
-        break;
+  thief->steals += 1;
+  for (int j = 1; j < n; ++j)
+    runqueue_push(&thief->queue, stolen[j]);
+  return stolen[0];
+}
 
-      SV token_text;
-      TokenType type = TOK_COUNT;
-      if (*line.data == '"') {
-        // string
-        int i = 1;
-        while (i < line.len && line.data[i] != '"')
-          i += 1;
-        if (line.data[i] != '"')
-          return false; // TODO: parse error
-        token_text = sv_slice(line, 1, i - 1);
-        line = sv_slice(line, i + 1, line.len - i - 1);
-        loc.col = token_text.data - line_start;
-        type = TOK_STR;
-      } else {
-        token_text = sv_strip(sv_chop(&line, svl(" ")));
-        loc.col = token_text.data - line_start + 1;
+void *scheduler_worker(void *arg) {
+  Worker *w = arg;
+  Scheduler *s = w->sched;
 
-        if ((token_text.len > 0 && isdigit(token_text.data[0])) || (token_text.len > 1 && token_text.data[0] == '-' && isdigit(token_text.data[1]))) {
-          type = TOK_INT;
-          SV tmp = token_text;
-          while (tmp.len > 0) {
-            sv_chop(&tmp, svl("."));
-            if (tmp.data[-1] == '.') {
-              if (type != TOK_FLOAT)
-                type = TOK_FLOAT;
-              else
-                return false; // TODO: parse error
-            } else
-              break;
-          }
-        } else if (token_text.len > 0 && token_text.data[0] == '\'') {
-          type = TOK_LABEL;
-        } else if (token_text.len > 0 && token_text.data[0] == '&') {
-          type = TOK_LABEL_ADDR;
-        } else {
-          // keyword
-          for (int i = 0; i < TOK_KW_COUNT; ++i) {
-            if (sv_eq(token_text, keywords[i])) {
-              type = (TokenType)i;
-              break;
-            }
-          }
-          assert(TOK_COUNT != type);
-        }
-      }
-      last_token_len = token_text.len;
-      prev_loc = loc;
-      make_token(&(Token){loc, token_text, type});
+  while (atomic_load(&s->live) > 0) {
+    Task *task = runqueue_pop(&w->queue);
+    if (task == NULL)
+      task = scheduler_steal(s, w);
+    if (task == NULL) {
+      pthread_mutex_lock(&s->idle_lock);
+      atomic_fetch_add(&s->sleeping, 1);
+      while (atomic_load(&s->queued) == 0 && atomic_load(&s->live) > 0)
+        pthread_cond_wait(&s->wake, &s->idle_lock);
+      atomic_fetch_sub(&s->sleeping, 1);
+      pthread_mutex_unlock(&s->idle_lock);
+      continue;
+    }
+    atomic_fetch_sub(&s->queued, 1);
+
+    double wait = now_seconds() - task->ready_since;
+    task->total_wait += wait;
+    if (wait > task->max_wait)
+      task->max_wait = wait;
+
+    long executed = task->vm->instr_count;
+    VMStatus status = vm_run(task->vm, s->budget);
+    executed = task->vm->instr_count - executed;
+
+    w->slices += 1;
+    w->instructions += executed;
+    task->slices += 1;
+
+    if (status == VM_HALTED || status == VM_FAILED) {
+      task->finished = now_seconds();
+      task->failed = status == VM_FAILED;
+      if (atomic_fetch_sub(&s->live, 1) == 1)
+        scheduler_wake(s, true);
+    } else {
+      task->ready_since = now_seconds();
+      scheduler_push(s, &w->queue, task);
     }
   }
 
-  return true;
+  return NULL;
 }
 
-Token *next_token(void) {
-  if (!cp)
-    cp = tokens.chunk;
+void scheduler_run(Scheduler *s) {
+  atomic_init(&s->live, s->tasks_count);
+  atomic_init(&s->queued, 0);
+  atomic_init(&s->sleeping, 0);
+  pthread_mutex_init(&s->idle_lock, NULL);
+  pthread_cond_init(&s->wake, NULL);
+  s->started = now_seconds();
 
-  if (tp >= cp->size) {
-    tp = 0;
-    cp = cp->next;
-    if (!cp) {
-      fprintf(stderr, "Error: Unexpected EOF");
-      exit(1);
+  for (int i = 0; i < s->workers_count; ++i) {
+    Worker *w = &s->workers[i];
+    w->sched = s;
+    w->id = i;
+    runqueue_init(&w->queue, s->tasks_count);
+  }
+
+  for (int i = 0; i < s->tasks_count; ++i) {
+    s->tasks[i].ready_since = s->started;
+    scheduler_push(s, &s->workers[i % s->workers_count].queue, &s->tasks[i]);
+  }
+
+  for (int i = 0; i < s->workers_count; ++i)
+    pthread_create(&s->workers[i].thread, NULL, scheduler_worker, &s->workers[i]);
+  for (int i = 0; i < s->workers_count; ++i)
+    pthread_join(s->workers[i].thread, NULL);
+}
+
+// Jain's fairness index: 1 when all xs are equal, 1/n when a single one takes everything
+double jain_index(const double *xs, int n) {
+  double sum = 0, sum_sq = 0;
+  for (int i = 0; i < n; ++i) {
+    sum += xs[i];
+    sum_sq += xs[i] * xs[i];
+  }
+  return sum_sq > 0 ? sum * sum / (n * sum_sq) : 1;
+}
+
+void scheduler_report(const Scheduler *s) {
+  double wall = 0;
+  long instructions = 0, slices = 0, steals = 0;
+  double total_wait = 0, max_wait = 0;
+
+  double *share = malloc((s->tasks_count + s->workers_count) * sizeof(double));
+  if (share == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  double *load = share + s->tasks_count;
+
+  for (int i = 0; i < s->tasks_count; ++i) {
+    const Task *t = &s->tasks[i];
+    double lifetime = t->finished - s->started;
+    share[i] = lifetime > 0 ? t->vm->instr_count / lifetime : 0;
+    if (t->finished - s->started > wall)
+      wall = t->finished - s->started;
+    total_wait += t->total_wait;
+    if (t->max_wait > max_wait)
+      max_wait = t->max_wait;
+  }
+
+  fprintf(stderr, "scheduler: %d threads, %d tasks, budget %ld\n", s->workers_count, s->tasks_count, s->budget);
+  for (int i = 0; i < s->workers_count; ++i) {
+    const Worker *w = &s->workers[i];
+    fprintf(stderr, "  worker %d: %ld slices, %ld instructions, %ld steals\n", i, w->slices, w->instructions, w->steals);
+    load[i] = w->instructions;
+    instructions += w->instructions;
+    slices += w->slices;
+    steals += w->steals;
+  }
+  fprintf(stderr, "  wall time:    %.6f s\n", wall);
+  fprintf(stderr, "  instructions: %ld (%.0f instr/s)\n", instructions, wall > 0 ? instructions / wall : 0);
+  fprintf(stderr, "  slices:       %ld (%.0f slices/s), %ld steals\n", slices, wall > 0 ? slices / wall : 0, steals);
+  fprintf(stderr, "  wait:         mean %.3f us, max %.3f us per slice\n",
+          slices > 0 ? total_wait / slices * 1e6 : 0, max_wait * 1e6);
+  fprintf(stderr, "  fairness:     %.3f (Jain, instr/s per task)\n", jain_index(share, s->tasks_count));
+  fprintf(stderr, "  load balance: %.3f (Jain, instructions per worker)\n", jain_index(load, s->workers_count));
+
+  free(share);
+}
+
+// Starts the threads of the pool, the first time a par loop runs, with the lock of the pool held
+void par_start(void) {
+  int threads = par_threads > 0 ? par_threads : sysconf(_SC_NPROCESSORS_ONLN);
+  // NOTE: the thread running the par loop works on it as well
+  for (int i = 0; i < threads - 1; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, par_worker, NULL) != 0) {
+      fprintf(stderr, "Warning: par loops run on %d threads instead of %d\n", i + 1, threads);
+      break;
     }
+    pthread_detach(thread);
+    par_pool.threads_count += 1;
   }
+}
 
-  Token *token_arr = (Token *)cp->mem;
+// Forgets the threads of the pool in a forked child, which has none of them; its first par loop starts its own.
+// NOTE: a thread of the parent may have held the lock at the fork, the child initializes it again
+void par_reset(void) {
+  pthread_mutex_init(&par_pool.busy, NULL);
+  pthread_mutex_init(&par_pool.lock, NULL);
+  pthread_cond_init(&par_pool.posted, NULL);
+  pthread_cond_init(&par_pool.finished, NULL);
+  par_pool.job = NULL;
+  par_pool.generation = 0;
+  par_pool.working = 0;
+  par_pool.threads_count = 0;
+  par_pool.started = false;
+}
 
-  return &token_arr[tp++];
+void *par_worker(void *arg) {
+  (void)arg;
+  VM *copy = malloc(sizeof(VM));
+  if (copy == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  long joined = 0;
+  for (;;) {
+    pthread_mutex_lock(&par_pool.lock);
+    while (par_pool.generation == joined)
+      pthread_cond_wait(&par_pool.posted, &par_pool.lock);
+    joined = par_pool.generation;
+    ParJob *job = par_pool.job;
+    pthread_mutex_unlock(&par_pool.lock);
+
+    par_chunks(job, copy);
+
+    pthread_mutex_lock(&par_pool.lock);
+    if (--par_pool.working == 0)
+      pthread_cond_signal(&par_pool.finished);
+    pthread_mutex_unlock(&par_pool.lock);
+  }
+  return NULL;
 }
 
-void token_print(const Token *token) {
-  static_assert(TOK_COUNT == 31, "Update TokenType is required");
-  switch (token->type) {
-  case TOK_INT:
-    printf("int %.*s\n", token->source.len, token->source.data);
-    break;
-  case TOK_FLOAT:
-    printf("float %.*s\n", token->source.len, token->source.data);
-    break;
-  case TOK_STR:
-    printf("str %.*s\n", token->source.len, token->source.data);
-    break;
-  case TOK_PLUS:
-  case TOK_MINUS:
-  case TOK_STAR:
-  case TOK_SLASH:
-  case TOK_MOD:
-  case TOK_PLUS_DOT:
-  case TOK_MINUS_DOT:
-  case TOK_STAR_DOT:
-  case TOK_SLASH_DOT:
-  case TOK_EQ:
-  case TOK_NEQ:
-  case TOK_LT:
-  case TOK_LE:
-  case TOK_GT:
-  case TOK_GE:
-  case TOK_DOT:
-  case TOK_DUP:
-  case TOK_OVER:
-  case TOK_SWAP:
-  case TOK_DROP:
-  case TOK_ROT:
-  case TOK_JMP:
-  case TOK_JZ:
-  case TOK_JNZ:
-  case TOK_LABEL:
-  case TOK_LABEL_ADDR:
-    printf("%.*s\n", token->source.len, token->source.data);
-    break;
-  case TOK_EOF:
-    printf("EOF\n");
-    break;
-  default:
-    assert(0 && "unreachable");
+// Runs chunks of job on copy, a vm of the calling thread, until none is left
+void par_chunks(ParJob *job, VM *copy) {
+  memcpy(copy, job->vm, sizeof(VM));
+  // NOTE: only the vm of the par loop records traces and profiles, the iterations are left out of them
+  copy->trace = NULL;
+  copy->profile = NULL;
+  copy->regs = NULL;
+  copy->strings = (Arena){0};
+  copy->instr_count = 0;
+  for (int c; (c = atomic_fetch_add(&job->next_chunk, 1)) < job->chunks_count;) {
+    int start = job->first + job->trips * c / job->chunks_count;
+    int end = job->first + job->trips * (c + 1) / job->chunks_count;
+    Value acc = par_iterate(job, copy, start);
+    for (int i = start + 1; i < end; ++i)
+      acc = par_combine(job, acc, par_iterate(job, copy, i));
+    job->partials[c] = acc;
   }
+  atomic_fetch_add(&job->instr_count, copy->instr_count);
+  arena_destroy(&copy->strings);
 }
 
-void value_print(Value value) {
-  static_assert(VAL_COUNT == 3, "Update ValueType is required");
-  switch (value.type) {
-  case VAL_INT:
-    printf("%d\n", value.integer);
-    break;
-  case VAL_STR:
-    printf("%s\n", value.cstr);
-    break;
-  case VAL_FLOAT:
-    printf("%g\n", value.float_);
-    break;
+// Runs the body of job for i on copy and returns the value it leaves
+Value par_iterate(const ParJob *job, VM *copy, int i) {
+  copy->stack[0] = (Value){.type = VAL_INT, .integer = i};
+  copy->sp = 1;
+  copy->rstack[0] = job->halt;
+  copy->rsp = 1;
+  copy->ip = job->addr;
+  if (!vm_finish(copy))
+    vm_check_failed(copy, job->ip, INSTR_PAR_SUM + job->reduction, "the body runs to its end");
+  if (copy->sp != 1 || (copy->stack[0].type != VAL_INT && copy->stack[0].type != VAL_FLOAT))
+    vm_check_failed(copy, job->ip, INSTR_PAR_SUM + job->reduction, "the body leaves one number");
+  // NOTE: strings the body builds die with the iteration
+  if (copy->strings.chunk)
+    arena_release(&copy->strings, copy->strings.chunk, 0);
+  return copy->stack[0];
+}
+
+Value par_combine(const ParJob *job, Value a, Value b) {
+  if (a.type != b.type)
+    vm_check_failed(job->vm, job->ip, INSTR_PAR_SUM + job->reduction, "the body always leaves the same type");
+  bool less = a.type == VAL_INT ? b.integer < a.integer : b.float_ < a.float_;
+  static_assert(REDUCE_COUNT == 3, "Update Reduction is required");
+  switch (job->reduction) {
+  case REDUCE_SUM:
+    if (a.type == VAL_INT)
+      a.integer = (int)((unsigned)a.integer + (unsigned)b.integer);
+    else
+      a.float_ += b.float_;
+    return a;
+  case REDUCE_MIN:
+    return less ? b : a;
+  case REDUCE_MAX:
+    return less || (a.type == VAL_INT ? b.integer == a.integer : b.float_ == a.float_) ? a : b;
   default:
     assert(0 && "unreachable");
   }
 }
 
-void vm_dump_stack(void) {
-  printf("stack[%d]:\n", vm.sp);
-  for (int i = 0; i < vm.sp; ++i) {
-    printf("  ");
-    value_print(vm.stack[i]);
+// The par loop of vm at ip: the body at addr for every i in [first, bound), its values combined with reduction.
+// An empty range leaves 0. While another par loop has the pool, the iterations run on the calling thread.
+Value par_run(VM *vm, int ip, int addr, Reduction reduction, int first, int bound) {
+  if (bound <= first)
+    return (Value){.type = VAL_INT, .integer = 0};
+  pthread_mutex_lock(&par_pool.lock);
+  if (!par_pool.started)
+    par_start();
+  par_pool.started = true;
+  pthread_mutex_unlock(&par_pool.lock);
+
+  ParJob job = {.vm = vm, .ip = ip, .addr = addr, .reduction = reduction, .first = first};
+  job.trips = (long long)bound - first;
+  // NOTE: the main program ends with the only DONE, the body returns there to stop its copy of the vm
+  job.halt = 0;
+  while (job.halt < PROGRAM_CAPACITY && OPCODE_INSTR(vm->program[job.halt]) != INSTR_DONE)
+    job.halt += instr_size(vm->program[job.halt]);
+  if (job.halt >= PROGRAM_CAPACITY)
+    vm_check_failed(vm, ip, INSTR_PAR_SUM + reduction, "the program ends");
+  atomic_init(&job.next_chunk, 0);
+  atomic_init(&job.instr_count, 0);
+
+  bool pooled = par_pool.threads_count > 0 && job.trips >= 2 * PAR_MIN_CHUNK &&
+                pthread_mutex_trylock(&par_pool.busy) == 0;
+  long long chunks = job.trips / PAR_MIN_CHUNK;
+  long long chunks_max = (par_pool.threads_count + 1) * PAR_CHUNKS_PER_THREAD;
+  job.chunks_count = !pooled ? 1 : chunks < chunks_max ? chunks : chunks_max;
+  job.partials = malloc(job.chunks_count * sizeof(Value));
+  VM *copy = malloc(sizeof(VM));
+  if (job.partials == NULL || copy == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+
+  if (pooled) {
+    pthread_mutex_lock(&par_pool.lock);
+    par_pool.job = &job;
+    par_pool.working = par_pool.threads_count;
+    par_pool.generation += 1;
+    pthread_cond_broadcast(&par_pool.posted);
+    pthread_mutex_unlock(&par_pool.lock);
+  }
+  par_chunks(&job, copy);
+  if (pooled) {
+    pthread_mutex_lock(&par_pool.lock);
+    while (par_pool.working > 0)
+      pthread_cond_wait(&par_pool.finished, &par_pool.lock);
+    pthread_mutex_unlock(&par_pool.lock);
+    pthread_mutex_unlock(&par_pool.busy);
   }
+
+  Value result = job.partials[0];
+  for (int c = 1; c < job.chunks_count; ++c)
+    result = par_combine(&job, result, job.partials[c]);
+  vm->instr_count += job.instr_count;
+  free(job.partials);
+  free(copy);
+  return result;
 }
 
-void vm_dump(void) {
-  printf("VM:\n");
+BatchGroup *batch_group_alloc(Batch *b) {
+  assert(b->pool_count > 0);
+  BatchGroup *g = b->pool[--b->pool_count];
+  g->lanes_count = 0;
+  return g;
+}
 
-  printf("ip = %d\n", vm.ip);
-  printf("program:\n");
-  Instr instr;
-  for (int ip = 0; ip < STACK_CAPACITY;) {
-    instr = vm.program[ip].word;
-    if (instr == INSTR_DONE)
-      break;
+// Regroups lanes by the ip they continue at: lanes going where lane 0 goes stay in g (compacted),
+// every other target gets a new pending group
+void batch_diverge(Batch *b, BatchGroup *g, const int *next_ip) {
+  BatchGroup *split[BATCH_LANES];
+  int split_count = 0;
+  int kept = 0;
 
-    static_assert(INSTR_COUNT == 30, "Update Instr is required");
-    switch (instr) {
-    case INSTR_INT: {
-      assert(ip + 1 < STACK_CAPACITY);
-      int value = vm.program[++ip].integer;
-      printf("int(%d) ", value);
-      ip += 1;
-    } break;
-    case INSTR_FLOAT: {
-      assert(ip + 1 < STACK_CAPACITY);
-      float value = vm.program[++ip].float_;
-      printf("float(%g) ", value);
-      ip += 1;
-    } break;
-    case INSTR_STRING:
-      assert(ip + 1 < STACK_CAPACITY);
-      Word word = vm.program[++ip];
-      printf("\"%s\"", (char *)word.cstr);
-      ip += 1;
-      break;
-    case INSTR_ADD:
-      printf("+ ");
-      ip += 1;
-      break;
-    case INSTR_SUB:
-      printf("- ");
-      ip += 1;
-      break;
-    case INSTR_MUL:
-      printf("* ");
-      ip += 1;
-      break;
-    case INSTR_DIV:
-      printf("/ ");
-      ip += 1;
-      break;
-    case INSTR_ADDF:
-      printf("+. ");
-      ip += 1;
-      break;
-    case INSTR_SUBF:
-      printf("-. ");
-      ip += 1;
-      break;
-    case INSTR_MULF:
-      printf("*. ");
-      ip += 1;
-      break;
-    case INSTR_DIVF:
-      printf("/. ");
-      ip += 1;
-      break;
-    case INSTR_MOD:
-      printf("%% ");
-      ip += 1;
-      break;
+  for (int l = 0; l < g->lanes_count; ++l) {
+    BatchGroup *target = g;
+    if (next_ip[l] != next_ip[0]) {
+      target = NULL;
+      for (int i = 0; i < split_count && !target; ++i)
+        if (split[i]->ip == next_ip[l])
+          target = split[i];
+      if (!target) {
+        target = batch_group_alloc(b);
+        target->ip = next_ip[l];
+        target->sp = g->sp;
+        target->rsp = g->rsp;
+        memcpy(target->types, g->types, g->sp * sizeof(ValueType));
+        memcpy(target->rstack, g->rstack, g->rsp * sizeof(int));
+        memcpy(target->slot_types, g->slot_types, sizeof(g->slot_types));
+        split[split_count++] = target;
+      }
+    }
+
+    int lane = target == g ? kept++ : target->lanes_count++;
+    target->records[lane] = g->records[l];
+    for (int i = 0; i < g->sp; ++i)
+      target->stack[i][lane] = g->stack[i][l];
+    for (int i = 0; i < SLOTS_CAPACITY; ++i)
+      target->slots[i][lane] = g->slots[i][l];
+  }
+
+  g->lanes_count = kept;
+  g->ip = next_ip[0];
+  for (int i = 0; i < split_count; ++i)
+    b->pending[b->pending_count++] = split[i];
+}
+
+// Applies `a op b` to the two topmost slots of every active lane, leaving the result in place of a.
+// NOTE: slots are accessed as restrict int/float arrays so that an optimized build can vectorize the loop; the
+// lanes past lanes_count hold stale values that could overflow, they are left alone.
+#define BATCH_BINOP(type, result_type, op)                                \
+  do {                                                                    \
+    type *restrict a = (type *)g->stack[g->sp - 2];                       \
+    const type *restrict b = (const type *)g->stack[g->sp - 1];           \
+    for (int l = 0; l < g->lanes_count; ++l)                              \
+      a[l] = a[l] op b[l];                                                \
+    g->types[g->sp - 2] = (result_type);                                  \
+    g->sp -= 1;                                                           \
+  } while (0)
+
+void batch_exec(Batch *batch, BatchGroup *g) {
+  const VM *vm = batch->vm;
+  int next_ip[BATCH_LANES];
+  // NOTE: TRIPS and the SERIES after it are straight-line code, the group cannot split between them
+  int loop_first[BATCH_LANES];
+  long long trips[BATCH_LANES];
 
+  for (;;) {
+    uint8_t opcode = vm->program[g->ip];
+    Instr instr = OPCODE_INSTR(opcode);
+
+    switch (instr) {
+    case INSTR_INT:
+    case INSTR_FLOAT:
+    case INSTR_STRING:
+    case INSTR_LABEL_ADDR: {
+      assert(g->sp < STACK_CAPACITY);
+      int value = operand_read(vm->program + g->ip + 1, OPCODE_WIDTH(opcode));
+      for (int l = 0; l < BATCH_LANES; ++l)
+        g->stack[g->sp][l].integer = value;
+      g->types[g->sp++] = instr == INSTR_FLOAT ? VAL_FLOAT : instr == INSTR_STRING ? VAL_STR : VAL_INT;
+      g->ip += 1 + OPCODE_WIDTH(opcode);
+    } break;
+
+    case INSTR_ADD:
+    case INSTR_SUB:
+    case INSTR_MUL:
     case INSTR_EQ:
-      printf("=");
-      ip += 1;
-      break;
     case INSTR_NEQ:
-      printf("!=");
-      ip += 1;
-      break;
     case INSTR_LT:
-      printf("<");
-      ip += 1;
-      break;
     case INSTR_LE:
-      printf("<=");
-      ip += 1;
-      break;
     case INSTR_GT:
-      printf(">");
-      ip += 1;
-      break;
     case INSTR_GE:
-      printf(">=");
-      ip += 1;
+      assert(g->sp >= 2);
+      assert(g->types[g->sp - 2] == VAL_INT && g->types[g->sp - 1] == VAL_INT);
+      // clang-format off
+      if (instr == INSTR_ADD)      BATCH_BINOP(int, VAL_INT, +);
+      else if (instr == INSTR_SUB) BATCH_BINOP(int, VAL_INT, -);
+      else if (instr == INSTR_MUL) BATCH_BINOP(int, VAL_INT, *);
+      else if (instr == INSTR_EQ)  BATCH_BINOP(int, VAL_INT, ==);
+      else if (instr == INSTR_NEQ) BATCH_BINOP(int, VAL_INT, !=);
+      else if (instr == INSTR_LT)  BATCH_BINOP(int, VAL_INT, <);
+      else if (instr == INSTR_LE)  BATCH_BINOP(int, VAL_INT, <=);
+      else if (instr == INSTR_GT)  BATCH_BINOP(int, VAL_INT, >);
+      else                         BATCH_BINOP(int, VAL_INT, >=);
+      // clang-format on
+      g->ip += 1;
       break;
 
-    case INSTR_DUP:
-      printf("dup ");
-      ip += 1;
-      break;
-    case INSTR_OVER:
-      printf("over ");
-      ip += 1;
+    case INSTR_DIV:
+    case INSTR_MOD: {
+      // NOTE: only active lanes, garbage lanes could divide by zero
+      assert(g->sp >= 2);
+      assert(g->types[g->sp - 2] == VAL_INT && g->types[g->sp - 1] == VAL_INT);
+      BatchWord *a = g->stack[g->sp - 2], *b = g->stack[g->sp - 1];
+      for (int l = 0; l < g->lanes_count; ++l)
+        a[l].integer = instr == INSTR_DIV ? a[l].integer / b[l].integer : a[l].integer % b[l].integer;
+      g->sp -= 1;
+      g->ip += 1;
+    } break;
+
+    case INSTR_ADDF:
+    case INSTR_SUBF:
+    case INSTR_MULF:
+    case INSTR_DIVF:
+      assert(g->sp >= 2);
+      assert(g->types[g->sp - 2] == VAL_FLOAT && g->types[g->sp - 1] == VAL_FLOAT);
+      // clang-format off
+      if (instr == INSTR_ADDF)      BATCH_BINOP(float, VAL_FLOAT, +);
+      else if (instr == INSTR_SUBF) BATCH_BINOP(float, VAL_FLOAT, -);
+      else if (instr == INSTR_MULF) BATCH_BINOP(float, VAL_FLOAT, *);
+      else                          BATCH_BINOP(float, VAL_FLOAT, /);
+      // clang-format on
+      g->ip += 1;
       break;
+
+    case INSTR_DUP:
+    case INSTR_OVER: {
+      int depth = instr == INSTR_DUP ? 1 : 2;
+      assert(g->sp >= depth && g->sp + 1 < STACK_CAPACITY);
+      memcpy(g->stack[g->sp], g->stack[g->sp - depth], sizeof(g->stack[0]));
+      g->types[g->sp] = g->types[g->sp - depth];
+      g->sp += 1;
+      g->ip += 1;
+    } break;
+
     case INSTR_SWAP:
-      printf("swap ");
-      ip += 1;
-      break;
+    case INSTR_ROT: {
+      // NOTE: rot bubbles the third slot up to the top with two adjacent swaps
+      assert(g->sp >= (instr == INSTR_SWAP ? 2 : 3));
+      for (int i = instr == INSTR_SWAP ? g->sp - 2 : g->sp - 3; i < g->sp - 1; ++i) {
+        BatchWord tmp[BATCH_LANES];
+        memcpy(tmp, g->stack[i], sizeof(tmp));
+        memcpy(g->stack[i], g->stack[i + 1], sizeof(tmp));
+        memcpy(g->stack[i + 1], tmp, sizeof(tmp));
+        ValueType type = g->types[i];
+        g->types[i] = g->types[i + 1];
+        g->types[i + 1] = type;
+      }
+      g->ip += 1;
+    } break;
+
     case INSTR_DROP:
-      printf("drop ");
-      ip += 1;
-      break;
-    case INSTR_ROT:
-      printf("rot ");
-      ip += 1;
+      assert(g->sp >= 1);
+      g->sp -= 1;
+      g->ip += 1;
       break;
+
     case INSTR_JMP:
-      printf("jmp ");
-      ip += 1;
-      break;
     case INSTR_JZ:
-      printf("jz ");
-      ip += 1;
+    case INSTR_JNZ: {
+      bool uniform = true;
+      if (instr == INSTR_JMP) {
+        assert(g->sp >= 1);
+        assert(g->types[g->sp - 1] == VAL_INT);
+        BatchWord *addr = g->stack[--g->sp];
+        for (int l = 0; l < g->lanes_count; ++l) {
+          next_ip[l] = addr[l].integer;
+          uniform = uniform && next_ip[l] == next_ip[0];
+        }
+      } else {
+        assert(g->sp >= 2);
+        assert(g->types[g->sp - 2] == VAL_INT && g->types[g->sp - 1] == VAL_INT);
+        BatchWord *cond = g->stack[--g->sp];
+        BatchWord *addr = g->stack[--g->sp];
+        for (int l = 0; l < g->lanes_count; ++l) {
+          next_ip[l] = cond[l].integer == (instr == INSTR_JNZ) ? addr[l].integer : g->ip + 1;
+          uniform = uniform && next_ip[l] == next_ip[0];
+        }
+      }
+      if (uniform)
+        g->ip = next_ip[0];
+      else
+        batch_diverge(batch, g, next_ip);
+    } break;
+
+    case INSTR_CALL:
+      assert(g->rsp < RSTACK_CAPACITY);
+      g->rstack[g->rsp++] = g->ip + 1 + OPCODE_WIDTH(opcode);
+      g->ip = operand_read(vm->program + g->ip + 1, OPCODE_WIDTH(opcode));
+      break;
+
+    case INSTR_RET:
+      assert(g->rsp >= 1);
+      g->ip = g->rstack[--g->rsp];
       break;
-    case INSTR_JNZ:
-      printf("jnz ");
-      ip += 1;
+
+    case INSTR_STORE: {
+      assert(g->sp >= 1);
+      int slot = operand_read(vm->program + g->ip + 1, OPCODE_WIDTH(opcode));
+      g->sp -= 1;
+      memcpy(g->slots[slot], g->stack[g->sp], sizeof(g->slots[0]));
+      g->slot_types[slot] = g->types[g->sp];
+      g->ip += 1 + OPCODE_WIDTH(opcode);
+    } break;
+
+    case INSTR_LOAD: {
+      assert(g->sp < STACK_CAPACITY);
+      int slot = operand_read(vm->program + g->ip + 1, OPCODE_WIDTH(opcode));
+      memcpy(g->stack[g->sp], g->slots[slot], sizeof(g->slots[0]));
+      g->types[g->sp++] = g->slot_types[slot];
+      g->ip += 1 + OPCODE_WIDTH(opcode);
+    } break;
+
+    case INSTR_LOOP: {
+      LoopOperand loop = loop_operand_read(vm->program + g->ip + 1);
+      assert(loop.slot >= 0 ? g->slot_types[loop.slot] == VAL_INT : g->sp >= 1 && g->types[g->sp - 1] == VAL_INT);
+      assert(loop.bound_slot < 0 || g->slot_types[loop.bound_slot] == VAL_INT);
+      BatchWord *counter = loop.slot >= 0 ? g->slots[loop.slot] : g->stack[g->sp - 1];
+      bool uniform = true;
+      for (int l = 0; l < g->lanes_count; ++l) {
+        counter[l].integer += 1;
+        int bound = loop.bound_slot >= 0 ? g->slots[loop.bound_slot][l].integer : loop.value;
+        next_ip[l] = counter[l].integer < bound ? loop.target : g->ip + 1 + LOOP_OPERAND_WIDTH;
+        uniform = uniform && next_ip[l] == next_ip[0];
+      }
+      if (uniform)
+        g->ip = next_ip[0];
+      else
+        batch_diverge(batch, g, next_ip);
+    } break;
+
+    case INSTR_TRIPS: {
+      LoopOperand loop = loop_operand_read(vm->program + g->ip + 1);
+      assert(g->slot_types[loop.slot] == VAL_INT);
+      assert(loop.bound_slot < 0 || g->slot_types[loop.bound_slot] == VAL_INT);
+      for (int l = 0; l < g->lanes_count; ++l) {
+        int bound = loop.bound_slot >= 0 ? g->slots[loop.bound_slot][l].integer : loop.value;
+        loop_first[l] = g->slots[loop.slot][l].integer;
+        trips[l] = loop_trips(loop_first[l], bound);
+        g->slots[loop.slot][l].integer = loop_last(loop_first[l], trips[l]);
+      }
+      g->ip += 1 + LOOP_OPERAND_WIDTH;
+    } break;
+
+    case INSTR_SERIES: {
+      LoopOperand loop = loop_operand_read(vm->program + g->ip + 1);
+      assert(g->slot_types[loop.slot] == VAL_INT);
+      BatchWord *acc = g->slots[loop.slot];
+      for (int l = 0; l < g->lanes_count; ++l)
+        acc[l].integer = loop_series(acc[l].integer, loop_first[l], trips[l], loop.target, loop.value);
+      g->ip += 1 + LOOP_OPERAND_WIDTH;
+    } break;
+
+    case INSTR_SNAPSHOT:
+      g->ip += 1;
       break;
+
     case INSTR_DUMP:
-      printf(". ");
-      ip += 1;
+      assert(g->sp >= 1);
+      g->sp -= 1;
+      for (int l = 0; l < g->lanes_count; ++l) {
+        Value value = {.type = g->types[g->sp], .integer = g->stack[g->sp][l].integer};
+        if (value.type == VAL_STR)
+          value = string_literal(vm->data, g->stack[g->sp][l].integer);
+        value_print(value);
+      }
+      g->ip += 1;
       break;
+
     case INSTR_DONE:
-      printf("done ");
-      ip += 1;
-      break;
-    case INSTR_COUNT:
-      assert(0 && "unreachable");
+      for (int l = 0; l < g->lanes_count; ++l) {
+        batch->results[g->records[l]] = g->sp > 0 ? g->stack[g->sp - 1][l] : (BatchWord){0};
+        if (g->sp > 0)
+          batch->results_types[g->records[l]] = g->types[g->sp - 1];
+      }
+      return;
+
     default:
       assert(0 && "unreachable");
     }
   }
-  printf("\n");
+}
+
+// Runs the global vm's program once per record of input_path (a column of native 4-byte ints or floats),
+// each lane starting with its record on the stack. The value left on the top of every lane's stack is
+// written to output_path as a column of the same kind, or printed when output_path is NULL.
+bool batch_run(const VM *vm, const char *input_path, ValueType input_type, const char *output_path) {
+  // NOTE: only the core instructions run in lanes. A lane only holds a word, the strings string operations build
+  // do not fit in it and natives work on whole values. The input is read a field at a time in order, which lanes
+  // in lockstep cannot share, par loops run whole vms and the blocks --lazy compiles late are copied into the vm
+  // that reaches them.
+  for (int ip = 0; ip < vm->program_size; ip += instr_size(vm->program[ip])) {
+    Instr instr = OPCODE_INSTR(vm->program[ip]);
+    if (instr_info[instr].group != GROUP_CORE) {
+      fprintf(stderr, "Error: %s at ip %d is not supported with --batch\n", instr_to_cstr(instr), ip);
+      return false;
+    }
+  }
 
-  vm_dump_stack();
+  int size = get_file_size(input_path);
+  if (size < 0)
+    return false;
 
-  printf("data: is not supported yet\n");
+  int records_count = size / sizeof(BatchWord);
+  BatchWord *records = malloc(records_count * sizeof(BatchWord) + 1);
+  Batch batch = {.vm = vm};
+  batch.results = malloc(records_count * sizeof(BatchWord) + 1);
+  batch.results_types = malloc(records_count * sizeof(ValueType) + 1);
+  BatchGroup *groups = calloc(BATCH_LANES, sizeof(BatchGroup));
+  if (records == NULL || batch.results == NULL || batch.results_types == NULL || groups == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  for (int i = 0; i < records_count; ++i)
+    batch.results_types[i] = input_type;
+
+  FILE *f = fopen(input_path, "rb");
+  if (f == NULL || fread(records, sizeof(BatchWord), records_count, f) != (size_t)records_count) {
+    fprintf(stderr, "Could not read file %s: %s\n", input_path, strerror(errno));
+    if (f)
+      fclose(f);
+    return false;
+  }
+  fclose(f);
+
+  for (int first = 0; first < records_count; first += BATCH_LANES) {
+    batch.pool_count = 0;
+    for (int i = 0; i < BATCH_LANES; ++i)
+      batch.pool[batch.pool_count++] = &groups[i];
+
+    BatchGroup *g = batch_group_alloc(&batch);
+    g->ip = 0;
+    g->sp = 1;
+    g->rsp = 0;
+    memset(g->slot_types, 0, sizeof(g->slot_types));
+    memset(g->slots, 0, sizeof(g->slots));
+    g->types[0] = input_type;
+    g->lanes_count = records_count - first < BATCH_LANES ? records_count - first : BATCH_LANES;
+    for (int l = 0; l < BATCH_LANES; ++l) {
+      g->records[l] = first + l;
+      g->stack[0][l] = l < g->lanes_count ? records[first + l] : (BatchWord){0};
+    }
+
+    batch.pending[batch.pending_count++] = g;
+    while (batch.pending_count > 0)
+      batch_exec(&batch, batch.pending[--batch.pending_count]);
+  }
+
+  if (output_path) {
+    // NOTE: the output is a column of one kind, results of another type cannot be written in it
+    for (int i = 1; i < records_count; ++i) {
+      if (batch.results_types[i] != batch.results_types[0]) {
+        fprintf(stderr, "Error: records 0 and %d end with values of different types, --batch-out needs one\n", i);
+        return false;
+      }
+    }
+    FILE *out = fopen(output_path, "wb");
+    if (out == NULL || fwrite(batch.results, sizeof(BatchWord), records_count, out) != (size_t)records_count) {
+      fprintf(stderr, "Could not write file %s: %s\n", output_path, strerror(errno));
+      if (out)
+        fclose(out);
+      return false;
+    }
+    fclose(out);
+  } else {
+    for (int i = 0; i < records_count; ++i) {
+      Value value = {.type = batch.results_types[i], .integer = batch.results[i].integer};
+      if (value.type == VAL_STR)
+        value = string_literal(vm->data, batch.results[i].integer);
+      value_print(value);
+    }
+  }
+
+  free(groups);
+  free(batch.results_types);
+  free(batch.results);
+  free(records);
+  return true;
 }
 
-const char *instr_to_cstr(Instr instr) {
-  // clang-format off
-  static_assert(INSTR_COUNT == 30, "Update Instr is required");
-  switch (instr) {
-  case INSTR_INT:        return "INSTR_INT";
-  case INSTR_FLOAT:      return "INSTR_FLOAT";
-  case INSTR_STRING:     return "INSTR_STRING";
-  case INSTR_LABEL:      return "INSTR_LABEL";
-  case INSTR_LABEL_ADDR: return "INSTR_LABEL_ADDR";
-  case INSTR_ADD:        return "INSTR_ADD";
-  case INSTR_SUB:        return "INSTR_SUB";
-  case INSTR_MUL:        return "INSTR_MUL";
-  case INSTR_DIV:        return "INSTR_DIV";
-  case INSTR_MOD:        return "INSTR_MOD";
-  case INSTR_ADDF:       return "INSTR_ADDF";
-  case INSTR_SUBF:       return "INSTR_SUBF";
-  case INSTR_MULF:       return "INSTR_MULF";
-  case INSTR_DIVF:       return "INSTR_DIVF";
-  case INSTR_EQ:         return "INSTR_EQ";
-  case INSTR_NEQ:        return "INSTR_NEQ";
-  case INSTR_LT:         return "INSTR_LT";
-  case INSTR_LE:         return "INSTR_LE";
-  case INSTR_GT:         return "INSTR_GT";
-  case INSTR_GE:         return "INSTR_GE";
-  case INSTR_DUP:        return "INSTR_DUP";
-  case INSTR_OVER:       return "INSTR_OVER";
-  case INSTR_SWAP:       return "INSTR_SWAP";
-  case INSTR_DROP:       return "INSTR_DROP";
-  case INSTR_ROT:        return "INSTR_ROT";
-  case INSTR_JMP:        return "INSTR_JMP";
-  case INSTR_JZ:         return "INSTR_JZ";
-  case INSTR_JNZ:        return "INSTR_JNZ";
-  case INSTR_DUMP:       return "INSTR_DUMP";
-  case INSTR_DONE:       return "INSTR_DONE";
-  case INSTR_COUNT:      return "INSTR_COUNT";
-  default:               assert(0 && "unreachable");
+// Runs the program `requests` times. The part before the first `snapshot` is the prelude, the rest is
+// the request; the prelude runs once unless mode is REQUEST_COLD.
+bool serve_requests(const char *filename, int requests, RequestMode mode, StatsFormat stats_format) {
+  static_assert(REQUEST_MODE_COUNT == 3, "Update RequestMode is required");
+  double start = now_seconds();
+  VM *snapshot = malloc(sizeof(VM));
+  if (snapshot == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
   }
-  // clang-format on
+
+  bool result = true;
+  int served = 0;
+  if (mode != REQUEST_COLD) {
+    if (!load_program(filename)) {
+      result = false;
+      goto defer;
+    }
+    // NOTE: a program without a snapshot point is all request, that run was the first one
+    VMStatus status = vm_run(&vm, VM_BUDGET_UNLIMITED);
+    if (status == VM_FAILED) {
+      result = false;
+      goto defer;
+    }
+    if (status == VM_HALTED) {
+      served = 1;
+      vm_reset(&vm);
+    }
+    *snapshot = vm;
+  }
+  double prelude_time = now_seconds() - start;
+  // NOTE: a child reading the input would consume stdin for the next ones, it is read whole before forking
+  if (mode == REQUEST_FORK && program_reads_input(&vm)) {
+    input_get(&vm);
+    input_fill(0, INPUT_ALL);
+  }
+
+  int counters[COUNTER_COUNT];
+  bool counting = stats_format != STATS_OFF && counters_open(counters);
+  start = now_seconds();
+  for (int i = served; i < requests; ++i) {
+    if (mode == REQUEST_COLD) {
+      if (!load_program(filename)) {
+        result = false;
+        goto defer;
+      }
+      bool ok = vm_finish(&vm);
+      vm_reset(&vm); // frees its strings before the next load
+      if (!ok) {
+        result = false;
+        goto defer;
+      }
+    } else if (mode == REQUEST_RESTORE) {
+      vm_restore(&vm, snapshot);
+      if (!vm_finish(&vm)) {
+        result = false;
+        goto defer;
+      }
+    } else {
+      fflush(stdout); // the child must not flush what the parent buffered
+      pid_t pid = fork();
+      if (pid < 0) {
+        fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
+        result = false;
+        goto defer;
+      }
+      if (pid == 0) {
+        // NOTE: threads do not survive fork, the child starts its own compiler thread for --lazy and par loops
+        lazy_compiler_started = false;
+        par_reset();
+        bool ok = vm_finish(&vm);
+        fflush(stdout);
+        _exit(ok ? 0 : 1);
+      }
+      int wstatus;
+      if (waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+        fprintf(stderr, "Error: request %d failed\n", i);
+        result = false;
+        goto defer;
+      }
+    }
+  }
+  double requests_time = now_seconds() - start;
+  if (counting)
+    counters_close(counters, &stats);
+
+  const char *mode_names[REQUEST_MODE_COUNT] = {
+      [REQUEST_COLD] = "cold",
+      [REQUEST_RESTORE] = "restore",
+      [REQUEST_FORK] = "fork",
+  };
+  // NOTE: a request run with the prelude is not in the timed window
+  int timed = requests - served;
+  fprintf(stderr, "requests: %d (%s), prelude %.6f ms, %.6f s total, %.0f req/s\n", requests, mode_names[mode],
+          prelude_time * 1e3, requests_time, requests_time > 0 ? timed / requests_time : 0);
+  // NOTE: the vm is the one of the last request, or the snapshot with REQUEST_FORK where the children ran them
+  if (stats_format != STATS_OFF) {
+    stats.startup_time = prelude_time;
+    stats.run_time = requests_time;
+    stats_collect(&vm, &stats);
+    stats_print(&stats, stats_format);
+  }
+
+defer:
+  free(snapshot);
+  return result;
 }
 
-int compiler_get_label_addr(SV label_name) {
-  for (int i = 0; i < vm.labels_count; ++i) {
-    if (sv_eq(label_name, vm.labels[i].name))
-      return vm.labels[i].addr;
+// Loads a program and every module it includes, compiled on module_jobs threads or taken from the module
+// cache, and links them into the global vm, ready to run
+bool load_program(const char *filename) {
+  ModuleLoader *l = module_loader_create(filename);
+  if (l == NULL)
+    return false;
+  bool result = module_loader_run(l) && program_build(l);
+  module_loader_free(l);
+  return result;
+}
+
+// A loader with the main module of the program queued
+ModuleLoader *module_loader_create(const char *filename) {
+  char path[PATH_MAX];
+  if (realpath(filename, path) == NULL) {
+    fprintf(stderr, "Error: could not open the file %s: %s\n", filename, strerror(errno));
+    return NULL;
   }
-  return -1;
+
+  ModuleLoader *l = calloc(1, sizeof(ModuleLoader));
+  if (l == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  pthread_mutex_init(&l->lock, NULL);
+  pthread_cond_init(&l->cond, NULL);
+  struct stat exe;
+  if (stat("/proc/self/exe", &exe) == 0)
+    l->compiler_mtime = exe.st_mtim.tv_sec * 1000000000ll + exe.st_mtim.tv_nsec;
+
+  Module *main_module = module_loader_add(l, path);
+  main_module->filename = filename;
+  main_module->is_main = true;
+  return l;
 }
 
-bool compile(void) {
-  Label unresolved_labels[LABELS_CAPACITY] = {0};
-  int ulc = 0;
+// Loads the queued modules and the ones they include, on front_end_jobs threads
+bool module_loader_run(ModuleLoader *l) {
+  int jobs = front_end_jobs();
+  pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+  if (threads == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+  // NOTE: every thread compiles into its own thread local vm, the program is linked into the one of this thread
+  for (int i = 0; i < jobs; ++i)
+    pthread_create(&threads[i], NULL, module_loader_worker, l);
+  for (int i = 0; i < jobs; ++i)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  return !l->failed;
+}
 
-  // First pass
-  for (Token *token = next_token(); token->type != TOK_EOF; token = next_token()) {
-    // clang-format off
-    static_assert(TOK_COUNT == 31, "Update TokenType is required");
-    switch (token->type) {
-    case TOK_INT: {
-      int i = atoi(token->source.data);
-      vm_push_instr(INSTR_INT, (Word){.integer=i});
-    } break;
+// Links the loaded modules into the global vm and gets it ready to run
+bool program_build(ModuleLoader *l) {
+  bool result = module_link(l);
+  if (result) {
+    stats.read_time = stats.tokenize_time = stats.compile_time = 0;
+    stats.tokens_bytes = 0;
+    stats.modules = l->count;
+    stats.modules_cached = 0;
+    for (int i = 0; i < l->count; ++i) {
+      stats.read_time += l->modules[i]->read_time;
+      stats.tokenize_time += l->modules[i]->tokenize_time;
+      stats.compile_time += l->modules[i]->compile_time;
+      stats.tokens_bytes += l->modules[i]->tokens_bytes;
+      stats.modules_cached += l->modules[i]->cached;
+    }
+    // NOTE: the layout without a profile is the one --profile records, so it comes first. A lazy program has
+    // none, the blocks it compiles late go in the order they are reached
+    if (use_layout && !vm.lazy && program_layout(&vm, NULL) && profile_use_path) {
+      Profile *profile;
+      result = profile_read(profile_use_path, &vm, &profile);
+      if (profile)
+        program_layout(&vm, profile);
+      free(profile);
+    }
+    if (profile_path)
+      vm.profile = profile_create(&vm);
+    if (interpreter == INTERPRETER_TRACED)
+      vm_dump(&vm);
+    vm.program_size = vm.ip;
+    stats.program_bytes = vm.program_size;
+    stats.data_bytes = vm.data_offset;
+    // NOTE: copies of the vm share it, only --watch frees it when building the program again
+    if (use_registers)
+      vm.regs = regs_translate(&vm);
+    vm_reset(&vm);
+  }
+  return result;
+}
 
-    case TOK_FLOAT: {
-      float f = strtof(token->source.data, NULL);
-      vm_push_instr(INSTR_FLOAT, (Word){.float_=f});
-    } break;
+void module_loader_free(ModuleLoader *l) {
+  for (int i = 0; i < l->count; ++i)
+    module_free(l->modules[i]);
+  pthread_mutex_destroy(&l->lock);
+  pthread_cond_destroy(&l->cond);
+  free(l);
+}
 
-    case TOK_STR: {
-      SV string = {(char *)token->source.data, token->source.len};
-      vm_push_instr(INSTR_STRING, (Word){.word=(word_t)&string});
-    } break;
+// Runs the program, then again every time one of its files changes. The modules that did not change stay loaded
+// and are relinked with the ones loaded again, which only lex the lines that changed (see tokenize_edit).
+// NOTE: the unit rebuilt is the module, not the edit: a changed module is compiled whole, and the whole program is
+// linked and laid out again, so a program in one large file is compiled again whole on every save
+bool watch_program(const char *filename, StatsFormat stats_format) {
+#ifdef __linux__
+  ModuleLoader *l = module_loader_create(filename);
+  if (l == NULL)
+    return false;
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Error: could not watch the sources: %s\n", strerror(errno));
+    module_loader_free(l);
+    return false;
+  }
 
-  case TOK_LABEL: {
-    SV label_name = sva(token->source); // skip '
-    vm_push_instr(INSTR_LABEL, (Word){.word=(word_t)&label_name});
-  } break;
+  bool run = module_loader_run(l) && program_build(l); // the program was built and has not run since
+  int watched = 0;                                     // modules whose directory is watched
+  while (true) {
+    if (run) {
+      run = false;
+      double start = now_seconds();
+      vm_finish(&vm); // a failed run reported its error, the next save builds the program again
+      stats.run_time = now_seconds() - start;
+      fflush(stdout);
+      if (stats_format != STATS_OFF) {
+        stats_collect(&vm, &stats);
+        stats_print(&stats, stats_format);
+      }
+    }
 
-  case TOK_LABEL_ADDR: {
-    SV label_name = sva(token->source); // skip &
-    // NOTE: INSTR_LABEL_ADDR pushes intstruction and reserves the next word for operand to be back-patched later
-    unresolved_labels[ulc++] = (Label){label_name, vm.ip+1};
-    vm_push_instr(INSTR_LABEL_ADDR, word0);
-    assert(ulc < LABELS_CAPACITY);
-  } break;
+    // NOTE: directories are watched instead of files, editors save by renaming a new file over the old one
+    for (; watched < l->count; ++watched) {
+      char dir[PATH_MAX];
+      snprintf(dir, sizeof(dir), "%s", l->modules[watched]->path);
+      char *slash = strrchr(dir, '/');
+      slash[slash == dir] = '\0';
+      if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+        fprintf(stderr, "Warning: could not watch %s: %s\n", dir, strerror(errno));
+    }
 
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      fprintf(stderr, "Error: could not watch the sources: %s\n", strerror(errno));
+      break;
+    }
+    _Alignas(struct inotify_event) char events[4096];
+    do {
+      while (read(fd, events, sizeof(events)) > 0)
+        ;
+    } while (poll(&pfd, 1, WATCH_SETTLE_MS) > 0);
 
-    case TOK_PLUS:      vm_push_instr(INSTR_ADD, word0); break;
-    case TOK_MINUS:     vm_push_instr(INSTR_SUB, word0); break;
-    case TOK_STAR:      vm_push_instr(INSTR_MUL, word0); break;
-    case TOK_SLASH:     vm_push_instr(INSTR_DIV, word0); break;
-    case TOK_MOD:       vm_push_instr(INSTR_MOD, word0); break;
-    case TOK_PLUS_DOT:  vm_push_instr(INSTR_ADDF, word0); break;
-    case TOK_MINUS_DOT: vm_push_instr(INSTR_SUBF, word0); break;
-    case TOK_STAR_DOT:  vm_push_instr(INSTR_MULF, word0); break;
-    case TOK_SLASH_DOT: vm_push_instr(INSTR_DIVF, word0); break;
-    case TOK_EQ:        vm_push_instr(INSTR_EQ, word0); break;
-    case TOK_NEQ:       vm_push_instr(INSTR_NEQ, word0); break;
-    case TOK_LT:        vm_push_instr(INSTR_LT, word0); break;
-    case TOK_LE:        vm_push_instr(INSTR_LE, word0); break;
-    case TOK_GT:        vm_push_instr(INSTR_GT, word0); break;
-    case TOK_GE:        vm_push_instr(INSTR_GE, word0); break;
-    case TOK_DUP:       vm_push_instr(INSTR_DUP, word0); break;
-    case TOK_DOT:       vm_push_instr(INSTR_DUMP, word0); break;
-    case TOK_OVER:      vm_push_instr(INSTR_OVER, word0); break;
-    case TOK_SWAP:      vm_push_instr(INSTR_SWAP, word0); break;
-    case TOK_DROP:      vm_push_instr(INSTR_DROP, word0); break;
-    case TOK_ROT:       vm_push_instr(INSTR_ROT, word0); break;
-    case TOK_JMP:       vm_push_instr(INSTR_JMP, word0); break;
-    case TOK_JZ:        vm_push_instr(INSTR_JZ, word0); break;
-    case TOK_JNZ:       vm_push_instr(INSTR_JNZ, word0); break;
-    default:
-      assert(0 && "unreachable");
+    // NOTE: modules are loaded on this thread, the ones newly included are queued and loaded by the same loop
+    double start = now_seconds();
+    int reloaded = 0, tokens_count = 0, tokens_reused = 0;
+    l->failed = false;
+    for (int i = 0; i < l->count; ++i) {
+      Module *m = l->modules[i];
+      struct stat st;
+      if (m->loaded && stat(m->path, &st) == 0 && st.st_size == m->source_size &&
+          st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec == m->source_mtime)
+        continue;
+      module_unload(m);
+      bool ok = module_load(m, l->compiler_mtime);
+      for (int j = 0; ok && j < m->relocs_count; ++j) {
+        if (m->relocs[j].kind == RELOC_INCLUDE)
+          ok = module_loader_add(l, m->relocs[j].name.data) != NULL;
+      }
+      m->loaded = ok;
+      l->failed = l->failed || !ok;
+      reloaded += 1;
+      tokens_count += m->tokens_lexed + m->tokens_reused;
+      tokens_reused += m->tokens_reused;
     }
-    // clang-format off
+    l->next = l->count;
+    // NOTE: another file of a watched directory changed, the program is left as it is
+    if (reloaded == 0)
+      continue;
+
+    if (!l->failed) {
+      // NOTE: the register program and the strings belong to the program being replaced
+      regs_free((RegProgram *)vm.regs);
+      vm.regs = NULL;
+      arena_destroy(&vm.strings);
+      run = program_build(l);
+    }
+    fprintf(stderr, "watch: loaded %d of %d modules again in %.2f ms, %d of %d tokens reused\n", reloaded,
+            l->count, (now_seconds() - start) * 1000, tokens_reused, tokens_count);
   }
-  vm_push_instr(INSTR_DONE, word0);
 
-  // Second pass: labels resolution
-  for (int i = 0; i < ulc; ++i) {
-    int addr = compiler_get_label_addr(unresolved_labels[i].name);
-    if (addr < 0)
-      return false; // TODO: compiler error
-    vm.program[unresolved_labels[i].addr] = (Word){.integer = addr};
+  close(fd);
+  module_loader_free(l);
+  return false;
+#else
+  (void)filename;
+  (void)stats_format;
+  fprintf(stderr, "Error: --watch needs inotify, which this platform does not have\n");
+  return false;
+#endif
+}
+
+// The stats of a run, from the vm that ran it
+void stats_collect(const VM *vm, Stats *stats) {
+  stats->instructions = vm->instr_count;
+  stats->max_sp = vm_max_sp(vm);
+  stats->strings_bytes = arena_used(&vm->strings);
+  stats->strings_chunks = arena_chunks(&vm->strings);
+  stats->input_bytes = vm->input ? vm->input->len : 0;
+  stats->input_records = vm->input_records;
+  if (vm->lazy) {
+    stats->lazy_blocks = vm->lazy->blocks_count;
+    stats->lazy_compiled = vm->lazy->compiled;
+    stats->lazy_time = vm->lazy->compile_time;
+  }
+  // NOTE: ru_maxrss carries the peak of the process from before its exec, which is the shell that forked it; Linux
+  // has the peak of the program itself as VmHWM
+  stats->max_rss = 0;
+  FILE *status = fopen("/proc/self/status", "r");
+  if (status) {
+    char line[256];
+    while (fgets(line, sizeof(line), status) && sscanf(line, "VmHWM: %ld", &stats->max_rss) != 1)
+      ;
+    fclose(status);
   }
+  struct rusage usage;
+  if (stats->max_rss == 0 && getrusage(RUSAGE_SELF, &usage) == 0)
+    stats->max_rss = usage.ru_maxrss;
+}
+
+int arena_used(const Arena *a) {
+  int used = 0;
+  for (const ArenaChunk *chunk = a->chunk; chunk; chunk = chunk->next)
+    used += chunk->offset;
+  return used;
+}
+
+int arena_chunks(const Arena *a) {
+  int count = 0;
+  for (const ArenaChunk *chunk = a->chunk; chunk; chunk = chunk->next)
+    count += 1;
+  return count;
+}
 
+// Starts hardware counters for this thread; false when perf_event_open is unavailable or not permitted
+bool counters_open(int *fds) {
+#ifdef __linux__
+  static const uint64_t configs[COUNTER_COUNT] = {
+      [COUNTER_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+      [COUNTER_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+      [COUNTER_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+      [COUNTER_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+  };
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = configs[i],
+        .disabled = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fds[i] < 0) {
+      while (i-- > 0)
+        close(fds[i]);
+      return false;
+    }
+  }
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
   return true;
+#else
+  (void)fds;
+  return false;
+#endif
+}
+
+void counters_close(int *fds, Stats *stats) {
+#ifdef __linux__
+  for (int i = 0; i < COUNTER_COUNT; ++i)
+    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+  stats->counters_available = true;
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    if (read(fds[i], &stats->counters[i], sizeof(stats->counters[i])) != sizeof(stats->counters[i]))
+      stats->counters_available = false;
+    close(fds[i]);
+  }
+#else
+  (void)fds;
+  (void)stats;
+#endif
+}
+
+void stats_print(const Stats *stats, StatsFormat format) {
+  double ips = stats->run_time > 0 ? stats->instructions / stats->run_time : 0;
+  double rps = stats->run_time > 0 ? stats->input_records / stats->run_time : 0;
+  const char *counter_names[COUNTER_COUNT] = {
+      [COUNTER_CYCLES] = "cycles",
+      [COUNTER_INSTRUCTIONS] = "instructions",
+      [COUNTER_BRANCH_MISSES] = "branch_misses",
+      [COUNTER_CACHE_MISSES] = "cache_misses",
+  };
+
+  static_assert(STATS_COUNT == 3, "Update StatsFormat is required");
+  if (format == STATS_JSON) {
+    fprintf(stderr, "{\"phases\": {\"read_entire_file\": %.9f, \"tokenize\": %.9f, \"compile\": %.9f, \"vm_run\": %.9f}, ",
+            stats->read_time, stats->tokenize_time, stats->compile_time, stats->run_time);
+    fprintf(stderr, "\"startup\": %.9f, ", stats->startup_time);
+    fprintf(stderr, "\"instructions\": %ld, \"instructions_per_second\": %.0f, \"max_sp\": %d, ",
+            stats->instructions, ips, stats->max_sp);
+    fprintf(stderr, "\"program_bytes\": %d, \"token_arena_bytes\": %d, \"data_bytes\": %d, ",
+            stats->program_bytes, stats->tokens_bytes, stats->data_bytes);
+    fprintf(stderr, "\"strings_bytes\": %d, \"strings_chunks\": %d, ", stats->strings_bytes, stats->strings_chunks);
+    fprintf(stderr, "\"input_bytes\": %ld, \"input_records\": %ld, \"records_per_second\": %.0f, ",
+            stats->input_bytes, stats->input_records, rps);
+    fprintf(stderr, "\"lazy_blocks\": %d, \"lazy_blocks_compiled\": %d, \"lazy_compile\": %.9f, \"max_rss_kb\": %ld, ",
+            stats->lazy_blocks, stats->lazy_compiled, stats->lazy_time, stats->max_rss);
+    fprintf(stderr, "\"modules\": %d, \"modules_cached\": %d, \"counters\": ", stats->modules, stats->modules_cached);
+    if (stats->counters_available) {
+      fprintf(stderr, "{");
+      for (int i = 0; i < COUNTER_COUNT; ++i)
+        fprintf(stderr, "%s\"%s\": %llu", i > 0 ? ", " : "", counter_names[i], (unsigned long long)stats->counters[i]);
+      fprintf(stderr, "}}\n");
+    } else {
+      fprintf(stderr, "null}\n");
+    }
+    return;
+  }
+
+  fprintf(stderr, "stats:\n");
+  fprintf(stderr, "  read_entire_file: %12.6f ms\n", stats->read_time * 1e3);
+  fprintf(stderr, "  tokenize:         %12.6f ms\n", stats->tokenize_time * 1e3);
+  fprintf(stderr, "  compile:          %12.6f ms\n", stats->compile_time * 1e3);
+  fprintf(stderr, "  startup:          %12.6f ms (to the first instruction)\n", stats->startup_time * 1e3);
+  fprintf(stderr, "  vm_run:           %12.6f ms\n", stats->run_time * 1e3);
+  fprintf(stderr, "  instructions:     %12ld (%.0f instr/s)\n", stats->instructions, ips);
+  fprintf(stderr, "  max sp:           %12d\n", stats->max_sp);
+  fprintf(stderr, "  program:          %12d bytes\n", stats->program_bytes);
+  fprintf(stderr, "  token arena:      %12d bytes\n", stats->tokens_bytes);
+  fprintf(stderr, "  data:             %12d bytes\n", stats->data_bytes);
+  fprintf(stderr, "  strings:          %12d bytes (%d chunks)\n", stats->strings_bytes, stats->strings_chunks);
+  fprintf(stderr, "  input:            %12ld bytes (%ld records, %.0f records/s)\n", stats->input_bytes,
+          stats->input_records, rps);
+  fprintf(stderr, "  modules:          %12d (%d cached)\n", stats->modules, stats->modules_cached);
+  fprintf(stderr, "  lazy blocks:      %12d (%d compiled in %.6f ms)\n", stats->lazy_blocks, stats->lazy_compiled,
+          stats->lazy_time * 1e3);
+  fprintf(stderr, "  max rss:          %12ld kB\n", stats->max_rss);
+  if (!stats->counters_available) {
+    fprintf(stderr, "  hardware counters: unavailable\n");
+    return;
+  }
+  for (int i = 0; i < COUNTER_COUNT; ++i)
+    fprintf(stderr, "  %-17s %12llu\n", counter_names[i], (unsigned long long)stats->counters[i]);
 }
 
 int get_file_size(const char *filename) {
@@ -1117,30 +6559,273 @@ SV sv_chop(SV *sv, SV delim) {
   return result;
 }
 
+void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [options] <source.step> [<source.step> ...]\n", program);
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --threads <n>           run the programs as green threads on n worker threads (default: cores)\n");
+  fprintf(stderr, "  --copies <n>            spawn n instances of every program on the scheduler\n");
+  fprintf(stderr, "  --budget <n>            instructions per scheduler time slice (default %d)\n", SCHED_DEFAULT_BUDGET);
+  fprintf(stderr, "  --inline-threshold <n>  inline definitions of up to n tokens (default %d, 0 disables)\n", INLINE_THRESHOLD);
+  fprintf(stderr, "  --jobs <n>              compile included modules on n threads (default: cores)\n");
+  fprintf(stderr, "  --module-cache <dir>    keep compiled modules in dir and reuse them until their source changes\n");
+  fprintf(stderr, "  --no-module-cache       compile every module from source (default)\n");
+  fprintf(stderr, "  --watch                 run the program again whenever one of its files changes\n");
+  fprintf(stderr, "  --interpreter <kind>    fast (no checks), checked (default) or traced (prints every instruction)\n");
+  fprintf(stderr, "  --registers             run the program translated to register code\n");
+  fprintf(stderr, "  --no-layout             keep the blocks of the program as written, unreachable ones included\n");
+  fprintf(stderr, "  --lazy                  compile the labeled blocks of the program the first time they run\n");
+  fprintf(stderr, "  --profile <file>        count executed instructions and taken jumps, written to file on exit\n");
+  fprintf(stderr, "  --profile-use <file>    lay the hottest path of the program out straight from a --profile run\n");
+  fprintf(stderr, "  --stats                 report timings, instruction counts and memory usage on exit\n");
+  fprintf(stderr, "  --stats-json            same as --stats, as JSON\n");
+  fprintf(stderr, "  --requests <n>          run the part after `snapshot` n times, the prelude once\n");
+  fprintf(stderr, "  --request-mode <mode>   restore (default), fork or cold (rerun the prelude every time)\n");
+  fprintf(stderr, "  --trace <file>          record executed instructions, written to file on exit or crash\n");
+  fprintf(stderr, "  --trace-records <n>     ring buffer size per VM, a power of 2 (default %d)\n", TRACE_DEFAULT_RECORDS);
+  fprintf(stderr, "  --decode-trace <file>   print a recorded trace and exit\n");
+  fprintf(stderr, "  --par-threads <n>       run par loops on n threads (default: cores)\n");
+  fprintf(stderr, "  --input <file>          what read-int, read-float and read-line parse (default: stdin)\n");
+  fprintf(stderr, "  --batch <file>          run the program once per 4-byte record of file, seeded on the stack\n");
+  fprintf(stderr, "  --batch-type int|float  type of the input records (default int)\n");
+  fprintf(stderr, "  --batch-out <file>      write the top of every run's stack as a column (default: print)\n");
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <source.step>\n", argv[0]);
-    return 1;
+  int threads = 0, copies = 0;
+  long budget = SCHED_DEFAULT_BUDGET;
+  const char *trace_path = NULL;
+  int trace_records = TRACE_DEFAULT_RECORDS;
+  const char *batch_path = NULL, *batch_out = NULL;
+  ValueType batch_type = VAL_INT;
+  StatsFormat stats_format = STATS_OFF;
+  int requests = 0;
+  RequestMode request_mode = REQUEST_RESTORE;
+  int files_start = 1;
+  natives_init();
+  for (; files_start < argc && strncmp(argv[files_start], "--", 2) == 0; ++files_start) {
+    const char *flag = argv[files_start];
+    if (strcmp(flag, "--stats") == 0) {
+      stats_format = STATS_TEXT;
+      continue;
+    }
+    if (strcmp(flag, "--stats-json") == 0) {
+      stats_format = STATS_JSON;
+      continue;
+    }
+    if (strcmp(flag, "--no-module-cache") == 0) {
+      module_cache_dir = NULL;
+      continue;
+    }
+    if (strcmp(flag, "--registers") == 0) {
+      use_registers = true;
+      continue;
+    }
+    if (strcmp(flag, "--no-layout") == 0) {
+      use_layout = false;
+      continue;
+    }
+    if (strcmp(flag, "--watch") == 0) {
+      watching = true;
+      continue;
+    }
+    if (strcmp(flag, "--lazy") == 0) {
+      lazy_blocks = true;
+      continue;
+    }
+
+    if (files_start + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    const char *value = argv[++files_start];
+    if (strcmp(flag, "--threads") == 0) {
+      threads = atoi(value);
+    } else if (strcmp(flag, "--copies") == 0) {
+      copies = atoi(value);
+    } else if (strcmp(flag, "--budget") == 0) {
+      budget = atol(value);
+    } else if (strcmp(flag, "--inline-threshold") == 0) {
+      inline_threshold = atoi(value);
+    } else if (strcmp(flag, "--jobs") == 0) {
+      module_jobs = atoi(value);
+    } else if (strcmp(flag, "--module-cache") == 0) {
+      module_cache_dir = value;
+    } else if (strcmp(flag, "--trace") == 0) {
+      trace_path = value;
+    } else if (strcmp(flag, "--interpreter") == 0) {
+      if (strcmp(value, "fast") == 0) {
+        interpreter = INTERPRETER_FAST;
+      } else if (strcmp(value, "checked") == 0) {
+        interpreter = INTERPRETER_CHECKED;
+      } else if (strcmp(value, "traced") == 0) {
+        interpreter = INTERPRETER_TRACED;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(flag, "--profile") == 0) {
+      profile_path = value;
+    } else if (strcmp(flag, "--profile-use") == 0) {
+      profile_use_path = value;
+    } else if (strcmp(flag, "--trace-records") == 0) {
+      trace_records = atoi(value);
+    } else if (strcmp(flag, "--requests") == 0) {
+      requests = atoi(value);
+    } else if (strcmp(flag, "--request-mode") == 0) {
+      if (strcmp(value, "cold") == 0) {
+        request_mode = REQUEST_COLD;
+      } else if (strcmp(value, "restore") == 0) {
+        request_mode = REQUEST_RESTORE;
+      } else if (strcmp(value, "fork") == 0) {
+        request_mode = REQUEST_FORK;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(flag, "--par-threads") == 0) {
+      par_threads = atoi(value);
+    } else if (strcmp(flag, "--input") == 0) {
+      input_path = value;
+    } else if (strcmp(flag, "--batch") == 0) {
+      batch_path = value;
+    } else if (strcmp(flag, "--batch-out") == 0) {
+      batch_out = value;
+    } else if (strcmp(flag, "--batch-type") == 0) {
+      if (strcmp(value, "int") == 0) {
+        batch_type = VAL_INT;
+      } else if (strcmp(value, "float") == 0) {
+        batch_type = VAL_FLOAT;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(flag, "--decode-trace") == 0) {
+      return trace_decode(value) ? 0 : 1;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
   }
 
-  char *source_filename = argv[1];
-  int source_file_size = get_file_size(source_filename);
-  if (source_file_size < 0)
+  int files_count = argc - files_start;
+  bool trace_records_valid = trace_records > 0 && (trace_records & (trace_records - 1)) == 0;
+  if (files_count < 1 || threads < 0 || copies < 0 || module_jobs < 0 || budget <= 0 || requests < 0 ||
+      par_threads < 0 || !trace_records_valid) {
+    usage(argv[0]);
     return 1;
-
-  Arena source_arena = arena_create(source_file_size + 1);
-  if (!read_entire_file(source_filename, &source_arena))
+  }
+  // NOTE: the profile is not shared between threads, only a single program run directly records one
+  bool direct = files_count == 1 && threads == 0 && copies == 0 && requests == 0 && batch_path == NULL;
+  if (profile_path && !direct) {
+    fprintf(stderr, "Error: --profile records a single program run without --threads, --copies, --requests or --batch\n");
     return 1;
-
-  tokens_init();
-
-  if (!tokenize(source_arena.chunk->mem, source_filename))
+  }
+  if (lazy_blocks && (batch_path || watching)) {
+    fprintf(stderr, "Error: --lazy compiles blocks into the vm running them, not with --batch or --watch\n");
     return 1;
-  if (!compile())
+  }
+  if (requests > 0 && files_count != 1) {
+    fprintf(stderr, "Error: --requests serves a single program\n");
+    return 1;
+  }
+  if (watching && (!direct || trace_path || profile_path)) {
+    fprintf(stderr, "Error: --watch reruns a single program without --threads, --copies, --requests, --batch, "
+                    "--trace or --profile\n");
     return 1;
-  vm_run();
+  }
 
-  tokens_free();
+  // NOTE: a file given for the input is opened right away to report a bad path, stdin only when read
+  if (input_path) {
+    pthread_once(&input_once, input_open);
+    if (input_failed)
+      return 1;
+  }
 
-  return 0;
+  if (requests > 0) {
+    bool ok = serve_requests(argv[files_start], requests, request_mode, stats_format);
+    return ok ? 0 : 1;
+  }
+
+  if (batch_path) {
+    if (files_count != 1 || !load_program(argv[files_start]))
+      return 1;
+    bool ok = batch_run(&vm, batch_path, batch_type, batch_out);
+    return ok ? 0 : 1;
+  }
+
+  if (watching)
+    return watch_program(argv[files_start], stats_format) ? 0 : 1;
+
+  if (files_count == 1 && threads == 0 && copies == 0) {
+    double load_start = now_seconds();
+    if (!load_program(argv[files_start]))
+      return 1;
+    if (trace_path) {
+      traces_init(1, trace_records, trace_path);
+      trace_attach(&vm, argv[files_start]);
+    }
+    int counters[COUNTER_COUNT];
+    bool counting = stats_format != STATS_OFF && counters_open(counters);
+    double start = now_seconds();
+    stats.startup_time = start - load_start;
+    bool ok = vm_finish(&vm);
+    stats.run_time = now_seconds() - start;
+    if (counting)
+      counters_close(counters, &stats);
+    traces_dump();
+    if (vm.profile && !profile_write(vm.profile, profile_path))
+      return 1;
+
+    if (stats_format != STATS_OFF) {
+      stats_collect(&vm, &stats);
+      stats_print(&stats, stats_format);
+    }
+    return ok ? 0 : 1;
+  }
+
+  if (threads == 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (copies == 0)
+    copies = 1;
+
+  Scheduler sched = {
+      .workers_count = threads,
+      .tasks_count = files_count * copies,
+      .budget = budget,
+  };
+  sched.workers = calloc(sched.workers_count, sizeof(Worker));
+  sched.tasks = calloc(sched.tasks_count, sizeof(Task));
+  VM *vms = malloc(sched.tasks_count * sizeof(VM));
+  if (sched.workers == NULL || sched.tasks == NULL || vms == NULL) {
+    fprintf(stderr, "Error: memory issue...");
+    abort();
+  }
+
+  if (trace_path)
+    traces_init(sched.tasks_count, trace_records, trace_path);
+
+  for (int i = 0; i < files_count; ++i) {
+    if (!load_program(argv[files_start + i]))
+      return 1;
+    for (int j = 0; j < copies; ++j) {
+      int k = i * copies + j;
+      vms[k] = vm;
+      sched.tasks[k] = (Task){.vm = &vms[k], .name = argv[files_start + i]};
+      if (trace_path)
+        trace_attach(&vms[k], argv[files_start + i]);
+    }
+  }
+
+  scheduler_run(&sched);
+  scheduler_report(&sched);
+  traces_dump();
+  bool ok = true;
+  for (int i = 0; i < sched.tasks_count; ++i)
+    ok = ok && !sched.tasks[i].failed;
+
+  free(vms);
+  free(sched.tasks);
+  free(sched.workers);
+
+  return ok ? 0 : 1;
 }